@@ -20,6 +20,7 @@ import java.io.FileDescriptor;
 import java.io.FileInputStream;
 import java.io.FileOutputStream;
 import java.io.IOException;
+import java.util.Arrays;
 
 import android.app.Activity;
 import android.app.PendingIntent;
@@ -40,6 +41,7 @@ import android.view.Menu;
 import android.view.View;
 import android.view.View.OnClickListener;
 import android.widget.Button;
+import android.widget.CheckBox;
 import android.widget.EditText;
 import android.widget.TextView;
 import android.widget.Toast;
@@ -75,8 +77,34 @@ public class MainActivity extends Activity {
 	private TextView mTextReceivedText;
 	private TextView mTextAccessoryState;
 
+	private EditText mEditTextChannel;
+	private CheckBox mCheckBoxMultiplexed;
+
 	private long mElapsedTime;
 
+	// multiplexed link, the frames of src/mux.h on the host side, when the host runs with --channel. It is
+	// chosen with the checkbox at open, otherwise the data is plain uart data as always.
+	private static final int MUX_VERSION = 1;
+	private static final int MUX_HEADER_SIZE = 4;
+	private static final int MUX_CONTROL_CHANNEL = 0;
+	private static final int MUX_FRAME_DATA = 0;
+	private static final int MUX_FRAME_CREDIT = 1;
+	private static final int MUX_FRAME_HELLO = 2;
+	private static final int MUX_FRAME_RESET = 3;
+	private static final int MUX_WINDOW = 65536;
+
+	private boolean mMultiplexed;
+	private final long[] mTxCredit = new long[256];
+	private final int[] mRxConsumed = new int[256];
+	private final boolean[] mRxGranted = new boolean[256];
+
+	// frame parser, used by the read thread only
+	private final byte[] mFrameHeader = new byte[MUX_HEADER_SIZE];
+	private int mFrameHeaderFill;
+	private int mFrameRemaining;
+	private final byte[] mFrameControl = new byte[8];
+	private int mFrameControlFill;
+
 	@Override
 	protected void onCreate(Bundle savedInstanceState) {
 		super.onCreate(savedInstanceState);
@@ -98,6 +126,8 @@ public class MainActivity extends Activity {
 		mTextElapsedTime = (TextView) findViewById(R.id.textElapsedTime);
 		mTextReceivedText = (TextView) findViewById(R.id.textReceivedText);
 		mTextAccessoryState = (TextView) findViewById(R.id.textAccessoryState);
+		mEditTextChannel = (EditText) findViewById(R.id.editTextChannel);
+		mCheckBoxMultiplexed = (CheckBox) findViewById(R.id.checkBoxMultiplexed);
 
 		// implement button click listener
 		OnClickListener buttonClickListener = new OnClickListener() {
@@ -235,8 +265,14 @@ public class MainActivity extends Activity {
 				FileDescriptor fd = mFileDescriptor.getFileDescriptor();
 				mInputStream = new FileInputStream(fd);
 				mOutputStream = new FileOutputStream(fd);
+				mMultiplexed = mCheckBoxMultiplexed.isChecked();
+				mFrameHeaderFill = 0;
 				accessoryReadThread.start();
 				setState(State.OPEN);
+				// the HELLO of the host session may have gone to a previous instance: ask for a new one at once
+				// rather than waiting for the host to repeat it
+				if (mMultiplexed)
+					writeFrame(MUX_CONTROL_CHANNEL, MUX_FRAME_RESET, new byte[0], 0, 0);
 			} else {
 				throw new IOException("Failed to open file descriptor");
 			}
@@ -271,7 +307,10 @@ public class MainActivity extends Activity {
 			try {
 				if (!mEditTextToSend.getText().toString().equals("")) {
 					mTextReceivedText.setText("");
-					mOutputStream.write(mEditTextToSend.getText().toString().getBytes());
+					if (mMultiplexed)
+						sendOnChannel(mEditTextToSend.getText().toString().getBytes());
+					else
+						mOutputStream.write(mEditTextToSend.getText().toString().getBytes());
 				}
 				Log.d(TAG, "sending data OK");
 			} catch (IOException e) {
@@ -281,6 +320,134 @@ public class MainActivity extends Activity {
 		}
 	}
 
+	/**
+	 * send data on the selected channel, as much as the credit granted by the host allows
+	 */
+	private synchronized void sendOnChannel(byte[] data) {
+		int channel;
+		try {
+			channel = Integer.parseInt(mEditTextChannel.getText().toString());
+		} catch (NumberFormatException e) {
+			channel = -1;
+		}
+		if (channel < 1 || channel > 255) {
+			Toast.makeText(this, "Invalid channel", Toast.LENGTH_LONG).show();
+			return;
+		}
+
+		int length = (int) Math.min(data.length, mTxCredit[channel]);
+		if (length < data.length)
+			Toast.makeText(this, String.format("Channel %d busy, sent %d of %d bytes", channel, length, data.length), Toast.LENGTH_LONG).show();
+		for (int offset = 0; offset < length;) {
+			int count = Math.min(length - offset, ACCESSORY_MODE_BUFFER_SIZE - MUX_HEADER_SIZE);
+			writeFrame(channel, MUX_FRAME_DATA, data, offset, count);
+			offset += count;
+		}
+		mTxCredit[channel] -= length;
+	}
+
+	private synchronized void writeFrame(int channel, int type, byte[] payload, int offset, int length) {
+		byte[] frame = new byte[MUX_HEADER_SIZE + length];
+		frame[0] = (byte) channel;
+		frame[1] = (byte) type;
+		frame[2] = (byte) (length >> 8);
+		frame[3] = (byte) length;
+		System.arraycopy(payload, offset, frame, MUX_HEADER_SIZE, length);
+		try {
+			mOutputStream.write(frame);
+		} catch (IOException e) {
+			Log.e(TAG, "Failed to send frame", e);
+		}
+	}
+
+	private void writeCredit(int channel, int credit) {
+		byte[] payload = { (byte) (credit >> 24), (byte) (credit >> 16), (byte) (credit >> 8), (byte) credit };
+		writeFrame(channel, MUX_FRAME_CREDIT, payload, 0, payload.length);
+	}
+
+	/**
+	 * a new host session: channel state starts over, the answer makes the host accept our credits
+	 */
+	private synchronized void muxHello(byte sequence) {
+		Arrays.fill(mTxCredit, 0);
+		Arrays.fill(mRxConsumed, 0);
+		Arrays.fill(mRxGranted, false);
+		writeFrame(MUX_CONTROL_CHANNEL, MUX_FRAME_HELLO, new byte[] { MUX_VERSION, sequence }, 0, 2);
+	}
+
+	private synchronized void muxCredit(int channel, long credit) {
+		mTxCredit[channel] += credit;
+		// the host grants credit on each of its channels at start, so the first grant tells the channel exists
+		if (!mRxGranted[channel]) {
+			mRxGranted[channel] = true;
+			writeCredit(channel, MUX_WINDOW);
+		}
+	}
+
+	/**
+	 * received data is shown at once, the credit is given back in quarters of the window
+	 */
+	private synchronized void muxConsumed(int channel, int count) {
+		mRxConsumed[channel] += count;
+		if (mRxConsumed[channel] >= MUX_WINDOW / 4) {
+			writeCredit(channel, mRxConsumed[channel]);
+			mRxConsumed[channel] = 0;
+		}
+	}
+
+	/**
+	 * split the frames of a multiplexed link, they may span several reads
+	 */
+	private void demultiplex(byte[] buffer, int size) {
+		int offset = 0;
+
+		while (offset < size) {
+			if (mFrameHeaderFill < MUX_HEADER_SIZE) {
+				mFrameHeader[mFrameHeaderFill++] = buffer[offset++];
+				if (mFrameHeaderFill == MUX_HEADER_SIZE) {
+					mFrameRemaining = (mFrameHeader[2] & 0xff) << 8 | (mFrameHeader[3] & 0xff);
+					mFrameControlFill = 0;
+					if (mFrameRemaining == 0)
+						frameEnd();
+				}
+				continue;
+			}
+
+			int channel = mFrameHeader[0] & 0xff;
+			int count = Math.min(size - offset, mFrameRemaining);
+			if (mFrameHeader[1] == MUX_FRAME_DATA) {
+				Message m = Message.obtain(mHandler, MESSAGE_READ_DATA);
+				m.obj = "[" + channel + "] " + new String(buffer, offset, count);
+				mHandler.sendMessage(m);
+				muxConsumed(channel, count);
+			} else {
+				int copy = Math.min(count, mFrameControl.length - mFrameControlFill);
+				System.arraycopy(buffer, offset, mFrameControl, mFrameControlFill, copy);
+				mFrameControlFill += copy;
+			}
+			offset += count;
+			mFrameRemaining -= count;
+			if (mFrameRemaining == 0)
+				frameEnd();
+		}
+	}
+
+	private void frameEnd() {
+		int channel = mFrameHeader[0] & 0xff;
+
+		mFrameHeaderFill = 0;
+		switch (mFrameHeader[1]) {
+			case MUX_FRAME_HELLO:
+				if (mFrameControlFill == 2)
+					muxHello(mFrameControl[1]);
+				break;
+			case MUX_FRAME_CREDIT:
+				if (mFrameControlFill == 4)
+					muxCredit(channel, (mFrameControl[0] & 0xffL) << 24 | (mFrameControl[1] & 0xff) << 16 | (mFrameControl[2] & 0xff) << 8 | (mFrameControl[3] & 0xff));
+				break;
+		}
+	}
+
 	private static final int ACCESSORY_MODE_BUFFER_SIZE = 16384;
 
 	Thread accessoryReadThread = new Thread() {
@@ -295,7 +462,9 @@ public class MainActivity extends Activity {
 					int ret = mInputStream.read(buffer);
 					if (ret < 0)
 						break;
-					if (ret > 0) {
+					if (ret > 0 && mMultiplexed) {
+						demultiplex(buffer, ret);
+					} else if (ret > 0) {
 						Log.d(TAG, "accessory read read " + String.valueOf(ret) + " chars");
 						if (buffer.toString().equals("quit"))
 							break;
@@ -24,16 +24,25 @@
 #include "accessory.h"
 
 #include <libusb.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
+#include "evloop.h"
+#include "probe_cache.h"
 #include "usb_ch9.h"
 
 #define USB_ACCESSORY_VENDOR_ID 		0x18D1
 #define USB_ACCESSORY_PRODUCT_ID 		0x2D00
 #define USB_ACCESSORY_ADB_PRODUCT_ID	0x2D01
+#define USB_ACCESSORY_AUDIO_PRODUCT_ID	0x2D04
+#define USB_ACCESSORY_AUDIO_ADB_PRODUCT_ID	0x2D05
 
 #define ACCESSORY_STRING_MANUFACTURER	0
 #define ACCESSORY_STRING_MODEL			1
@@ -41,6 +50,7 @@
 #define ACCESSORY_STRING_VERSION		3
 #define ACCESSORY_STRING_URI			4
 #define ACCESSORY_STRING_SERIAL		5
+#define ACCESSORY_STRINGS				6
 
 #define ACCESSORY_GET_PROTOCOL			51
 #define ACCESSORY_SEND_STRING			52
@@ -62,16 +72,143 @@
 #define FDTI_ID						0x0403
 #define VMWARE_ID						0x0E0F
 
-#define CONNECT_TRIES					15
-#define CONNECT_TRIES_MS_DELAY			1000
+#define SWITCH_TIMEOUT_MS				15000
+#define SWITCH_RETRY_MS				50
+#define CONTROL_TIMEOUT_MS				1000
 
 #define LIBUSB_VERBOSE_LEVEL			0
 
-static int accessory_setup(accessory_device *ad);
+#define TX_TIMEOUT						1000
+#define HID_TIMEOUT					1000
+#define AUDIO_MODE_PCM_16BIT_44100		1
+#define UEVENT_BUFFER_SIZE				8192
+#define STOP_TIMEOUT_MS				2000
+#define PROBE_RETRY_FIRST_MS			100
+#define PROBE_RETRY_WINDOW_MS			5000
+#define ACCESSORY_SWITCHING			1
+
+typedef struct accessory_tx {
+	struct libusb_transfer *transfer;
+	accessory_device *ad;
+	accessory_send_callback callback;
+	void *user_data;
+	struct accessory_tx *next;
+} accessory_tx;
+
+/**
+ * an arrived device whose probe failed on a transient error, probed again with a doubling delay
+ */
+typedef struct accessory_retry {
+	libusb_device *dev;
+	long long deadline;
+	long long next_probe;				// LLONG_MAX while queued in the arrived devices
+	int delay_ms;
+	struct accessory_retry *next;
+} accessory_retry;
+
+/**
+ * a phone told to switch to accessory mode, waiting to be back as 18D1:2D0x at its port
+ */
+typedef struct accessory_switch {
+	accessory_device *ad;
+	probe_entry cached;				// what the probe cache knew, zero if nothing
+	long long start;				// setup start and start of the re-enumeration wait, for the timings
+	long long phase;
+	long long deadline;
+	long long next_reopen;
+	struct accessory_switch *next;
+} accessory_switch;
+
+static int accessory_setup(accessory_device *ad, accessory_switch *sw);
+static int accessory_switch_finish(accessory_switch *sw);
+static int accessory_switch_wait(accessory_switch *sw);
+static int accessory_switch_queue(const accessory_switch *sw);
+static void accessory_switch_arm();
+static void accessory_switch_expired(int fd, uint32_t events, void *user_data);
+static accessory_device *accessory_take_switched(accessory_match_callback match, void *user_data);
+static int accessory_is_switching(const char *port_path);
+static void accessory_switch_clear();
+static void accessory_probe_invalidate(accessory_device *ad);
+static accessory_device *accessory_probe(libusb_device *dev, accessory_match_callback match, void *user_data);
+static accessory_device *accessory_probe_or_retry(libusb_device *dev, accessory_match_callback match, void *user_data);
+static int accessory_is_transient(int error);
+static void accessory_retry_later(libusb_device *dev);
+static void accessory_retry_cancel(libusb_device *dev);
+static void accessory_retry_arm();
+static void accessory_retry_expired(int fd, uint32_t events, void *user_data);
+static void accessory_retry_start();
+static int accessory_match_selector(const accessory_device *candidate, void *user_data);
+static void accessory_get_port_path(libusb_device *dev, char *path, size_t size);
+static int accessory_reopen(accessory_device *ad);
+static void accessory_receive_completed(struct libusb_transfer *transfer);
+static void accessory_submit_completed(struct libusb_transfer *transfer);
+static void accessory_pollfd_added(int fd, short events, void *user_data);
+static void accessory_pollfd_removed(int fd, void *user_data);
+static void accessory_pollfd_ready(int fd, uint32_t events, void *user_data);
+static void accessory_add_arrived(libusb_device *dev);
+static void accessory_clear_arrived();
+static int accessory_hotplug_event(libusb_context *context, libusb_device *dev, libusb_hotplug_event event, void *user_data);
+static void accessory_uevent_ready(int fd, uint32_t events, void *user_data);
+static void accessory_wait_arrival(int timeout_ms);
+static long long accessory_time_us();
+static int accessory_is_aoa_product(uint16_t product_id);
+static void accessory_hid_event_completed(struct libusb_transfer *transfer);
+static int accessory_usb_send_data(accessory_device *ad, unsigned char *buffer, int size);
+static int accessory_usb_submit_data(accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data);
+static int accessory_usb_start_receiving(accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data);
+static void accessory_usb_resume_receiving(accessory_device *ad);
+static void accessory_usb_stop_transfers(accessory_device *ad);
+static void accessory_usb_free_device(accessory_device *ad);
+
+static const accessory_transport usb_transport = {
+		accessory_usb_start_receiving,
+		accessory_usb_resume_receiving,
+		accessory_usb_submit_data,
+		accessory_usb_send_data,
+		accessory_usb_stop_transfers,
+		accessory_usb_free_device,
+};
 
 static libusb_context *ctx = NULL;
 
+// devices reported by hotplug events and not yet probed
+static libusb_device **arrived = NULL;
+static int arrived_count = 0;
+static int arrived_size = 0;
+static accessory_arrival_callback arrival_callback = NULL;
+static void *arrival_user_data = NULL;
+static int hotplug_registered = 0;
+static libusb_hotplug_callback_handle hotplug_handle;
+static int uevent_fd = -1;
+static int arrival_seen = 0;
+
+// arrived devices not yet ready when probed: the node is created before udev sets its permissions, and a phone
+// may still be enumerating. Retried only with hotplug, polling probes them again anyway.
+static accessory_retry *retries = NULL;
+static int retry_timer_fd = -1;
+static int probe_transient = 0;			// the last probe failed on an error worth a retry
+
+// with an event loop attached the re-enumeration after a switch is waited for in the background, so the
+// other accessories keep forwarding meanwhile
+static accessory_switch *switching = NULL;
+static accessory_switch *switched = NULL;		// back in accessory mode, not yet returned
+static int switch_timer_fd = -1;
+static int switch_arrival = 0;				// a device arrived since the switches were last looked at
+
+// identity sent to the phone, it selects the app started for the accessory
+static char identity[ACCESSORY_STRINGS][ACCESSORY_STRING_SIZE] = {
+		ACCESSORY_MANUFACTURER,
+		ACCESSORY_MODEL,
+		ACCESSORY_DESCRIPTION,
+		ACCESSORY_VERSION,
+		ACCESSORY_URI,
+		ACCESSORY_SERIAL,
+};
+static const char *identity_keys[ACCESSORY_STRINGS] = { "manufacturer", "model", "description", "version", "uri", "serial" };
+static int audio_mode = 0;
+
 void accessory_finalize() {
+	accessory_disable_hotplug();
 	if (ctx != NULL) {
 		libusb_exit(ctx);
 		ctx = NULL;
@@ -82,113 +219,404 @@ accessory_device *accessory_get_device() {
 	return accessory_get_device_with_vid_pid(VOID_ID, VOID_ID);
 }
 
+/**
+ * the first device with vendor_id:product_id, any device with VOID_ID. Devices are looked for by enumeration as
+ * for accessory_get_device_matching(), and the one switched is reopened at its port path.
+ */
 accessory_device *accessory_get_device_with_vid_pid(uint16_t vendor_id, uint16_t product_id) {
+	accessory_selector selector;
+
+	if (vendor_id == VOID_ID || product_id == VOID_ID)
+		return accessory_get_device_matching(NULL, NULL);
+
+	memset(&selector, 0, sizeof(selector));
+	selector.vendor_id = vendor_id;
+	selector.product_id = product_id;
+
+	return accessory_get_device_matching(accessory_match_selector, &selector);
+}
+
+/**
+ * parse a selector: "serial=<iSerialNumber>", "path=<bus-port.port...>", "id=<vid>:<pid>" in hex, "any" or
+ * "loopback". Returns 0 or -1 if not valid
+ */
+int accessory_selector_parse(const char *text, accessory_selector *selector) {
+	unsigned int vendor_id, product_id;
+	char tail;
+
+	memset(selector, 0, sizeof(accessory_selector));
+
+	if (strncmp(text, "serial=", 7) == 0) {
+		if (text[7] == 0 || strlen(text + 7) >= sizeof(selector->serial))
+			return -1;
+		strcpy(selector->serial, text + 7);
+	} else if (strncmp(text, "path=", 5) == 0) {
+		if (text[5] == 0 || strlen(text + 5) >= sizeof(selector->port_path))
+			return -1;
+		strcpy(selector->port_path, text + 5);
+	} else if (strncmp(text, "id=", 3) == 0) {
+		if (sscanf(text + 3, "%x:%x%c", &vendor_id, &product_id, &tail) != 2 || vendor_id > 0xFFFF || product_id > 0xFFFF)
+			return -1;
+		selector->vendor_id = vendor_id;
+		selector->product_id = product_id;
+	} else if (strcmp(text, "loopback") == 0) {
+		selector->loopback = 1;
+	} else if (strcmp(text, "any") != 0)
+		return -1;
+
+	return 0;
+}
+
+int accessory_selector_matches(const accessory_selector *selector, const accessory_device *ad) {
+	if (selector->loopback)
+		return 0;
+	if (selector->vendor_id != 0 && (selector->vendor_id != ad->vendor_id || selector->product_id != ad->product_id))
+		return 0;
+	if (selector->port_path[0] != 0 && strcmp(selector->port_path, ad->port_path) != 0)
+		return 0;
+	// the serial is checked once the device is opened to read it
+	if (selector->serial[0] != 0 && ad->serial_known && strcmp(selector->serial, ad->serial) != 0)
+		return 0;
+
+	return 1;
+}
+
+static int accessory_match_selector(const accessory_device *candidate, void *user_data) {
+	return accessory_selector_matches(user_data, candidate);
+}
+
+/**
+ * enumerate the attached devices and return the first one accepted by match (any one when match is NULL) and
+ * successfully switched to accessory mode. Candidates are opened through their own libusb_device, so phones
+ * sharing the same VID:PID are told apart by port_path and serial.
+ */
+accessory_device *accessory_get_device_matching(accessory_match_callback match, void *user_data) {
+	int i;
+	ssize_t cnt;
+	libusb_device **devs;
+	accessory_device *ad = NULL;
+
 	if (ctx == NULL)
 		return NULL;
 
-	if (vendor_id != VOID_ID && product_id != VOID_ID) {
-		accessory_device *ad = malloc(sizeof(accessory_device));
-		memset(ad, 0, sizeof(accessory_device));
+	ad = accessory_take_switched(match, user_data);
+	if (ad != NULL)
+		return ad;
 
-		ad->product_id = product_id;
-		ad->vendor_id = vendor_id;
+	// a full enumeration covers the devices reported by hotplug meanwhile
+	accessory_clear_arrived();
 
-		ad->handle = libusb_open_device_with_vid_pid(ctx, ad->vendor_id, ad->product_id);
-		if (ad->handle == NULL) {
-			accessory_free_device(ad);
-			return NULL;
-		}
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt <= 0) {
+		return NULL;
+	}
 
-		// check whether a kernel driver is attached to interface #0. If so, we'll need to detach it.
-		if (libusb_kernel_driver_active(ad->handle, 0)) {
-			int res = libusb_detach_kernel_driver(ad->handle, 0);
-			if (res == 0) {
-				ad->was_kernel_driver_detached = 1;
-			} else {
-				accessory_free_device(ad);
-				return NULL;
-			}
+	for (i = 0; i < cnt && ad == NULL; i++)
+		ad = accessory_probe_or_retry(devs[i], match, user_data);
+
+	libusb_free_device_list(devs, 1);
+	return ad;
+}
+
+/**
+ * as accessory_get_device_matching() but only among the devices plugged in since the last call, as reported by
+ * hotplug events: an idle bus costs nothing and unrelated devices already present are left alone
+ */
+accessory_device *accessory_get_arrived_device(accessory_match_callback match, void *user_data) {
+	accessory_device *ad = accessory_take_switched(match, user_data);
+
+	while (ad == NULL && arrived_count > 0) {
+		libusb_device *dev = arrived[0];
+
+		arrived_count--;
+		memmove(&arrived[0], &arrived[1], arrived_count * sizeof(libusb_device *));
+		ad = accessory_probe_or_retry(dev, match, user_data);
+		libusb_unref_device(dev);
+	}
+
+	return ad;
+}
+
+static accessory_device *accessory_probe_or_retry(libusb_device *dev, accessory_match_callback match, void *user_data) {
+	probe_transient = 0;
+	accessory_device *ad = accessory_probe(dev, match, user_data);
+
+	if (ad == NULL && probe_transient)
+		accessory_retry_later(dev);
+	else
+		accessory_retry_cancel(dev);
+
+	return ad;
+}
+
+/**
+ * errors of a device not accessible yet, busy or still enumerating, rather than of one not speaking AOA
+ */
+static int accessory_is_transient(int error) {
+	return error == LIBUSB_ERROR_ACCESS || error == LIBUSB_ERROR_BUSY || error == LIBUSB_ERROR_IO || error == LIBUSB_ERROR_TIMEOUT;
+}
+
+/**
+ * probe dev again after a delay doubling at every failure, for up to PROBE_RETRY_WINDOW_MS from the first one
+ */
+static void accessory_retry_later(libusb_device *dev) {
+	accessory_retry *retry;
+	long long now = accessory_time_us();
+
+	if (retry_timer_fd < 0)
+		return;
+
+	for (retry = retries; retry != NULL && retry->dev != dev; retry = retry->next)
+		;
+	if (retry == NULL) {
+		retry = calloc(1, sizeof(accessory_retry));
+		if (retry == NULL)
+			return;
+		retry->dev = libusb_ref_device(dev);
+		retry->deadline = now + PROBE_RETRY_WINDOW_MS * 1000LL;
+		retry->delay_ms = PROBE_RETRY_FIRST_MS;
+		retry->next = retries;
+		retries = retry;
+	} else
+		retry->delay_ms *= 2;
+
+	retry->next_probe = now + retry->delay_ms * 1000LL;
+	if (retry->next_probe > retry->deadline) {
+		accessory_retry_cancel(dev);
+		return;
+	}
+	accessory_retry_arm();
+}
+
+static void accessory_retry_cancel(libusb_device *dev) {
+	accessory_retry **link;
+
+	for (link = &retries; *link != NULL; link = &(*link)->next) {
+		accessory_retry *retry = *link;
+		if (retry->dev == dev) {
+			*link = retry->next;
+			libusb_unref_device(retry->dev);
+			free(retry);
+			return;
 		}
+	}
+}
 
-		ad->was_interface_claimed = libusb_claim_interface(ad->handle, 0) == 0;
-		if (!ad->was_interface_claimed) {
-			accessory_free_device(ad);
-			return NULL;
+/**
+ * arm the retry timer for the earliest retry due, disarm it when none is
+ */
+static void accessory_retry_arm() {
+	accessory_retry *retry;
+	long long first = LLONG_MAX;
+
+	for (retry = retries; retry != NULL; retry = retry->next) {
+		if (retry->next_probe < first)
+			first = retry->next_probe;
+	}
+
+	if (first == LLONG_MAX)
+		evloop_timer_arm(retry_timer_fd, 0, 0);
+	else {
+		long long delay = first - accessory_time_us();
+		evloop_timer_arm(retry_timer_fd, delay > 0 ? delay : 1, 0);
+	}
+}
+
+/**
+ * the devices due are reported as arrived again, to be probed with the next ones
+ */
+static void accessory_retry_expired(int fd, uint32_t events, void *user_data) {
+	accessory_retry *retry;
+	long long now = accessory_time_us();
+
+	evloop_timer_ack(fd);
+
+	for (retry = retries; retry != NULL; retry = retry->next) {
+		if (retry->next_probe <= now) {
+			retry->next_probe = LLONG_MAX;
+			accessory_add_arrived(retry->dev);
 		}
+	}
+	accessory_retry_arm();
+}
+
+/**
+ * open dev and, when accepted by match, switch it to accessory mode. Returns the device or NULL. Only the
+ * devices the selector may take are opened: vendor, product and port path are known without it.
+ */
+static accessory_device *accessory_probe(libusb_device *dev, accessory_match_callback match, void *user_data) {
+	struct libusb_device_descriptor desc;
+
+	int r = libusb_get_device_descriptor(dev, &desc);
+	if (r < 0)
+		return NULL;
+
+	if (desc.bDeviceClass != 0 || desc.idVendor == VMWARE_ID || desc.idVendor == FDTI_ID)
+		return NULL;
+
+	accessory_device *ad = malloc(sizeof(accessory_device));
+	memset(ad, 0, sizeof(accessory_device));
+	ad->transport = &usb_transport;
 
-		if (accessory_setup(ad) < 0) {
+	ad->vendor_id = desc.idVendor;
+	ad->product_id = desc.idProduct;
+	accessory_get_port_path(dev, ad->port_path, sizeof(ad->port_path));
+
+	// the phone being switched is back with another VID:PID before its switch is complete, leave it to that
+	if (accessory_is_switching(ad->port_path)) {
+		free(ad);
+		return NULL;
+	}
+
+	// a device found not accessory capable a short time ago is not opened again
+	const probe_entry *cached = probe_cache_lookup(ad->port_path, ad->vendor_id, ad->product_id);
+	if (cached != NULL && cached->aoa_version == 0) {
+		free(ad);
+		return NULL;
+	}
+
+	if (match != NULL && match(ad, user_data) == 0) {
+		free(ad);
+		return NULL;
+	}
+
+	r = libusb_open(dev, &ad->handle);
+	if (r < 0) {
+		probe_transient = accessory_is_transient(r);
+		ad->handle = NULL;
+		accessory_free_device(ad);
+		return NULL;
+	}
+
+	if (desc.iSerialNumber != 0)
+		libusb_get_string_descriptor_ascii(ad->handle, desc.iSerialNumber, (unsigned char *) ad->serial, sizeof(ad->serial));
+	ad->serial_known = 1;
+
+	if (match != NULL && match(ad, user_data) == 0) {
+		accessory_free_device(ad);
+		return NULL;
+	}
+
+	// check whether a kernel driver is attached to interface #0. If so, we'll need to detach it.
+	if (libusb_kernel_driver_active(ad->handle, 0) == 1) {
+		if (libusb_detach_kernel_driver(ad->handle, 0) == 0) {
+			ad->was_kernel_driver_detached = 1;
+		} else {
 			accessory_free_device(ad);
 			return NULL;
 		}
+	}
 
-		return ad;
-	} else {
-		int i;
-		ssize_t cnt;
-		libusb_device **devs;
+	r = libusb_claim_interface(ad->handle, 0);
+	ad->was_interface_claimed = r == 0;
+	if (!ad->was_interface_claimed) {
+		probe_transient = accessory_is_transient(r);
+		accessory_free_device(ad);
+		return NULL;
+	}
 
-		cnt = libusb_get_device_list(ctx, &devs);
-		if (cnt <= 0) {
+	accessory_switch sw;
+	r = accessory_setup(ad, &sw);
+	if (r == ACCESSORY_SWITCHING) {
+		// returned by a later call once back, the caller is told by the arrival callback
+		if (switch_timer_fd >= 0) {
+			if (accessory_switch_queue(&sw) < 0)
+				accessory_free_device(ad);
 			return NULL;
 		}
+		r = accessory_switch_wait(&sw);
+	}
+	if (r < 0) {
+		// what the cache told may be outdated, e.g. by a firmware update: probed in full at the retry
+		if (ad->probe_cached) {
+			accessory_probe_invalidate(ad);
+			probe_transient = 1;
+		}
+		accessory_free_device(ad);
+		return NULL;
+	}
 
-		for (i = 0; i < cnt; i++) {
-			struct libusb_device_descriptor desc;
-
-			int r = libusb_get_device_descriptor(devs[i], &desc);
-			if (r < 0)
-				continue;
+	return ad;
+}
 
-			if (desc.bDeviceClass != 0 || desc.idVendor == VMWARE_ID || desc.idVendor == FDTI_ID)
-				continue;
+/**
+ * physical position of dev in the same "bus-port.port..." format used by sysfs, stable across re-enumerations
+ */
+static void accessory_get_port_path(libusb_device *dev, char *path, size_t size) {
+	uint8_t ports[8];
+	int i, n, len;
+
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	len = snprintf(path, size, "%u", libusb_get_bus_number(dev));
+	for (i = 0; i < n && len < size; i++)
+		len += snprintf(path + len, size - len, "%c%u", i == 0 ? '-' : '.', ports[i]);
+}
 
-			accessory_device *ad = malloc(sizeof(accessory_device));
-			memset(ad, 0, sizeof(accessory_device));
+/**
+ * open the device re-enumerated in accessory mode at the port path of ad and with its serial number, so the phone
+ * just switched is found also with other accessories attached. Returns 0 or -1 if not (yet) present.
+ */
+static int accessory_reopen(accessory_device *ad) {
+	int i, r = -1;
+	ssize_t cnt;
+	libusb_device **devs;
+	char port_path[ACCESSORY_PORT_PATH_SIZE];
+	char serial[ACCESSORY_SERIAL_SIZE];
+
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt <= 0)
+		return -1;
 
-			ad->vendor_id = desc.idVendor;
-			ad->product_id = desc.idProduct;
+	for (i = 0; i < cnt && r < 0; i++) {
+		struct libusb_device_descriptor desc;
 
-			ad->handle = libusb_open_device_with_vid_pid(ctx, ad->vendor_id, ad->product_id);
-			if (ad->handle == NULL) {
-				accessory_free_device(ad);
-				continue;
-			}
+		if (libusb_get_device_descriptor(devs[i], &desc) < 0)
+			continue;
+		if (desc.idVendor != USB_ACCESSORY_VENDOR_ID)
+			continue;
+		if (!accessory_is_aoa_product(desc.idProduct))
+			continue;
 
-			// check whether a kernel driver is attached to interface #0. If so, we'll need to detach it.
-			if (libusb_kernel_driver_active(ad->handle, 0) == 1) {
-				if (libusb_detach_kernel_driver(ad->handle, 0) == 0) {
-					ad->was_kernel_driver_detached = 1;
-				} else {
-					accessory_free_device(ad);
-					continue;
-				}
-			}
+		accessory_get_port_path(devs[i], port_path, sizeof(port_path));
+		if (ad->port_path[0] != 0 && strcmp(port_path, ad->port_path) != 0)
+			continue;
 
-			ad->was_interface_claimed = libusb_claim_interface(ad->handle, 0) == 0;
-			if (!ad->was_interface_claimed) {
-				accessory_free_device(ad);
-				continue;
-			}
+		if (libusb_open(devs[i], &ad->handle) < 0) {
+			ad->handle = NULL;
+			continue;
+		}
 
-			if (accessory_setup(ad) < 0) {
-				accessory_free_device(ad);
+		// Android keeps its serial number in accessory mode: a different one is another phone, e.g. plugged
+		// into the same port while this one was switching
+		if (ad->serial[0] != 0 && desc.iSerialNumber != 0) {
+			serial[0] = 0;
+			libusb_get_string_descriptor_ascii(ad->handle, desc.iSerialNumber, (unsigned char *) serial, sizeof(serial));
+			if (serial[0] != 0 && strcmp(serial, ad->serial) != 0) {
+				libusb_close(ad->handle);
+				ad->handle = NULL;
 				continue;
-			} else {
-				libusb_free_device_list(devs, 1);
-				return ad;
 			}
 		}
 
-		libusb_free_device_list(devs, 1);
-		return NULL;
+		ad->aoa_vendor_id = desc.idVendor;
+		ad->aoa_product_id = desc.idProduct;
+		r = 0;
 	}
+
+	libusb_free_device_list(devs, 1);
+	return r;
 }
 
-void accessory_free_device(accessory_device *ad) {
+static void accessory_usb_free_device(accessory_device *ad) {
 	if (ctx == NULL)
 		return;
 
 	if (ad != NULL) {
+		accessory_usb_stop_transfers(ad);
+		// the device outlives the transfers libusb still holds
+		if (ad->abandoned)
+			return;
+
 		if (ad->was_interface_claimed)
 			libusb_release_interface(ad->handle, 0);
 
@@ -202,6 +630,69 @@ void accessory_free_device(accessory_device *ad) {
 	}
 }
 
+void accessory_free_device(accessory_device *ad) {
+	if (ad != NULL)
+		ad->transport->free_device(ad);
+}
+
+/**
+ * send the whole buffer synchronously. Returns the number of bytes sent or a LIBUSB_ERROR_* code.
+ * Must not be called from inside an event callback, use accessory_submit_data() there.
+ */
+int accessory_send_data(accessory_device *ad, unsigned char *buffer, int size) {
+	if (ad == NULL || ad->is_disconnected)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	return ad->transport->send_data(ad, buffer, size);
+}
+
+/**
+ * submit buffer as a single asynchronous OUT transfer without copying it: the caller must keep buffer untouched
+ * until callback is called from the event loop with the number of bytes sent (less than size if the phone did
+ * not read them within the timeout) or a LIBUSB_ERROR_* code. Transfers are pipelined, several may be in flight.
+ */
+int accessory_submit_data(accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data) {
+	if (ad == NULL || ad->is_disconnected)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	return ad->transport->submit_data(ad, buffer, size, callback, user_data);
+}
+
+/**
+ * keep queue_depth IN transfers of buffer_size bytes always pending, and deliver every completion to callback
+ * from inside the event loop, in order. See accessory_receive_callback for holding data.
+ */
+int accessory_start_receiving(accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data) {
+	if (ad == NULL || queue_depth < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return ad->transport->start_receiving(ad, queue_depth, buffer_size, callback, user_data);
+}
+
+/**
+ * deliver again the held IN data, in completion order
+ */
+void accessory_resume_receiving(accessory_device *ad) {
+	if (ad != NULL)
+		ad->transport->resume_receiving(ad);
+}
+
+/**
+ * stop receiving and wait for the submitted OUT transfers to complete
+ */
+void accessory_stop_transfers(accessory_device *ad) {
+	if (ad != NULL)
+		ad->transport->stop_transfers(ad);
+}
+
+/**
+ * transfers still in flight after accessory_stop_transfers() gave up waiting for them. libusb may complete them
+ * at any later time, so the buffers they were given must be left allocated; their callbacks are no more called.
+ */
+int accessory_transfers_pending(accessory_device *ad) {
+	return ad != NULL ? ad->rx_pending + ad->tx_pending : 0;
+}
+
 int accessory_init() {
 	if (ctx != NULL)
 		return -1;
@@ -216,15 +707,21 @@ int accessory_init() {
 	return 0;
 }
 
-static int accessory_setup(accessory_device *ad) {
-	int res, tries;
+/**
+ * get ad ready to be used in accessory mode. A device already switched is ready at once (returns 0), the
+ * others are told to switch and sw is filled to wait for them to come back re-enumerated (returns
+ * ACCESSORY_SWITCHING). Returns -1 on error.
+ */
+static int accessory_setup(accessory_device *ad, accessory_switch *sw) {
+	int res, i;
 	unsigned char buffer[2];
+	long long phase, now;
 
 	if (ctx == NULL || ad == NULL)
 		return -1;
 
 	if (ad->vendor_id == USB_ACCESSORY_VENDOR_ID) {
-		if (ad->product_id == USB_ACCESSORY_PRODUCT_ID || ad->product_id == USB_ACCESSORY_ADB_PRODUCT_ID) {
+		if (accessory_is_aoa_product(ad->product_id)) {
 
 			if (accessory_get_endpoints(ad))
 				return -1;
@@ -235,34 +732,55 @@ static int accessory_setup(accessory_device *ad) {
 		}
 	}
 
-	res = libusb_control_transfer(ad->handle, USB_DIR_IN | USB_TYPE_VENDOR, ACCESSORY_GET_PROTOCOL, 0, 0, buffer, 2, 0);
-	if (res < 0)
-		return -1;
+	memset(sw, 0, sizeof(accessory_switch));
+	sw->ad = ad;
 
-	ad->aoa_version = buffer[1] << 8 | buffer[0];
+	// a device already switched once is known to speak AOA, no need to ask again
+	const probe_entry *entry = probe_cache_lookup(ad->port_path, ad->vendor_id, ad->product_id);
+	if (entry != NULL)
+		sw->cached = *entry;
 
-	usleep(1000);
+	sw->start = phase = accessory_time_us();
+	if (sw->cached.aoa_version > 0) {
+		ad->aoa_version = sw->cached.aoa_version;
+		ad->probe_cached = 1;
+	} else {
+		res = libusb_control_transfer(ad->handle, USB_DIR_IN | USB_TYPE_VENDOR, ACCESSORY_GET_PROTOCOL, 0, 0, buffer, 2, CONTROL_TIMEOUT_MS);
+		// a phone still enumerating is retried, not remembered as lacking AOA
+		if (res < 0 && accessory_is_transient(res)) {
+			probe_transient = 1;
+			return -1;
+		}
+		if (res < 0 || (buffer[1] << 8 | buffer[0]) == 0) {
+			probe_cache_set_negative(ad->port_path, ad->vendor_id, ad->product_id);
+			return -1;
+		}
 
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, 0, (unsigned char *) ACCESSORY_MANUFACTURER, strlen(ACCESSORY_MANUFACTURER), 0);
-	if (res < 0)
-		return -1;
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, 1, (unsigned char *) ACCESSORY_MODEL, strlen(ACCESSORY_MODEL), 0);
-	if (res < 0)
-		return -1;
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, 2, (unsigned char *) ACCESSORY_DESCRIPTION, strlen(ACCESSORY_DESCRIPTION), 0);
-	if (res < 0)
-		return -1;
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, 3, (unsigned char *) ACCESSORY_VERSION, strlen(ACCESSORY_VERSION), 0);
-	if (res < 0)
-		return -1;
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, 4, (unsigned char *) ACCESSORY_URI, strlen(ACCESSORY_URI), 0);
-	if (res < 0)
-		return -1;
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, 5, (unsigned char *) ACCESSORY_SERIAL, strlen(ACCESSORY_SERIAL), 0);
-	if (res < 0)
-		return -1;
+		ad->aoa_version = buffer[1] << 8 | buffer[0];
+		probe_cache_set_version(ad->port_path, ad->vendor_id, ad->product_id, ad->aoa_version);
+	}
+	now = accessory_time_us();
+	ad->setup_timings.protocol_us = now - phase;
+	phase = now;
+
+	for (i = 0; i < ACCESSORY_STRINGS; i++) {
+		res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, i, (unsigned char *) identity[i], strlen(identity[i]), CONTROL_TIMEOUT_MS);
+		if (res < 0)
+			return -1;
+	}
+
+	// audio streams on interfaces of its own, beside the accessory one, from protocol version 2
+	if (audio_mode && ad->aoa_version >= 2) {
+		res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SET_AUDIO_MODE, AUDIO_MODE_PCM_16BIT_44100, 0, NULL, 0, CONTROL_TIMEOUT_MS);
+		if (res < 0)
+			return -1;
+	}
 
-	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_START, 0, 0, NULL, 0, 0);
+	now = accessory_time_us();
+	ad->setup_timings.strings_us = now - phase;
+	phase = now;
+
+	res = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_START, 0, 0, NULL, 0, CONTROL_TIMEOUT_MS);
 	if (res < 0) {
 		//	Cause problems with some ANDROID devices running on Rockchip & AllWinner kernels we need to ignore
 		//	a response error (-ESHUTDOWN)(-108) and continue with accessory device claim operations.
@@ -270,76 +788,465 @@ static int accessory_setup(accessory_device *ad) {
 		// return -1;
 	}
 
-	usleep(1000);
-
 	libusb_release_interface(ad->handle, 0);
 	ad->was_interface_claimed = 0;
 	libusb_close(ad->handle);
 	ad->handle = 0;
+	// the driver detached was bound to the device gone with the switch
+	ad->was_kernel_driver_detached = 0;
 
-	usleep(1000);
-
-	tries = 0;
-	while (1) {
-		ad->handle = libusb_open_device_with_vid_pid(ctx, USB_ACCESSORY_VENDOR_ID, USB_ACCESSORY_PRODUCT_ID);
-		if (ad->handle != NULL) {
-			ad->aoa_vendor_id = USB_ACCESSORY_VENDOR_ID;
-			ad->aoa_product_id = USB_ACCESSORY_PRODUCT_ID;
-			break;
-		}
+	now = accessory_time_us();
+	ad->setup_timings.start_us = now - phase;
 
-		usleep(1000);
+	// the phone re-enumerates as 18D1:2D0x at the same port: look for it at every arrival event, and every
+	// SWITCH_RETRY_MS in case the event was missed or the device node was not yet accessible
+	sw->phase = now;
+	sw->deadline = now + SWITCH_TIMEOUT_MS * 1000LL;
+	sw->next_reopen = now;
 
-		ad->handle = libusb_open_device_with_vid_pid(ctx, USB_ACCESSORY_VENDOR_ID, USB_ACCESSORY_ADB_PRODUCT_ID);
-		if (ad->handle != NULL) {
-			ad->aoa_vendor_id = USB_ACCESSORY_VENDOR_ID;
-			ad->aoa_product_id = USB_ACCESSORY_ADB_PRODUCT_ID;
-			break;
-		}
+	return ACCESSORY_SWITCHING;
+}
 
-		tries++;
-		if (tries >= CONNECT_TRIES)
-			return -1;
+/**
+ * the phone is back in accessory mode and reopened: claim its interface and find the endpoints
+ */
+static int accessory_switch_finish(accessory_switch *sw) {
+	accessory_device *ad = sw->ad;
+	long long phase, now;
 
-		usleep(CONNECT_TRIES_MS_DELAY * 1000);
-	}
+	now = accessory_time_us();
+	ad->setup_timings.reenumeration_us = now - sw->phase;
+	phase = now;
 
 	ad->was_interface_claimed = libusb_claim_interface(ad->handle, 0) == 0;
 	if (!ad->was_interface_claimed)
 		return -1;
 
-	if (accessory_get_endpoints(ad))
-		return -1;
+	if (sw->cached.endpoint_in != 0) {
+		ad->aoa_endpoint_in = sw->cached.endpoint_in;
+		ad->aoa_endpoint_out = sw->cached.endpoint_out;
+		ad->aoa_max_packet_size = sw->cached.max_packet_size;
+	} else {
+		if (accessory_get_endpoints(ad))
+			return -1;
+		probe_cache_set_endpoints(ad->port_path, ad->vendor_id, ad->product_id, ad->aoa_endpoint_in, ad->aoa_endpoint_out, ad->aoa_max_packet_size);
+	}
+
+	now = accessory_time_us();
+	ad->setup_timings.claim_us = now - phase;
+	ad->setup_timings.total_us = now - sw->start;
 
 	return 0;
 }
 
-int accessory_get_endpoints(accessory_device *ad) {
-	int c, i, a;
+/**
+ * the device failed with the protocol version or endpoints known from the probe cache: forget them, so that it
+ * is probed in full next time. Entries of working devices do not expire, a firmware update may change them.
+ */
+static void accessory_probe_invalidate(accessory_device *ad) {
+	if (!ad->probe_cached)
+		return;
 
-	struct libusb_device* dev = libusb_get_device(ad->handle);
-	if (dev == NULL)
-		return -1;
+	probe_cache_remove(ad->port_path, ad->vendor_id, ad->product_id);
+	ad->probe_cached = 0;
+}
 
-	struct libusb_device_descriptor dev_desc;
-	if (libusb_get_device_descriptor(dev, &dev_desc))
-		return -1;
+/**
+ * wait for the re-enumeration in place, when no event loop is attached to do it in the background
+ */
+static int accessory_switch_wait(accessory_switch *sw) {
+	long long now = accessory_time_us();
 
-	for (c = 0; c < dev_desc.bNumConfigurations; c++) {
-		struct libusb_config_descriptor *config_desc;
-		if (libusb_get_config_descriptor(dev, c, &config_desc))
+	while (1) {
+		if (arrival_seen || now >= sw->next_reopen) {
+			arrival_seen = 0;
+			if (accessory_reopen(sw->ad) == 0)
+				return accessory_switch_finish(sw);
+			sw->next_reopen = now + SWITCH_RETRY_MS * 1000LL;
+		}
+		if (now >= sw->deadline)
 			return -1;
-		for (i = 0; i < config_desc->bNumInterfaces; i++) {
-			for (a = 0; a < config_desc[c].interface[i].num_altsetting; a++) {
-				if (config_desc[c].interface[i].altsetting[a].iInterface == 5) {
-					if (config_desc[c].interface[i].altsetting[a].bNumEndpoints != 2) {
-						libusb_free_config_descriptor(config_desc);
-						return -1;
-					}
-					ad->aoa_endpoint_in = config_desc[c].interface[i].altsetting[a].endpoint[0].bEndpointAddress;
-					ad->aoa_endpoint_out = config_desc[c].interface[i].altsetting[a].endpoint[1].bEndpointAddress;
-					libusb_free_config_descriptor(config_desc);
-					return 0;
+
+		accessory_wait_arrival((int) (((sw->next_reopen < sw->deadline ? sw->next_reopen : sw->deadline) - now + 999) / 1000));
+		now = accessory_time_us();
+	}
+}
+
+/**
+ * keep waiting for the re-enumeration from the event loop. Returns -1 if out of memory
+ */
+static int accessory_switch_queue(const accessory_switch *sw) {
+	accessory_switch *pending = malloc(sizeof(accessory_switch));
+
+	if (pending == NULL)
+		return -1;
+	*pending = *sw;
+	pending->next = switching;
+	switching = pending;
+	accessory_switch_arm();
+
+	return 0;
+}
+
+/**
+ * arm the switch timer for the earliest reopen or deadline, disarm it when no phone is switching
+ */
+static void accessory_switch_arm() {
+	accessory_switch *sw;
+	long long first = LLONG_MAX;
+
+	for (sw = switching; sw != NULL; sw = sw->next) {
+		long long due = sw->next_reopen < sw->deadline ? sw->next_reopen : sw->deadline;
+		if (due < first)
+			first = due;
+	}
+
+	if (first == LLONG_MAX)
+		evloop_timer_arm(switch_timer_fd, 0, 0);
+	else {
+		long long delay = first - accessory_time_us();
+		evloop_timer_arm(switch_timer_fd, delay > 0 ? delay : 1, 0);
+	}
+}
+
+/**
+ * reopen the phones switching at a device arrival or when their retry is due. The ones back are moved to the
+ * switched devices, returned by the next accessory_get_*_device() call the arrival callback asks for; the ones
+ * past the deadline are dropped.
+ */
+static void accessory_switch_expired(int fd, uint32_t events, void *user_data) {
+	accessory_switch **link = &switching;
+	long long now = accessory_time_us();
+	int done = 0;
+
+	evloop_timer_ack(fd);
+
+	while (*link != NULL) {
+		accessory_switch *sw = *link;
+
+		if (switch_arrival || now >= sw->next_reopen) {
+			if (accessory_reopen(sw->ad) == 0) {
+				*link = sw->next;
+				if (accessory_switch_finish(sw) == 0) {
+					sw->next = switched;
+					switched = sw;
+				} else {
+					accessory_probe_invalidate(sw->ad);
+					accessory_free_device(sw->ad);
+					free(sw);
+				}
+				done = 1;
+				continue;
+			}
+			sw->next_reopen = now + SWITCH_RETRY_MS * 1000LL;
+		}
+		if (now >= sw->deadline) {
+			*link = sw->next;
+			accessory_probe_invalidate(sw->ad);
+			accessory_free_device(sw->ad);
+			free(sw);
+			done = 1;
+			continue;
+		}
+		link = &sw->next;
+	}
+	switch_arrival = 0;
+	accessory_switch_arm();
+
+	// failures are reported too: devices put off while the switch was pending may be taken now
+	if (done && arrival_callback != NULL)
+		arrival_callback(arrival_user_data);
+}
+
+/**
+ * a switched device, in the order they came back, accepted by match. The ones nobody takes any more are left
+ * in accessory mode, where a later scan finds them.
+ */
+static accessory_device *accessory_take_switched(accessory_match_callback match, void *user_data) {
+	while (switched != NULL) {
+		accessory_switch *sw = switched;
+		accessory_device *ad = sw->ad;
+
+		switched = sw->next;
+		free(sw);
+		if (match == NULL || match(ad, user_data))
+			return ad;
+		accessory_free_device(ad);
+	}
+
+	return NULL;
+}
+
+/**
+ * whether a device at port_path is being switched, or switched and not yet taken
+ */
+static int accessory_is_switching(const char *port_path) {
+	accessory_switch *sw;
+
+	for (sw = switching; sw != NULL; sw = sw->next) {
+		if (strcmp(sw->ad->port_path, port_path) == 0)
+			return 1;
+	}
+	for (sw = switched; sw != NULL; sw = sw->next) {
+		if (strcmp(sw->ad->port_path, port_path) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * whether a phone accepted by match (any one when NULL) is being switched to accessory mode or is switched and
+ * not yet taken, so that a caller can keep another phone from being switched for the same purpose
+ */
+int accessory_switch_pending(accessory_match_callback match, void *user_data) {
+	accessory_switch *sw;
+
+	for (sw = switching; sw != NULL; sw = sw->next) {
+		if (match == NULL || match(sw->ad, user_data))
+			return 1;
+	}
+	for (sw = switched; sw != NULL; sw = sw->next) {
+		if (match == NULL || match(sw->ad, user_data))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void accessory_switch_clear() {
+	while (switching != NULL) {
+		accessory_switch *sw = switching;
+		switching = sw->next;
+		accessory_free_device(sw->ad);
+		free(sw);
+	}
+	while (switched != NULL)
+		accessory_free_device(accessory_take_switched(NULL, NULL));
+}
+
+/**
+ * wait up to timeout_ms for a device arrival, returning early when one is reported. libusb events of the other
+ * accessories are handled meanwhile when hotplug runs through libusb.
+ */
+static void accessory_wait_arrival(int timeout_ms) {
+	if (hotplug_registered) {
+		struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+		libusb_handle_events_timeout_completed(ctx, &tv, &arrival_seen);
+	} else if (uevent_fd >= 0) {
+		struct pollfd pfd = { uevent_fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout_ms) > 0)
+			accessory_uevent_ready(uevent_fd, EPOLLIN, NULL);
+	} else
+		usleep(timeout_ms * 1000);
+}
+
+static long long accessory_time_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * accessory mode product IDs having the accessory interface, with or without adb and audio
+ */
+static int accessory_is_aoa_product(uint16_t product_id) {
+	return product_id == USB_ACCESSORY_PRODUCT_ID || product_id == USB_ACCESSORY_ADB_PRODUCT_ID
+			|| product_id == USB_ACCESSORY_AUDIO_PRODUCT_ID || product_id == USB_ACCESSORY_AUDIO_ADB_PRODUCT_ID;
+}
+
+/**
+ * set one of the identity strings sent when switching a phone: key is manufacturer, model, description, version,
+ * uri or serial. Returns -1 for an unknown key or a value too long.
+ */
+int accessory_set_identity(const char *key, const char *value) {
+	int i;
+
+	for (i = 0; i < ACCESSORY_STRINGS; i++) {
+		if (strcmp(key, identity_keys[i]) == 0) {
+			if (strlen(value) >= ACCESSORY_STRING_SIZE)
+				return -1;
+			strcpy(identity[i], value);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * read identity strings from a file of "key = value" lines, '#' starting a comment line. Returns -1 if the file
+ * cannot be read or has an invalid line, reported on stderr
+ */
+int accessory_load_identity(const char *file_name) {
+	char line[ACCESSORY_STRING_SIZE + 32];
+	int line_number = 0;
+	FILE *file;
+
+	file = fopen(file_name, "r");
+	if (file == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char *key, *value, *end;
+
+		line_number++;
+		key = line + strspn(line, " \t");
+		if (*key == '#' || *key == '\r' || *key == '\n' || *key == 0)
+			continue;
+
+		value = strchr(key, '=');
+		if (value == NULL) {
+			fprintf(stderr, "%s:%d: expected key = value\n", file_name, line_number);
+			fclose(file);
+			return -1;
+		}
+
+		// trim the blanks around key and value
+		for (end = value; end > key && (end[-1] == ' ' || end[-1] == '\t'); end--)
+			;
+		*end = 0;
+		value += 1 + strspn(value + 1, " \t");
+		for (end = value + strlen(value); end > value && strchr(" \t\r\n", end[-1]) != NULL; end--)
+			;
+		*end = 0;
+
+		if (accessory_set_identity(key, value) < 0) {
+			fprintf(stderr, "%s:%d: unknown key '%s' or value too long\n", file_name, line_number, key);
+			fclose(file);
+			return -1;
+		}
+	}
+
+	fclose(file);
+	return 0;
+}
+
+/**
+ * ask the phones switched from now on to route their audio output to the accessory (AOA v2, 16 bit PCM stereo
+ * at 44100 Hz)
+ */
+void accessory_set_audio_mode(int enable) {
+	audio_mode = enable;
+}
+
+/**
+ * register the HID device id with its report descriptor (AOA v2). The descriptor is sent in chunks as large
+ * as the control endpoint packets. Returns 0 or a LIBUSB_ERROR_* code.
+ */
+int accessory_register_hid(accessory_device *ad, int id, const unsigned char *descriptor, int size) {
+	struct libusb_device_descriptor desc;
+	int offset, chunk, r;
+
+	if (ad == NULL || ad->handle == NULL)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (ad->aoa_version < 2)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = libusb_get_device_descriptor(libusb_get_device(ad->handle), &desc);
+	if (r < 0)
+		return r;
+
+	r = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_REGISTER_HID, id, size, NULL, 0, CONTROL_TIMEOUT_MS);
+	if (r < 0)
+		return r;
+
+	for (offset = 0; offset < size; offset += chunk) {
+		chunk = size - offset < desc.bMaxPacketSize0 ? size - offset : desc.bMaxPacketSize0;
+		r = libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SET_HID_REPORT_DESC, id, offset,
+				(unsigned char *) descriptor + offset, chunk, CONTROL_TIMEOUT_MS);
+		if (r < 0) {
+			libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_UNREGISTER_HID, id, 0, NULL, 0, CONTROL_TIMEOUT_MS);
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+void accessory_unregister_hid(accessory_device *ad, int id) {
+	if (ad != NULL && ad->handle != NULL && !ad->is_disconnected)
+		libusb_control_transfer(ad->handle, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_UNREGISTER_HID, id, 0, NULL, 0, CONTROL_TIMEOUT_MS);
+}
+
+/**
+ * send an input report of the registered HID device id. The control transfer is asynchronous, report is copied
+ * and can be reused at once. Returns 0 or a LIBUSB_ERROR_* code.
+ */
+int accessory_send_hid_event(accessory_device *ad, int id, const unsigned char *report, int size) {
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	int r;
+
+	if (ad == NULL || ad->is_disconnected)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	transfer = libusb_alloc_transfer(0);
+	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + size);
+	if (transfer == NULL || buffer == NULL) {
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	libusb_fill_control_setup(buffer, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_SEND_HID_EVENT, id, 0, size);
+	memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, report, size);
+	libusb_fill_control_transfer(transfer, ad->handle, buffer, accessory_hid_event_completed, ad, HID_TIMEOUT);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		libusb_free_transfer(transfer);
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			ad->is_disconnected = 1;
+		return r;
+	}
+	// accounted as an OUT transfer, so accessory_stop_transfers() waits for it
+	ad->tx_pending++;
+
+	return 0;
+}
+
+static void accessory_hid_event_completed(struct libusb_transfer *transfer) {
+	accessory_device *ad = transfer->user_data;
+
+	ad->tx_pending--;
+	if (ad->abandoned)
+		return;
+	if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+		ad->is_disconnected = 1;
+}
+
+int accessory_get_endpoints(accessory_device *ad) {
+	int c, i, a;
+
+	struct libusb_device* dev = libusb_get_device(ad->handle);
+	if (dev == NULL)
+		return -1;
+
+	struct libusb_device_descriptor dev_desc;
+	if (libusb_get_device_descriptor(dev, &dev_desc))
+		return -1;
+
+	for (c = 0; c < dev_desc.bNumConfigurations; c++) {
+		struct libusb_config_descriptor *config_desc;
+		if (libusb_get_config_descriptor(dev, c, &config_desc))
+			return -1;
+		for (i = 0; i < config_desc->bNumInterfaces; i++) {
+			for (a = 0; a < config_desc[c].interface[i].num_altsetting; a++) {
+				if (config_desc[c].interface[i].altsetting[a].iInterface == 5) {
+					if (config_desc[c].interface[i].altsetting[a].bNumEndpoints != 2) {
+						libusb_free_config_descriptor(config_desc);
+						return -1;
+					}
+					const struct libusb_endpoint_descriptor *ep = config_desc[c].interface[i].altsetting[a].endpoint;
+					int out = (ep[0].bEndpointAddress & USB_DIR_IN) ? 1 : 0;
+					ad->aoa_endpoint_in = ep[1 - out].bEndpointAddress;
+					ad->aoa_endpoint_out = ep[out].bEndpointAddress;
+					ad->aoa_max_packet_size = ep[out].wMaxPacketSize;
+					libusb_free_config_descriptor(config_desc);
+					return 0;
 				}
 			}
 		}
@@ -366,30 +1273,563 @@ int accessory_receive_data(accessory_device *ad, unsigned char *buffer, int buff
 	return transferred;
 }
 
-void accessory_send_data(accessory_device *ad, unsigned char *buffer, int size) {
-	const static int PACKET_BULK_LEN = 512;
-	const static int MAX_TRIES = 5;
-	const static int TIMEOUT = 10;
+/**
+ * one synchronous bulk transfer, terminated by a zero length packet when size is a multiple of the endpoint
+ * max packet size
+ */
+static int accessory_usb_send_data(accessory_device *ad, unsigned char *buffer, int size) {
 	int transferred = 0;
-	int to_send = 0;
-	int tries = 0;
-	int sent = 0;
-
-	while (sent < size) {
-		to_send = size - sent;
-		if (to_send > PACKET_BULK_LEN)
-			to_send = PACKET_BULK_LEN;
-		int r = libusb_bulk_transfer(ad->handle, ad->aoa_endpoint_out, &buffer[sent], to_send, &transferred, TIMEOUT);
-		if (r != 0 && r != LIBUSB_ERROR_TIMEOUT)
+	int zlp_transferred;
+
+	if (ad == NULL || ad->is_disconnected)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	int r = libusb_bulk_transfer(ad->handle, ad->aoa_endpoint_out, buffer, size, &transferred, TX_TIMEOUT);
+	if (r == LIBUSB_ERROR_NO_DEVICE)
+		ad->is_disconnected = 1;
+	else if (r == 0)
+		ad->probe_cached = 0;
+	else if (r != LIBUSB_ERROR_TIMEOUT)
+		accessory_probe_invalidate(ad);
+	if (r != 0 && transferred == 0)
+		return r;
+
+	if (r == 0 && ad->aoa_max_packet_size > 0 && size % ad->aoa_max_packet_size == 0)
+		libusb_bulk_transfer(ad->handle, ad->aoa_endpoint_out, buffer, 0, &zlp_transferred, TX_TIMEOUT);
+
+	return transferred;
+}
+
+/**
+ * one bulk transfer on buffer, a zero length packet is appended when size is a multiple of the endpoint max
+ * packet size
+ */
+static int accessory_usb_submit_data(accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data) {
+	accessory_tx *tx;
+	int r;
+
+	if (ad == NULL || ad->is_disconnected)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	// transfers are recycled through a per device free list, so the hot path does not allocate
+	tx = ad->tx_free_list;
+	if (tx != NULL) {
+		ad->tx_free_list = tx->next;
+	} else {
+		tx = malloc(sizeof(accessory_tx));
+		if (tx == NULL)
+			return LIBUSB_ERROR_NO_MEM;
+		tx->transfer = libusb_alloc_transfer(0);
+		if (tx->transfer == NULL) {
+			free(tx);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	tx->ad = ad;
+	tx->callback = callback;
+	tx->user_data = user_data;
+
+	libusb_fill_bulk_transfer(tx->transfer, ad->handle, ad->aoa_endpoint_out, buffer, size, accessory_submit_completed, tx, TX_TIMEOUT);
+	tx->transfer->flags = LIBUSB_TRANSFER_ADD_ZERO_PACKET;
+
+	r = libusb_submit_transfer(tx->transfer);
+	if (r < 0) {
+		tx->next = ad->tx_free_list;
+		ad->tx_free_list = tx;
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			ad->is_disconnected = 1;
+		else
+			accessory_probe_invalidate(ad);
+		return r;
+	}
+	ad->tx_pending++;
+
+	return 0;
+}
+
+static void accessory_submit_completed(struct libusb_transfer *transfer) {
+	accessory_tx *tx = transfer->user_data;
+	accessory_device *ad = tx->ad;
+	int result;
+
+	ad->tx_pending--;
+	if (ad->abandoned)
+		return;
+	tx->next = ad->tx_free_list;
+	ad->tx_free_list = tx;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		ad->probe_cached = 0;
+		result = transfer->actual_length;
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+	case LIBUSB_TRANSFER_CANCELLED:
+		result = transfer->actual_length;
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		ad->is_disconnected = 1;
+		result = LIBUSB_ERROR_NO_DEVICE;
+		break;
+	case LIBUSB_TRANSFER_STALL:
+		result = LIBUSB_ERROR_PIPE;
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		result = LIBUSB_ERROR_OVERFLOW;
+		break;
+	default:
+		result = LIBUSB_ERROR_IO;
+		break;
+	}
+	if (result < 0 && result != LIBUSB_ERROR_NO_DEVICE)
+		accessory_probe_invalidate(ad);
+
+	if (tx->callback != NULL)
+		tx->callback(ad, transfer->buffer, result, tx->user_data);
+}
+
+/**
+ * queue_depth IN transfers always submitted on the accessory endpoint, so the pipe never waits for the host.
+ * Completions of the same endpoint arrive in submission order. Buffers are allocated once here and reused until
+ * accessory_stop_transfers().
+ */
+static int accessory_usb_start_receiving(accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data) {
+	int i, r;
+
+	if (ctx == NULL || ad == NULL || ad->rx_transfers != NULL || ad->abandoned || queue_depth < 1)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ad->rx_buffers = malloc((size_t) queue_depth * buffer_size);
+	ad->rx_transfers = calloc(queue_depth, sizeof(struct libusb_transfer *));
+	ad->rx_held = calloc(queue_depth, sizeof(struct libusb_transfer *));
+	if (ad->rx_buffers == NULL || ad->rx_transfers == NULL || ad->rx_held == NULL) {
+		accessory_usb_stop_transfers(ad);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	ad->rx_queue_depth = queue_depth;
+	ad->rx_stopping = 0;
+	ad->rx_held_head = 0;
+	ad->rx_held_count = 0;
+
+	ad->rx_callback = callback;
+	ad->rx_user_data = user_data;
+
+	for (i = 0; i < queue_depth; i++) {
+		ad->rx_transfers[i] = libusb_alloc_transfer(0);
+		if (ad->rx_transfers[i] == NULL) {
+			accessory_usb_stop_transfers(ad);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		libusb_fill_bulk_transfer(ad->rx_transfers[i], ad->handle, ad->aoa_endpoint_in, &ad->rx_buffers[(size_t) i * buffer_size], buffer_size, accessory_receive_completed, ad, 0);
+	}
+
+	for (i = 0; i < queue_depth; i++) {
+		r = libusb_submit_transfer(ad->rx_transfers[i]);
+		if (r < 0) {
+			if (r != LIBUSB_ERROR_NO_DEVICE)
+				accessory_probe_invalidate(ad);
+			accessory_usb_stop_transfers(ad);
+			return r;
+		}
+		ad->rx_pending++;
+	}
+
+	return 0;
+}
+
+static void accessory_receive_completed(struct libusb_transfer *transfer) {
+	accessory_device *ad = transfer->user_data;
+	int r;
+
+	ad->rx_pending--;
+	if (ad->abandoned)
+		return;
+
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		ad->probe_cached = 0;
+		if (transfer->actual_length > 0 && !ad->rx_stopping) {
+			// once a transfer is held the following ones queue behind it to preserve data order
+			if (ad->rx_held_count > 0 || ad->rx_callback(ad, transfer->buffer, transfer->actual_length, ad->rx_user_data) == ACCESSORY_RX_HOLD) {
+				ad->rx_held[(ad->rx_held_head + ad->rx_held_count++) % ad->rx_queue_depth] = transfer;
+				return;
+			}
+		}
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		// every queued transfer fails the same way, report it once
+		if (!ad->is_disconnected) {
+			ad->is_disconnected = 1;
+			ad->rx_callback(ad, NULL, LIBUSB_ERROR_NO_DEVICE, ad->rx_user_data);
+		}
+		return;
+	default:
+		accessory_probe_invalidate(ad);
+		ad->rx_callback(ad, NULL, LIBUSB_ERROR_IO, ad->rx_user_data);
+		break;
+	}
+
+	if (ad->rx_stopping || ad->is_disconnected)
+		return;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			ad->is_disconnected = 1;
+		ad->rx_callback(ad, NULL, r, ad->rx_user_data);
+		return;
+	}
+	ad->rx_pending++;
+}
+
+/**
+ * deliver again the data of held IN transfers, in completion order, and resubmit the ones consumed
+ */
+static void accessory_usb_resume_receiving(accessory_device *ad) {
+	int r;
+
+	if (ad == NULL)
+		return;
+
+	while (ad->rx_held_count > 0 && !ad->rx_stopping && !ad->is_disconnected) {
+		struct libusb_transfer *transfer = ad->rx_held[ad->rx_held_head];
+
+		if (ad->rx_callback(ad, transfer->buffer, transfer->actual_length, ad->rx_user_data) == ACCESSORY_RX_HOLD)
+			return;
+
+		ad->rx_held_head = (ad->rx_held_head + 1) % ad->rx_queue_depth;
+		ad->rx_held_count--;
+
+		r = libusb_submit_transfer(transfer);
+		if (r < 0) {
+			if (r == LIBUSB_ERROR_NO_DEVICE)
+				ad->is_disconnected = 1;
+			ad->rx_callback(ad, NULL, r, ad->rx_user_data);
+			return;
+		}
+		ad->rx_pending++;
+	}
+}
+
+/**
+ * cancel the IN transfers, wait for them and for any submitted OUT transfer to complete, then release buffers.
+ */
+static void accessory_usb_stop_transfers(accessory_device *ad) {
+	struct timeval tv = { 0, 100000 };
+	int waited_ms = 0;
+	int i;
+
+	if (ctx == NULL || ad == NULL)
+		return;
+
+	ad->rx_stopping = 1;
+	if (ad->rx_pending > 0) {
+		for (i = 0; i < ad->rx_queue_depth; i++) {
+			if (ad->rx_transfers[i] != NULL)
+				libusb_cancel_transfer(ad->rx_transfers[i]);
+		}
+	}
+
+	while ((ad->rx_pending > 0 || ad->tx_pending > 0) && waited_ms < STOP_TIMEOUT_MS) {
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		waited_ms += 100;
+	}
+
+	// transfers still in flight here own their buffers and point to ad, so leak them rather than free memory in
+	// use, and drop their completions: the owner of the callbacks is gone
+	ad->abandoned = ad->rx_pending > 0 || ad->tx_pending > 0;
+	if (ad->rx_pending == 0) {
+		if (ad->rx_transfers != NULL) {
+			for (i = 0; i < ad->rx_queue_depth; i++)
+				libusb_free_transfer(ad->rx_transfers[i]);
+			free(ad->rx_transfers);
+		}
+		free(ad->rx_buffers);
+		free(ad->rx_held);
+	}
+	ad->rx_transfers = NULL;
+	ad->rx_held = NULL;
+	ad->rx_held_count = 0;
+	ad->rx_buffers = NULL;
+	ad->rx_queue_depth = 0;
+
+	while (ad->tx_free_list != NULL) {
+		accessory_tx *tx = ad->tx_free_list;
+		ad->tx_free_list = tx->next;
+		libusb_free_transfer(tx->transfer);
+		free(tx);
+	}
+}
+
+/**
+ * register libusb file descriptors in the event loop and keep them in sync.
+ */
+int accessory_attach_event_loop() {
+	const struct libusb_pollfd **pollfds;
+	int i;
+
+	if (ctx == NULL)
+		return -1;
+
+	pollfds = libusb_get_pollfds(ctx);
+	if (pollfds == NULL)
+		return -1;
+
+	for (i = 0; pollfds[i] != NULL; i++)
+		accessory_pollfd_added(pollfds[i]->fd, pollfds[i]->events, NULL);
+	libusb_free_pollfds(pollfds);
+
+	libusb_set_pollfd_notifiers(ctx, accessory_pollfd_added, accessory_pollfd_removed, NULL);
+
+	switch_timer_fd = evloop_timer_create();
+	if (switch_timer_fd >= 0 && evloop_add(switch_timer_fd, EPOLLIN, accessory_switch_expired, NULL) < 0) {
+		close(switch_timer_fd);
+		switch_timer_fd = -1;
+	}
+
+	return 0;
+}
+
+void accessory_detach_event_loop() {
+	const struct libusb_pollfd **pollfds;
+	int i;
+
+	if (ctx == NULL)
+		return;
+
+	accessory_switch_clear();
+	if (switch_timer_fd >= 0) {
+		evloop_remove(switch_timer_fd);
+		close(switch_timer_fd);
+		switch_timer_fd = -1;
+	}
+
+	libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+
+	pollfds = libusb_get_pollfds(ctx);
+	if (pollfds == NULL)
+		return;
+
+	for (i = 0; pollfds[i] != NULL; i++)
+		evloop_remove(pollfds[i]->fd);
+	libusb_free_pollfds(pollfds);
+}
+
+/**
+ * return the time in ms before libusb needs to handle an internal timeout, or timeout_ms if none is pending
+ * or if it expires later.
+ */
+int accessory_get_next_timeout(int timeout_ms) {
+	struct timeval tv;
+	int ms;
+
+	if (ctx == NULL || libusb_get_next_timeout(ctx, &tv) != 1)
+		return timeout_ms;
+
+	ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+	if (timeout_ms >= 0 && timeout_ms < ms)
+		return timeout_ms;
+
+	return ms;
+}
+
+/**
+ * handle libusb events without blocking, callbacks of completed transfers are called from here.
+ */
+void accessory_handle_events() {
+	struct timeval tv = { 0, 0 };
+
+	if (ctx != NULL)
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+/**
+ * get notified of device arrivals: through libusb hotplug when available, otherwise through kernel uevents read
+ * from a netlink socket. callback is called from the event loop, the new devices are then probed with
+ * accessory_get_arrived_device(). Returns -1 when neither is available and the bus must be polled.
+ */
+int accessory_enable_hotplug(accessory_arrival_callback callback, void *user_data) {
+	struct sockaddr_nl addr;
+
+	if (ctx == NULL)
+		return -1;
+
+	arrival_callback = callback;
+	arrival_user_data = user_data;
+
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		int r = libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
+				LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, accessory_hotplug_event, NULL, &hotplug_handle);
+		if (r == LIBUSB_SUCCESS) {
+			hotplug_registered = 1;
+			accessory_retry_start();
+			return 0;
+		}
+	}
+
+	// the kernel broadcasts uevents on group 1 of NETLINK_KOBJECT_UEVENT, no udev daemon needed
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(uevent_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || evloop_add(uevent_fd, EPOLLIN, accessory_uevent_ready, NULL) < 0) {
+		close(uevent_fd);
+		uevent_fd = -1;
+		return -1;
+	}
+	accessory_retry_start();
+
+	return 0;
+}
+
+/**
+ * without the timer probe failures are not retried, the next full scan finds the device anyway
+ */
+static void accessory_retry_start() {
+	retry_timer_fd = evloop_timer_create();
+	if (retry_timer_fd >= 0 && evloop_add(retry_timer_fd, EPOLLIN, accessory_retry_expired, NULL) < 0) {
+		close(retry_timer_fd);
+		retry_timer_fd = -1;
+	}
+}
+
+void accessory_disable_hotplug() {
+	if (hotplug_registered) {
+		libusb_hotplug_deregister_callback(ctx, hotplug_handle);
+		hotplug_registered = 0;
+	}
+	if (uevent_fd >= 0) {
+		evloop_remove(uevent_fd);
+		close(uevent_fd);
+		uevent_fd = -1;
+	}
+	if (retry_timer_fd >= 0) {
+		evloop_remove(retry_timer_fd);
+		close(retry_timer_fd);
+		retry_timer_fd = -1;
+	}
+	while (retries != NULL)
+		accessory_retry_cancel(retries->dev);
+	accessory_clear_arrived();
+	free(arrived);
+	arrived = NULL;
+	arrived_size = 0;
+	arrival_callback = NULL;
+}
+
+static void accessory_add_arrived(libusb_device *dev) {
+	if (arrived_count == arrived_size) {
+		int size = arrived_size > 0 ? arrived_size * 2 : 16;
+		libusb_device **grown = realloc(arrived, size * sizeof(libusb_device *));
+		if (grown == NULL)
+			return;
+		arrived = grown;
+		arrived_size = size;
+	}
+
+	arrived[arrived_count++] = libusb_ref_device(dev);
+	arrival_seen = 1;
+	// may be a phone switching, look for it from the event loop: hotplug callbacks must not do I/O
+	if (switching != NULL) {
+		switch_arrival = 1;
+		evloop_timer_arm(switch_timer_fd, 1, 0);
+	}
+
+	if (arrival_callback != NULL)
+		arrival_callback(arrival_user_data);
+}
+
+static void accessory_clear_arrived() {
+	while (arrived_count > 0)
+		libusb_unref_device(arrived[--arrived_count]);
+}
+
+/**
+ * libusb hotplug callbacks must not do I/O on the device: arrivals are only recorded and probed later
+ */
+static int accessory_hotplug_event(libusb_context *context, libusb_device *dev, libusb_hotplug_event event, void *user_data) {
+	int i;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		accessory_add_arrived(dev);
+		return 0;
+	}
+
+	accessory_retry_cancel(dev);
+	for (i = 0; i < arrived_count; i++) {
+		if (arrived[i] == dev) {
+			libusb_unref_device(dev);
+			arrived_count--;
+			memmove(&arrived[i], &arrived[i + 1], (arrived_count - i) * sizeof(libusb_device *));
 			break;
-		if (transferred > 0) {
-			sent += transferred;
-			tries = 0;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * read the pending kernel uevents and record the USB devices added, found in the libusb device list by bus
+ * number and address
+ */
+static void accessory_uevent_ready(int fd, uint32_t events, void *user_data) {
+	char buffer[UEVENT_BUFFER_SIZE];
+	ssize_t cnt;
+
+	while ((cnt = recv(fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+		int is_add = 0, is_usb_device = 0, bus_number = -1, address = -1;
+		char *key;
+
+		// "ACTION@DEVPATH" header followed by KEY=VALUE strings, each NUL terminated
+		buffer[cnt] = 0;
+		for (key = buffer; key < buffer + cnt; key += strlen(key) + 1) {
+			if (strcmp(key, "ACTION=add") == 0)
+				is_add = 1;
+			else if (strcmp(key, "DEVTYPE=usb_device") == 0)
+				is_usb_device = 1;
+			else if (strncmp(key, "BUSNUM=", 7) == 0)
+				bus_number = atoi(key + 7);
+			else if (strncmp(key, "DEVNUM=", 7) == 0)
+				address = atoi(key + 7);
+		}
+		if (!is_add || !is_usb_device || bus_number < 0 || address < 0)
 			continue;
+
+		libusb_device **devs;
+		ssize_t i, n = libusb_get_device_list(ctx, &devs);
+		for (i = 0; i < n; i++) {
+			if (libusb_get_bus_number(devs[i]) == bus_number && libusb_get_device_address(devs[i]) == address) {
+				accessory_add_arrived(devs[i]);
+				break;
+			}
 		}
-		if (++tries >= MAX_TRIES)
-			break;
+		if (n >= 0)
+			libusb_free_device_list(devs, 1);
 	}
+}
+
+static void accessory_pollfd_added(int fd, short events, void *user_data) {
+	uint32_t ep_events = 0;
+
+	if (events & POLLIN)
+		ep_events |= EPOLLIN;
+	if (events & POLLOUT)
+		ep_events |= EPOLLOUT;
+
+	evloop_add(fd, ep_events, accessory_pollfd_ready, NULL);
+}
+
+static void accessory_pollfd_removed(int fd, void *user_data) {
+	evloop_remove(fd);
+}
 
-	return;
+static void accessory_pollfd_ready(int fd, uint32_t events, void *user_data) {
+	accessory_handle_events();
 }
@@ -26,26 +26,142 @@
 
 #include <stdint.h>
 
+struct accessory_device;
+
+#define ACCESSORY_PORT_PATH_SIZE		32
+#define ACCESSORY_SERIAL_SIZE			128
+#define ACCESSORY_STRING_SIZE			256
+
+#define ACCESSORY_RX_CONSUMED			0
+#define ACCESSORY_RX_HOLD				1
+
+/**
+ * called for every completed IN transfer. On errors buffer is NULL and size holds the LIBUSB_ERROR_* code.
+ * Returning ACCESSORY_RX_HOLD leaves the data in the transfer, which is parked with the ones completed after it
+ * until accessory_resume_receiving() delivers them again.
+ */
+typedef int (*accessory_receive_callback)(struct accessory_device *ad, unsigned char *buffer, int size, void *user_data);
+
+/**
+ * called when an OUT transfer submitted with accessory_submit_data() completes. result is the number of bytes sent
+ * or a LIBUSB_ERROR_* code, buffer is released to the caller.
+ */
+typedef void (*accessory_send_callback)(struct accessory_device *ad, unsigned char *buffer, int result, void *user_data);
+
+/**
+ * selects a physical device: every field set must match, zero or empty fields match anything. port_path and
+ * serial survive the switch to accessory mode, vendor_id and product_id are those before the switch.
+ */
+typedef struct {
+	uint16_t vendor_id;
+	uint16_t product_id;
+	char port_path[ACCESSORY_PORT_PATH_SIZE];
+	char serial[ACCESSORY_SERIAL_SIZE];
+	int loopback;					// no USB device, an in process echo loopback
+} accessory_selector;
+
+/**
+ * called during enumeration with a candidate device still untouched, first before it is opened: vendor_id,
+ * product_id and port_path are set and serial_known is 0, returning 0 leaves the device alone. Otherwise it is
+ * opened, its serial read and the callback called again with serial_known set. Returns non zero to take the device
+ * and switch it to accessory mode.
+ */
+typedef int (*accessory_match_callback)(const struct accessory_device *candidate, void *user_data);
+
+/**
+ * called from the event loop when devices were plugged in, to be probed with accessory_get_arrived_device()
+ */
+typedef void (*accessory_arrival_callback)(void *user_data);
+
+/**
+ * duration of each phase of the switch to accessory mode, all 0 for a device found already switched
+ */
 typedef struct {
+	unsigned int protocol_us;			// ACCESSORY_GET_PROTOCOL, 0 when known from the probe cache
+	unsigned int strings_us;			// identification strings
+	unsigned int start_us;				// ACCESSORY_START and release of the device
+	unsigned int reenumeration_us;		// until the device is back as 18D1:2D0x
+	unsigned int claim_us;				// interface claim and endpoints
+	unsigned int total_us;
+} accessory_timings;
+
+/**
+ * data path of a device in accessory mode, with the semantics of the accessory_* function of the same name.
+ * libusb drives a real phone, the loopback transport stands for one in process.
+ */
+typedef struct accessory_transport {
+	int (*start_receiving)(struct accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data);
+	void (*resume_receiving)(struct accessory_device *ad);
+	int (*submit_data)(struct accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data);
+	int (*send_data)(struct accessory_device *ad, unsigned char *buffer, int size);
+	void (*stop_transfers)(struct accessory_device *ad);
+	void (*free_device)(struct accessory_device *ad);
+} accessory_transport;
+
+typedef struct accessory_device {
 	uint16_t vendor_id;
 	uint16_t product_id;
+	char port_path[ACCESSORY_PORT_PATH_SIZE];	// physical position as in sysfs: "bus-port.port..."
+	char serial[ACCESSORY_SERIAL_SIZE];		// iSerialNumber, empty if not available
+	int serial_known;				// serial was read, a match callback before the device is opened sees 0
 	int aoa_version;
 	uint16_t aoa_vendor_id;
 	uint16_t aoa_product_id;
 	uint8_t aoa_endpoint_in;
 	uint8_t aoa_endpoint_out;
+	uint16_t aoa_max_packet_size;
 	int was_interface_claimed;
 	int was_kernel_driver_detached;
+	int is_disconnected;
+	int probe_cached;				// set up from the probe cache, not yet confirmed by a transfer
+	accessory_timings setup_timings;
+	const accessory_transport *transport;
+	void *transport_data;				// owned by the transport
 	struct libusb_device_handle *handle;
+	struct libusb_transfer **rx_transfers;
+	unsigned char *rx_buffers;
+	int rx_queue_depth;
+	int rx_pending;
+	int rx_stopping;
+	struct libusb_transfer **rx_held;
+	int rx_held_head;
+	int rx_held_count;
+	int tx_pending;
+	int abandoned;					// transfers left in flight by accessory_stop_transfers(), completions are ignored
+	accessory_receive_callback rx_callback;
+	void *rx_user_data;
+	struct accessory_tx *tx_free_list;
 } accessory_device;
 
 void accessory_finalize();
 accessory_device *accessory_get_device();
 accessory_device *accessory_get_device_with_vid_pid(uint16_t vendor_id, uint16_t product_id);
+accessory_device *accessory_get_device_matching(accessory_match_callback match, void *user_data);
+accessory_device *accessory_get_arrived_device(accessory_match_callback match, void *user_data);
+int accessory_switch_pending(accessory_match_callback match, void *user_data);
+int accessory_selector_parse(const char *text, accessory_selector *selector);
+int accessory_selector_matches(const accessory_selector *selector, const accessory_device *ad);
+int accessory_set_identity(const char *key, const char *value);
+int accessory_load_identity(const char *file_name);
+void accessory_set_audio_mode(int enable);
+int accessory_register_hid(accessory_device *ad, int id, const unsigned char *descriptor, int size);
+void accessory_unregister_hid(accessory_device *ad, int id);
+int accessory_send_hid_event(accessory_device *ad, int id, const unsigned char *report, int size);
+int accessory_enable_hotplug(accessory_arrival_callback callback, void *user_data);
+void accessory_disable_hotplug();
 void accessory_free_device(accessory_device *ad);
 int accessory_init();
 int accessory_get_endpoints(accessory_device *ad);
 int accessory_receive_data(accessory_device *ad, unsigned char *buffer, int buffer_size);
-void accessory_send_data(accessory_device *ad, unsigned char *buffer, int size);
+int accessory_send_data(accessory_device *ad, unsigned char *buffer, int size);
+int accessory_submit_data(accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data);
+int accessory_start_receiving(accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data);
+void accessory_resume_receiving(accessory_device *ad);
+void accessory_stop_transfers(accessory_device *ad);
+int accessory_transfers_pending(accessory_device *ad);
+int accessory_attach_event_loop();
+void accessory_detach_event_loop();
+int accessory_get_next_timeout(int timeout_ms);
+void accessory_handle_events();
 
 #endif /* ACCESSORY_H_ */
@@ -0,0 +1,390 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "accessory_loopback.h"
+
+#include <errno.h>
+#include <libusb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "evloop.h"
+
+#define LOOPBACK_VENDOR_ID				0x18D1
+#define LOOPBACK_PRODUCT_ID			0x2D00
+#define LOOPBACK_MAX_PACKET_SIZE		512
+#define LOOPBACK_ECHO_BUFFER_SIZE		65536
+#define LOOPBACK_RX_BURST				16		// packets delivered per wakeup, for fairness with other bridges
+#define TX_TIMEOUT						1000
+
+typedef struct {
+	unsigned char *buffer;
+	int size;
+	accessory_send_callback callback;
+	void *user_data;
+} loopback_tx;
+
+/**
+ * a socket pair stands for the USB pipe: SOCK_SEQPACKET keeps the boundaries of every transfer. The
+ * accessory side is ours, the peer side plays the phone.
+ */
+typedef struct {
+	int fd;
+	int peer_fd;
+	int watched;
+	int mode;
+	int receiving;
+	unsigned char *rx_buffer;
+	int rx_buffer_size;
+	int rx_held_size;				// data refused by the receive callback, 0 if none
+	loopback_tx *tx;
+	int tx_head;
+	int tx_count;
+	int tx_size;
+	unsigned char *echo_buffer;
+	int echo_size;				// waiting for room to be sent back, 0 if none
+} loopback;
+
+static int loopback_start_receiving(accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data);
+static void loopback_resume_receiving(accessory_device *ad);
+static int loopback_submit_data(accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data);
+static int loopback_send_data(accessory_device *ad, unsigned char *buffer, int size);
+static void loopback_stop_transfers(accessory_device *ad);
+static void loopback_free_device(accessory_device *ad);
+static void loopback_ready(int fd, uint32_t events, void *user_data);
+static void loopback_send_pending(accessory_device *ad);
+static void loopback_receive(accessory_device *ad);
+static void loopback_complete_pending(accessory_device *ad, int result);
+static void loopback_update_events(accessory_device *ad);
+static void loopback_echo_ready(int fd, uint32_t events, void *user_data);
+
+static const accessory_transport loopback_transport = {
+		loopback_start_receiving,
+		loopback_resume_receiving,
+		loopback_submit_data,
+		loopback_send_data,
+		loopback_stop_transfers,
+		loopback_free_device,
+};
+
+/**
+ * an accessory device in accessory mode without any USB: with ACCESSORY_LOOPBACK_ECHO whatever is sent to it
+ * comes back, as the echo demo app does. With ACCESSORY_LOOPBACK_PEER the phone is the descriptor returned by
+ * accessory_loopback_get_peer_fd(), where each read returns one OUT transfer and each write makes one IN
+ * transfer. The event loop must be initialized. Returns NULL on error.
+ */
+accessory_device *accessory_loopback_open(int mode) {
+	int fds[2];
+
+	accessory_device *ad = calloc(1, sizeof(accessory_device));
+	loopback *lb = calloc(1, sizeof(loopback));
+	if (ad == NULL || lb == NULL) {
+		free(ad);
+		free(lb);
+		return NULL;
+	}
+
+	ad->vendor_id = ad->aoa_vendor_id = LOOPBACK_VENDOR_ID;
+	ad->product_id = ad->aoa_product_id = LOOPBACK_PRODUCT_ID;
+	ad->aoa_version = 1;
+	ad->aoa_max_packet_size = LOOPBACK_MAX_PACKET_SIZE;
+	strcpy(ad->port_path, "loopback");
+	ad->transport = &loopback_transport;
+	ad->transport_data = lb;
+	lb->fd = lb->peer_fd = -1;
+	lb->mode = mode;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) {
+		loopback_free_device(ad);
+		return NULL;
+	}
+	lb->fd = fds[0];
+	lb->peer_fd = fds[1];
+
+	if (evloop_add(lb->fd, 0, loopback_ready, ad) < 0) {
+		loopback_free_device(ad);
+		return NULL;
+	}
+	lb->watched = 1;
+
+	if (mode == ACCESSORY_LOOPBACK_ECHO) {
+		lb->echo_buffer = malloc(LOOPBACK_ECHO_BUFFER_SIZE);
+		if (lb->echo_buffer == NULL || evloop_add(lb->peer_fd, EPOLLIN, loopback_echo_ready, lb) < 0) {
+			loopback_free_device(ad);
+			return NULL;
+		}
+	}
+
+	return ad;
+}
+
+/**
+ * phone side of a ACCESSORY_LOOPBACK_PEER device, not blocking and owned by the device
+ */
+int accessory_loopback_get_peer_fd(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+
+	return lb->mode == ACCESSORY_LOOPBACK_PEER ? lb->peer_fd : -1;
+}
+
+/**
+ * a single buffer stands for the whole IN queue: the socket already queues what the phone sent
+ */
+static int loopback_start_receiving(accessory_device *ad, int queue_depth, int buffer_size, accessory_receive_callback callback, void *user_data) {
+	loopback *lb = ad->transport_data;
+
+	if (lb->receiving)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	free(lb->rx_buffer);
+	lb->rx_buffer = malloc(buffer_size);
+	if (lb->rx_buffer == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+	lb->rx_buffer_size = buffer_size;
+	lb->rx_held_size = 0;
+	lb->receiving = 1;
+	ad->rx_callback = callback;
+	ad->rx_user_data = user_data;
+
+	loopback_update_events(ad);
+
+	return 0;
+}
+
+static void loopback_resume_receiving(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+
+	if (lb->rx_held_size == 0 || !lb->receiving || ad->is_disconnected)
+		return;
+
+	if (ad->rx_callback(ad, lb->rx_buffer, lb->rx_held_size, ad->rx_user_data) == ACCESSORY_RX_HOLD)
+		return;
+	lb->rx_held_size = 0;
+	loopback_update_events(ad);
+}
+
+/**
+ * queued and written when the socket has room, completing from the event loop as a USB transfer does
+ */
+static int loopback_submit_data(accessory_device *ad, unsigned char *buffer, int size, accessory_send_callback callback, void *user_data) {
+	loopback *lb = ad->transport_data;
+
+	if (lb->tx_count == lb->tx_size) {
+		int grown_size = lb->tx_size ? 2 * lb->tx_size : 8;
+		loopback_tx *grown = malloc(grown_size * sizeof(loopback_tx));
+		if (grown == NULL)
+			return LIBUSB_ERROR_NO_MEM;
+		int i;
+		for (i = 0; i < lb->tx_count; i++)
+			grown[i] = lb->tx[(lb->tx_head + i) % lb->tx_size];
+		free(lb->tx);
+		lb->tx = grown;
+		lb->tx_head = 0;
+		lb->tx_size = grown_size;
+	}
+
+	loopback_tx *tx = &lb->tx[(lb->tx_head + lb->tx_count++) % lb->tx_size];
+	tx->buffer = buffer;
+	tx->size = size;
+	tx->callback = callback;
+	tx->user_data = user_data;
+	ad->tx_pending++;
+
+	loopback_update_events(ad);
+
+	return 0;
+}
+
+static int loopback_send_data(accessory_device *ad, unsigned char *buffer, int size) {
+	loopback *lb = ad->transport_data;
+	struct pollfd fds;
+
+	fds.fd = lb->fd;
+	fds.events = POLLOUT;
+	while (1) {
+		ssize_t cnt = send(lb->fd, buffer, size, MSG_NOSIGNAL);
+		if (cnt >= 0)
+			return cnt;
+		if (errno == EPIPE || errno == ECONNRESET) {
+			ad->is_disconnected = 1;
+			return LIBUSB_ERROR_NO_DEVICE;
+		}
+		if (errno != EAGAIN && errno != EINTR)
+			return LIBUSB_ERROR_IO;
+		if (errno == EAGAIN && poll(&fds, 1, TX_TIMEOUT) == 0)
+			return LIBUSB_ERROR_TIMEOUT;
+	}
+}
+
+/**
+ * what the socket still accepts is sent, the rest completes with 0 bytes as cancelled USB transfers do
+ */
+static void loopback_stop_transfers(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+
+	lb->receiving = 0;
+	lb->rx_held_size = 0;
+	loopback_send_pending(ad);
+	loopback_complete_pending(ad, 0);
+	loopback_update_events(ad);
+}
+
+static void loopback_free_device(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+
+	if (lb->fd >= 0) {
+		loopback_stop_transfers(ad);
+		if (lb->watched)
+			evloop_remove(lb->fd);
+		close(lb->fd);
+	}
+	if (lb->peer_fd >= 0) {
+		if (lb->mode == ACCESSORY_LOOPBACK_ECHO)
+			evloop_remove(lb->peer_fd);
+		close(lb->peer_fd);
+	}
+	free(lb->rx_buffer);
+	free(lb->tx);
+	free(lb->echo_buffer);
+	free(lb);
+	free(ad);
+}
+
+static void loopback_ready(int fd, uint32_t events, void *user_data) {
+	accessory_device *ad = user_data;
+
+	if (events & EPOLLOUT)
+		loopback_send_pending(ad);
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		loopback_receive(ad);
+	loopback_update_events(ad);
+}
+
+static void loopback_send_pending(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+
+	while (lb->tx_count > 0 && !ad->is_disconnected) {
+		loopback_tx *tx = &lb->tx[lb->tx_head];
+
+		ssize_t cnt = send(lb->fd, tx->buffer, tx->size, MSG_NOSIGNAL);
+		if (cnt < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (cnt < 0) {
+			ad->is_disconnected = 1;
+			loopback_complete_pending(ad, LIBUSB_ERROR_NO_DEVICE);
+			return;
+		}
+
+		lb->tx_head = (lb->tx_head + 1) % lb->tx_size;
+		lb->tx_count--;
+		ad->tx_pending--;
+		if (tx->callback != NULL)
+			tx->callback(ad, tx->buffer, cnt, tx->user_data);
+	}
+}
+
+static void loopback_receive(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+	int i;
+
+	for (i = 0; i < LOOPBACK_RX_BURST && lb->receiving && lb->rx_held_size == 0 && !ad->is_disconnected; i++) {
+		ssize_t cnt = recv(lb->fd, lb->rx_buffer, lb->rx_buffer_size, MSG_TRUNC);
+		if (cnt < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (cnt <= 0) {
+			// the phone side was closed
+			ad->is_disconnected = 1;
+			ad->rx_callback(ad, NULL, LIBUSB_ERROR_NO_DEVICE, ad->rx_user_data);
+			return;
+		}
+		if (cnt > lb->rx_buffer_size) {
+			ad->rx_callback(ad, NULL, LIBUSB_ERROR_OVERFLOW, ad->rx_user_data);
+			continue;
+		}
+
+		if (ad->rx_callback(ad, lb->rx_buffer, cnt, ad->rx_user_data) == ACCESSORY_RX_HOLD)
+			lb->rx_held_size = cnt;
+	}
+}
+
+static void loopback_complete_pending(accessory_device *ad, int result) {
+	loopback *lb = ad->transport_data;
+
+	while (lb->tx_count > 0) {
+		loopback_tx *tx = &lb->tx[lb->tx_head];
+
+		lb->tx_head = (lb->tx_head + 1) % lb->tx_size;
+		lb->tx_count--;
+		ad->tx_pending--;
+		if (tx->callback != NULL)
+			tx->callback(ad, tx->buffer, result, tx->user_data);
+	}
+}
+
+/**
+ * watch for room while transfers are queued, and for data while receiving and nothing is held
+ */
+static void loopback_update_events(accessory_device *ad) {
+	loopback *lb = ad->transport_data;
+	uint32_t events = 0;
+
+	if (!lb->watched)
+		return;
+	// a closed peer is reported as EPOLLHUP whatever the events asked
+	if (ad->is_disconnected) {
+		evloop_remove(lb->fd);
+		lb->watched = 0;
+		return;
+	}
+	if (lb->tx_count > 0)
+		events |= EPOLLOUT;
+	if (lb->receiving && lb->rx_held_size == 0)
+		events |= EPOLLIN;
+	evloop_modify(lb->fd, events);
+}
+
+/**
+ * the phone of ACCESSORY_LOOPBACK_ECHO: every OUT transfer is sent back as an IN one
+ */
+static void loopback_echo_ready(int fd, uint32_t events, void *user_data) {
+	loopback *lb = user_data;
+
+	while (1) {
+		if (lb->echo_size == 0) {
+			ssize_t cnt = recv(fd, lb->echo_buffer, LOOPBACK_ECHO_BUFFER_SIZE, 0);
+			if (cnt <= 0)
+				break;
+			lb->echo_size = cnt;
+		}
+
+		if (send(fd, lb->echo_buffer, lb->echo_size, MSG_NOSIGNAL) < 0)
+			break;
+		lb->echo_size = 0;
+	}
+
+	// while an echo waits for room, stop reading: the accessory side is throttled as a real phone would do
+	evloop_modify(fd, lb->echo_size > 0 ? EPOLLOUT : EPOLLIN);
+}
@@ -0,0 +1,374 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE					// ppoll()
+
+#include "bench.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "accessory_loopback.h"
+#include "evloop.h"
+
+#define BENCH_STALL_NS					5000000000ULL	// without any data delivered the run is aborted
+#define BENCH_POLL_MS					100
+#define BENCH_READ_SIZE				65536
+#define BENCH_WRITE_BURST				64		// packets written per wakeup at most
+
+#define FLOW_USB_TO_UART				0
+#define FLOW_UART_TO_USB				1
+
+/**
+ * one direction of traffic through the bridge. Data follows a pattern of its stream offset, so the reader
+ * checks it without sharing anything with the writer but the packet send times.
+ */
+typedef struct {
+	int active;
+	int write_fd;
+	int read_fd;
+	int packet_writes;				// one write per packet: the accessory socket keeps transfer boundaries
+	unsigned long sent;
+	int partial;					// bytes of the current packet already written to a stream
+	unsigned long long written;
+	unsigned long long received;
+	unsigned long completed;			// packets whose last byte was received
+	unsigned long long corrupted;
+	uint64_t *sent_ns;
+	uint64_t *latency_ns;
+	uint64_t first_ns;
+	uint64_t last_ns;
+	unsigned char packet[BENCH_MAX_PACKET_SIZE];	// being written
+} bench_flow;
+
+typedef struct {
+	const bench_config *config;
+	bench_flow flows[2];
+	unsigned char read_buffer[BENCH_READ_SIZE];
+	atomic_int stop;
+	int done_fd;
+	int stalled;
+	uint64_t cpu_ns;				// of the generator thread
+} bench_state;
+
+static void *bench_generator(void *arg);
+static int bench_write(bench_state *s, bench_flow *flow, uint64_t start_ns);
+static int bench_read(bench_state *s, bench_flow *flow);
+static uint64_t bench_due_ns(bench_state *s, bench_flow *flow, uint64_t start_ns);
+static void bench_done(int fd, uint32_t events, void *user_data);
+static void bench_flow_report(bench_flow *flow, bench_flow_result *result);
+static unsigned char bench_pattern(unsigned long long offset);
+static int bench_compare(const void *a, const void *b);
+static uint64_t bench_time_ns();
+static uint64_t bench_process_cpu_ns();
+
+/**
+ * forward config->count packets in each direction through a bridge started with options between a loopback
+ * accessory and a pseudo terminal opened with uart, both driven from a generator thread playing phone and
+ * serial device. The event loop must be initialized. Returns 0, or -1 if the run could not be set up.
+ */
+int bench_run(const bench_config *config, const uart_config *uart, const bridge_options *options, bench_result *result) {
+	accessory_device *ad = NULL;
+	uart_port *port = NULL;
+	bridge *b = NULL;
+	int device_fd = -1;
+	int done = 0;
+	int r = -1;
+	int i;
+
+	memset(result, 0, sizeof(bench_result));
+	bench_state *s = calloc(1, sizeof(bench_state));
+	if (s == NULL)
+		return -1;
+	s->config = config;
+	s->done_fd = -1;
+	atomic_init(&s->stop, 0);
+
+	ad = accessory_loopback_open(ACCESSORY_LOOPBACK_PEER);
+	port = uart_open(UART_PTY, uart);
+	if (ad == NULL || port == NULL)
+		goto out;
+	device_fd = open(uart_get_peer_name(port), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	s->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (device_fd < 0 || s->done_fd < 0)
+		goto out;
+
+	s->flows[FLOW_USB_TO_UART].active = (config->directions & BENCH_USB_TO_UART) != 0;
+	s->flows[FLOW_USB_TO_UART].write_fd = accessory_loopback_get_peer_fd(ad);
+	s->flows[FLOW_USB_TO_UART].read_fd = device_fd;
+	s->flows[FLOW_USB_TO_UART].packet_writes = 1;
+	s->flows[FLOW_UART_TO_USB].active = (config->directions & BENCH_UART_TO_USB) != 0;
+	s->flows[FLOW_UART_TO_USB].write_fd = device_fd;
+	s->flows[FLOW_UART_TO_USB].read_fd = accessory_loopback_get_peer_fd(ad);
+	for (i = 0; i < 2; i++) {
+		s->flows[i].sent_ns = malloc(config->count * sizeof(uint64_t));
+		s->flows[i].latency_ns = malloc(config->count * sizeof(uint64_t));
+		if (s->flows[i].sent_ns == NULL || s->flows[i].latency_ns == NULL)
+			goto out;
+	}
+
+	b = bridge_start(ad, port, options);
+	if (b == NULL || evloop_add(s->done_fd, EPOLLIN, bench_done, &done) < 0)
+		goto out;
+
+	uint64_t cpu_start = bench_process_cpu_ns();
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, bench_generator, s) != 0)
+		goto out;
+
+	while (!done && bridge_get_state(b) == BRIDGE_RUNNING)
+		evloop_run_once(BENCH_POLL_MS);
+
+	atomic_store(&s->stop, 1);
+	pthread_join(thread, NULL);
+	result->forwarding_cpu_ns = bench_process_cpu_ns() - cpu_start - s->cpu_ns;
+	result->bridge_state = bridge_get_state(b);
+	result->stalled = s->stalled;
+	for (i = 0; i < 2; i++)
+		bench_flow_report(&s->flows[i], &result->flows[i]);
+	r = 0;
+
+out:
+	if (s->done_fd >= 0) {
+		evloop_remove(s->done_fd);
+		close(s->done_fd);
+	}
+	if (b != NULL) {
+		bridge_stop(b);
+		bridge_destroy(b);
+	}
+	accessory_free_device(ad);
+	if (device_fd >= 0)
+		close(device_fd);
+	uart_close(port);
+	for (i = 0; i < 2; i++) {
+		free(s->flows[i].sent_ns);
+		free(s->flows[i].latency_ns);
+	}
+	free(s);
+
+	return r;
+}
+
+/**
+ * writes the packets of both directions at the configured rate and checks what comes out on the other side
+ */
+static void *bench_generator(void *arg) {
+	bench_state *s = arg;
+	struct pollfd fds[2];
+	struct timespec cpu;
+	uint64_t start = bench_time_ns();
+	uint64_t progress = start;
+	int i;
+
+	while (!atomic_load(&s->stop)) {
+		uint64_t now = bench_time_ns();
+		uint64_t wake = now + BENCH_POLL_MS * 1000000ULL;
+		int finished = 1;
+
+		// both flows share the two descriptors, each one written by a flow and read by the other
+		fds[0].fd = s->flows[FLOW_USB_TO_UART].write_fd;
+		fds[1].fd = s->flows[FLOW_UART_TO_USB].write_fd;
+		fds[0].events = fds[1].events = 0;
+		for (i = 0; i < 2; i++) {
+			bench_flow *flow = &s->flows[i];
+			if (!flow->active)
+				continue;
+			if (flow->completed < s->config->count)
+				finished = 0;
+			fds[1 - i].events |= POLLIN;
+			if (flow->sent < s->config->count) {
+				uint64_t due = bench_due_ns(s, flow, start);
+				if (due <= now)
+					fds[i].events |= POLLOUT;
+				else if (due < wake)
+					wake = due;
+			}
+		}
+		if (finished)
+			break;
+
+		struct timespec timeout = { (wake - now) / 1000000000, (wake - now) % 1000000000 };
+		if (ppoll(fds, 2, &timeout, NULL) < 0 && errno != EINTR)
+			break;
+
+		for (i = 0; i < 2; i++) {
+			bench_flow *flow = &s->flows[i];
+			if (!flow->active)
+				continue;
+			if ((fds[i].revents & POLLOUT) && bench_write(s, flow, start) < 0)
+				atomic_store(&s->stop, 1);
+			if ((fds[1 - i].revents & (POLLIN | POLLHUP | POLLERR)) && bench_read(s, flow) > 0)
+				progress = bench_time_ns();
+		}
+
+		if (bench_time_ns() - progress > BENCH_STALL_NS) {
+			s->stalled = 1;
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	s->cpu_ns = cpu.tv_sec * 1000000000ULL + cpu.tv_nsec;
+	eventfd_write(s->done_fd, 1);
+
+	return NULL;
+}
+
+/**
+ * write the packets due, a packet counts as sent once completely written. Returns -1 on error
+ */
+static int bench_write(bench_state *s, bench_flow *flow, uint64_t start_ns) {
+	int size = s->config->packet_size;
+	int burst;
+
+	for (burst = 0; burst < BENCH_WRITE_BURST && flow->sent < s->config->count; burst++) {
+		if (flow->partial == 0) {
+			if (bench_due_ns(s, flow, start_ns) > bench_time_ns())
+				break;
+			int i;
+			for (i = 0; i < size; i++)
+				flow->packet[i] = bench_pattern(flow->written + i);
+		}
+
+		ssize_t cnt;
+		if (flow->packet_writes)
+			cnt = send(flow->write_fd, flow->packet, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+		else
+			cnt = write(flow->write_fd, flow->packet + flow->partial, size - flow->partial);
+		if (cnt < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+		flow->partial += cnt;
+		if (flow->partial < size)
+			break;
+
+		uint64_t now = bench_time_ns();
+		if (flow->sent == 0)
+			flow->first_ns = now;
+		flow->sent_ns[flow->sent++] = now;
+		flow->written += size;
+		flow->partial = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * read what arrived, check it and time the packets completed. Returns the number of bytes read
+ */
+static int bench_read(bench_state *s, bench_flow *flow) {
+	unsigned long long size = s->config->packet_size;
+	int total = 0;
+
+	while (1) {
+		ssize_t cnt = read(flow->read_fd, s->read_buffer, sizeof(s->read_buffer));
+		if (cnt <= 0)
+			break;
+		total += cnt;
+
+		ssize_t i;
+		for (i = 0; i < cnt; i++) {
+			if (s->read_buffer[i] != bench_pattern(flow->received + i))
+				flow->corrupted++;
+		}
+		flow->received += cnt;
+
+		uint64_t now = bench_time_ns();
+		while (flow->completed < flow->sent && (flow->completed + 1) * size <= flow->received) {
+			flow->latency_ns[flow->completed] = now - flow->sent_ns[flow->completed];
+			flow->completed++;
+		}
+		flow->last_ns = now;
+	}
+
+	return total;
+}
+
+static uint64_t bench_due_ns(bench_state *s, bench_flow *flow, uint64_t start_ns) {
+	if (s->config->rate == 0)
+		return start_ns;
+
+	return start_ns + flow->sent * 1000000000ULL / s->config->rate;
+}
+
+static void bench_done(int fd, uint32_t events, void *user_data) {
+	eventfd_t value;
+
+	eventfd_read(fd, &value);
+	*(int *) user_data = 1;
+}
+
+static void bench_flow_report(bench_flow *flow, bench_flow_result *result) {
+	unsigned long count = flow->completed;
+
+	result->packets = count;
+	result->bytes = flow->received;
+	result->corrupted_bytes = flow->corrupted;
+	if (count == 0)
+		return;
+
+	result->elapsed_ns = flow->last_ns - flow->first_ns;
+	qsort(flow->latency_ns, count, sizeof(uint64_t), bench_compare);
+	result->latency_p50_ns = flow->latency_ns[(count - 1) * 500 / 1000];
+	result->latency_p99_ns = flow->latency_ns[(count - 1) * 990 / 1000];
+	result->latency_p999_ns = flow->latency_ns[(count - 1) * 999 / 1000];
+	result->latency_max_ns = flow->latency_ns[count - 1];
+}
+
+/**
+ * byte at offset of a flow, not periodic on 256 bytes so that a lost or repeated packet shows
+ */
+static unsigned char bench_pattern(unsigned long long offset) {
+	return (offset ^ (offset >> 8) ^ (offset >> 16)) & 0xFF;
+}
+
+static int bench_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_time_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_process_cpu_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
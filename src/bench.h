@@ -0,0 +1,68 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+
+#include "bridge.h"
+#include "uart.h"
+
+#define BENCH_USB_TO_UART				1
+#define BENCH_UART_TO_USB				2
+
+#define BENCH_MAX_PACKET_SIZE			16384
+
+typedef struct {
+	int packet_size;				// 1 to BENCH_MAX_PACKET_SIZE bytes
+	unsigned int rate;				// packets per second and direction, 0 for as fast as possible
+	unsigned long count;				// packets per direction
+	int directions;				// BENCH_USB_TO_UART and/or BENCH_UART_TO_USB
+} bench_config;
+
+/**
+ * one direction of a run. Latency is from the write of a whole packet on one side to the read of its last
+ * byte on the other one.
+ */
+typedef struct {
+	unsigned long packets;
+	unsigned long long bytes;
+	unsigned long long corrupted_bytes;
+	uint64_t elapsed_ns;
+	uint64_t latency_p50_ns;
+	uint64_t latency_p99_ns;
+	uint64_t latency_p999_ns;
+	uint64_t latency_max_ns;
+} bench_flow_result;
+
+typedef struct {
+	bench_flow_result flows[2];			// indexed by direction: usb to uart, uart to usb
+	uint64_t forwarding_cpu_ns;			// process CPU time, but the traffic generator
+	int stalled;					// a packet was not delivered within the stall timeout
+	int bridge_state;
+} bench_result;
+
+int bench_run(const bench_config *config, const uart_config *uart, const bridge_options *options, bench_result *result);
+
+#endif /* BENCH_H_ */
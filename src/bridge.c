@@ -0,0 +1,866 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bridge.h"
+
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "trace.h"
+#include "uart.h"
+#include "uart_worker.h"
+
+#define TX_SLOTS						4
+
+struct bridge {
+	accessory_device *ad;
+	uart_port *port;
+	bridge_options options;
+	int state;
+
+	// OUT transfers are sent without copy from a ring of slots, released in submission order on completion
+	unsigned char *tx_buffers;
+	int tx_sizes[TX_SLOTS];
+	unsigned long long tx_times[TX_SLOTS];		// when the data was read from the uart, 0 without metrics
+	int tx_tail;
+	int tx_count;
+
+	int uart_fd;
+	int uart_paused;
+	int listen_fd;					// socket target: uart_fd is the program connected, -1 until then
+
+	// metrics: when the uart data in rx_slot was read and when the accessory packet waiting for room arrived
+	unsigned long long rx_start_ns;
+	unsigned long long rx_hold_ns;
+
+	// idle gap framing: uart data is collected in rx_slot (or in the ring up to tx_ready) and sent when the line is idle
+	int gap_timer_fd;
+	unsigned char *rx_slot;
+	int rx_fill;
+	size_t tx_ready;
+
+	// threaded mode: uart I/O runs in worker threads, UART->USB transfers are sent in place from the ring
+	int threaded;
+	uart_worker worker;
+	size_t tx_reserved;
+
+	// frame aware mode: uart data goes through a ring (the worker one or rx_ring), scanned for frame ends up to
+	// scan_pos, and transfers carry the complete frames up to frames_end. Offsets are from the ring read position.
+	int framed;
+	framer framer;
+	ring_buffer rx_ring;
+	ring_buffer *from_uart;				// ring sent from, NULL when uart data is sent from the slots
+	size_t scan_pos;
+	size_t frames_end;
+	int coalesce_timer_fd;
+	int coalesce_armed;
+	int coalesce_due;
+	unsigned char flush_table[256];		// flush_bytes as a lookup table
+	size_t flush_end;				// past the last flush byte scanned and not yet sent, 0 if none
+
+	// adaptive coalescing: uart data arrivals seen up to the arrived offset, averaged interval and size. The
+	// averages are kept times 8, so that integer steps do not stop them short of a steady value.
+	size_t arrived;
+	unsigned long long last_arrival_ns;
+	unsigned long long arrival_gap_x8;
+	unsigned long long arrival_size_x8;
+};
+
+static unsigned char *bridge_tx_acquire(bridge *b);
+static void bridge_tx_unacquire(bridge *b);
+static void bridge_tx_send(bridge *b, unsigned char *slot, int size);
+static void bridge_usb_sent(accessory_device *ad, unsigned char *buffer, int result, void *user_data);
+static int bridge_usb_received(accessory_device *ad, unsigned char *buffer, int size, void *user_data);
+static void bridge_uart_ready(int fd, uint32_t events, void *user_data);
+static void bridge_ring_submit(bridge *b);
+static void bridge_worker_data(int fd, uint32_t events, void *user_data);
+static void bridge_worker_space(int fd, uint32_t events, void *user_data);
+static void bridge_print_ring_stats(bridge *b, const char *name, ring_buffer *ring);
+static void bridge_uart_update_events(bridge *b);
+static void bridge_uart_accept(int fd, uint32_t events, void *user_data);
+static int bridge_uart_attach(bridge *b);
+static void bridge_uart_detach(bridge *b);
+static void bridge_uart_failed(bridge *b, const char *message);
+static void bridge_gap_expired(int fd, uint32_t events, void *user_data);
+static void bridge_gap_flush(bridge *b);
+static void bridge_uart_read_ring(bridge *b);
+static size_t bridge_frame_next(bridge *b);
+static void bridge_frame_commit(bridge *b, size_t size);
+static unsigned long long bridge_coalesce_wait(bridge *b, size_t ready, size_t coalesce_size);
+static void bridge_coalesce_expired(int fd, uint32_t events, void *user_data);
+static void bridge_count_received(bridge *b, int size, unsigned long long start_ns);
+static unsigned long long bridge_now(bridge *b);
+
+/**
+ * start forwarding data between accessory and port (NULL in closed loop mode). The bridge is driven by the
+ * shared event loop: USB IN completions and uart readiness are handled as they arrive, for any number of
+ * bridges, until bridge_get_state() reports something other than BRIDGE_RUNNING. Returns NULL on error.
+ */
+bridge *bridge_start(accessory_device *ad, uart_port *port, const bridge_options *options) {
+	bridge *b;
+	int r;
+
+	b = calloc(1, sizeof(bridge));
+	if (b == NULL)
+		return NULL;
+
+	b->ad = ad;
+	b->port = port;
+	b->options = *options;
+	b->state = BRIDGE_RUNNING;
+	b->uart_fd = -1;
+	b->listen_fd = -1;
+	b->gap_timer_fd = -1;
+	b->coalesce_timer_fd = -1;
+	// the program on a socket target comes and goes, worker threads need a descriptor fixed for the session
+	b->threaded = options->threaded && options->closed_loop == 0 && uart_get_listen_fd(port) < 0;
+	b->framed = options->closed_loop == 0 && options->idle_gap_us == 0 &&
+			((options->framing.mode != FRAMER_RAW && options->framing.mode != FRAMER_IDLE) || options->coalesce_delay_us > 0);
+	framer_init(&b->framer, &options->framing);
+	for (r = 0; r < options->flush_byte_count; r++)
+		b->flush_table[options->flush_bytes[r]] = 1;
+	// until data is seen streaming, arrivals are taken as sparse and sent right away
+	b->arrival_gap_x8 = (unsigned long long) options->coalesce_delay_us * 8;
+	b->arrival_size_x8 = 8;
+
+	b->tx_buffers = malloc((size_t) TX_SLOTS * options->buffer_size);
+	if (b->tx_buffers == NULL) {
+		free(b);
+		return NULL;
+	}
+
+	if (options->idle_gap_us > 0 && options->closed_loop == 0) {
+		b->gap_timer_fd = evloop_timer_create();
+		if (b->gap_timer_fd < 0 || evloop_add(b->gap_timer_fd, EPOLLIN, bridge_gap_expired, b) < 0) {
+			if (b->gap_timer_fd >= 0)
+				close(b->gap_timer_fd);
+			free(b->tx_buffers);
+			free(b);
+			return NULL;
+		}
+	}
+	if (b->framed) {
+		b->coalesce_timer_fd = evloop_timer_create();
+		if (b->coalesce_timer_fd < 0 || evloop_add(b->coalesce_timer_fd, EPOLLIN, bridge_coalesce_expired, b) < 0) {
+			if (b->coalesce_timer_fd >= 0)
+				close(b->coalesce_timer_fd);
+			b->coalesce_timer_fd = -1;
+			b->state = BRIDGE_ERROR;
+			return b;
+		}
+		if (!b->threaded) {
+			if (ring_init(&b->rx_ring, options->ring_size) < 0) {
+				b->state = BRIDGE_ERROR;
+				return b;
+			}
+			b->from_uart = &b->rx_ring;
+		}
+	}
+	if (b->threaded) {
+		if (uart_worker_start(&b->worker, port, options->ring_size) < 0) {
+			b->state = BRIDGE_ERROR;
+			return b;
+		}
+		b->from_uart = &b->worker.from_uart;
+		evloop_add(b->worker.from_uart_data_fd, EPOLLIN, bridge_worker_data, b);
+		evloop_add(b->worker.to_uart_space_fd, EPOLLIN, bridge_worker_space, b);
+	} else if (options->closed_loop == 0 && uart_get_listen_fd(port) >= 0) {
+		if (evloop_add(uart_get_listen_fd(port), EPOLLIN, bridge_uart_accept, b) < 0) {
+			b->state = BRIDGE_ERROR;
+			return b;
+		}
+		b->listen_fd = uart_get_listen_fd(port);
+		// the program may have stayed connected from a previous session
+		if (uart_get_fd(port) >= 0 && bridge_uart_attach(b) < 0) {
+			b->state = BRIDGE_ERROR;
+			return b;
+		}
+	} else if (options->closed_loop == 0) {
+		if (bridge_uart_attach(b) < 0) {
+			b->state = BRIDGE_ERROR;
+			return b;
+		}
+	}
+	if (options->closed_loop == 0)
+		uart_set_metrics(port, options->metrics);
+
+	r = accessory_start_receiving(ad, options->usb_queue_depth, options->buffer_size, bridge_usb_received, b);
+	if (r < 0)
+		b->state = r == LIBUSB_ERROR_NO_DEVICE ? BRIDGE_DISCONNECTED : BRIDGE_ERROR;
+
+	return b;
+}
+
+/**
+ * BRIDGE_RUNNING while data is forwarded, otherwise the reason why forwarding stopped
+ */
+int bridge_get_state(bridge *b) {
+	if (b->ad->is_disconnected && b->state == BRIDGE_RUNNING)
+		b->state = BRIDGE_DISCONNECTED;
+
+	return b->state;
+}
+
+void bridge_stop(bridge *b) {
+	if (b->state == BRIDGE_RUNNING)
+		b->state = BRIDGE_QUIT;
+}
+
+/**
+ * stop forwarding, print the session statistics and release the bridge. Accessory and port are left to the
+ * caller. Returns the final state.
+ */
+int bridge_destroy(bridge *b) {
+	int state = bridge_get_state(b);
+	const char *name = b->options.name != NULL ? b->options.name : "";
+
+	if (b->uart_fd >= 0)
+		evloop_remove(b->uart_fd);
+	b->uart_fd = -1;
+	if (b->listen_fd >= 0)
+		evloop_remove(b->listen_fd);
+	b->listen_fd = -1;
+
+	if (b->gap_timer_fd >= 0) {
+		evloop_remove(b->gap_timer_fd);
+		close(b->gap_timer_fd);
+		b->gap_timer_fd = -1;
+	}
+	if (b->coalesce_timer_fd >= 0) {
+		evloop_remove(b->coalesce_timer_fd);
+		close(b->coalesce_timer_fd);
+		b->coalesce_timer_fd = -1;
+	}
+
+	if (b->threaded && b->worker.started) {
+		evloop_remove(b->worker.from_uart_data_fd);
+		evloop_remove(b->worker.to_uart_space_fd);
+	}
+
+	// waits for OUT transfers too, so slots and ring regions are no more in use after this
+	accessory_stop_transfers(b->ad);
+	// ...unless libusb could not cancel them in time: then the bridge and its buffers are leaked rather than
+	// freed while in use
+	int abandoned = accessory_transfers_pending(b->ad) > 0;
+
+	if (b->threaded) {
+		b->worker.keep_rings = abandoned;
+		uart_worker_stop(&b->worker);
+		bridge_print_ring_stats(b, "USB->UART", &b->worker.to_uart);
+		bridge_print_ring_stats(b, "UART->USB", &b->worker.from_uart);
+	}
+	if (b->options.closed_loop == 0) {
+		uart_stats stats;
+		uart_get_stats(b->port, &stats);
+		printf("%sUART TX: written %llu, queued %llu, dropped %llu bytes, %lu short writes\n", name, stats.bytes_written, stats.bytes_queued, stats.bytes_dropped, stats.short_writes);
+
+		uart_error_counters errors;
+		if (uart_get_error_counters(b->port, &errors) == 0)
+			printf("%sUART RX errors: overrun %lu, buffer overrun %lu, framing %lu, parity %lu, break %lu\n", name, errors.overrun, errors.buffer_overrun, errors.framing, errors.parity, errors.breaks);
+	}
+
+	if (!abandoned) {
+		free(b->tx_buffers);
+		ring_free(&b->rx_ring);
+		free(b);
+	}
+
+	return state;
+}
+
+static unsigned char *bridge_tx_acquire(bridge *b) {
+	if (b->tx_count == TX_SLOTS)
+		return NULL;
+
+	int slot = (b->tx_tail + b->tx_count++) % TX_SLOTS;
+	return &b->tx_buffers[(size_t) slot * b->options.buffer_size];
+}
+
+static void bridge_tx_unacquire(bridge *b) {
+	b->tx_count--;
+}
+
+static void bridge_tx_send(bridge *b, unsigned char *slot, int size) {
+	b->tx_sizes[(b->tx_tail + b->tx_count - 1) % TX_SLOTS] = size;
+	b->tx_times[(b->tx_tail + b->tx_count - 1) % TX_SLOTS] = b->rx_start_ns;
+
+	int r = accessory_submit_data(b->ad, slot, size, bridge_usb_sent, b);
+	if (r < 0) {
+		bridge_tx_unacquire(b);
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			b->state = BRIDGE_DISCONNECTED;
+		else {
+			fprintf(stderr, "USB send error: %s, dropped %d bytes\n", libusb_error_name(r), size);
+			if (b->options.metrics != NULL)
+				metrics_count_usb_error(b->options.metrics, r);
+		}
+		return;
+	}
+
+	if (b->options.trace != NULL)
+		b->options.trace(b->options.name, slot, size, TRACE_TX);
+}
+
+static void bridge_usb_sent(accessory_device *ad, unsigned char *buffer, int result, void *user_data) {
+	bridge *b = user_data;
+	int size = b->tx_sizes[b->tx_tail];
+	unsigned long long start_ns = b->tx_times[b->tx_tail];
+
+	b->tx_tail = (b->tx_tail + 1) % TX_SLOTS;
+	b->tx_count--;
+
+	if (b->from_uart != NULL) {
+		ring_read_commit(b->from_uart, size);
+		b->tx_reserved -= size;
+		if (b->tx_ready > 0)
+			b->tx_ready -= size;
+		if (b->framed)
+			bridge_frame_commit(b, size);
+		if (b->threaded)
+			uart_worker_signal(b->worker.from_uart_space_fd);
+	}
+
+	if (result == LIBUSB_ERROR_NO_DEVICE)
+		b->state = BRIDGE_DISCONNECTED;
+	else if (result < 0)
+		fprintf(stderr, "USB send error: %s, dropped %d bytes\n", libusb_error_name(result), size);
+	else if (result < size)
+		fprintf(stderr, "USB send timeout, dropped %d bytes\n", size - result);
+
+	metrics_slot *metrics = b->options.metrics;
+	if (metrics != NULL && result != LIBUSB_ERROR_NO_DEVICE) {
+		if (result < 0)
+			metrics_count_usb_error(metrics, result);
+		else {
+			if (result < size)
+				metrics_add(&metrics->usb_timeouts, 1);
+			metrics_add(&metrics->bytes[METRICS_UART_TO_USB], result);
+			metrics_add(&metrics->packets[METRICS_UART_TO_USB], 1);
+			if (start_ns != 0)
+				metrics_observe(&metrics->latency[METRICS_UART_TO_USB], metrics_now_ns() - start_ns);
+		}
+	}
+
+	// a slot is free again, resume reading the uart
+	if (b->uart_paused && b->uart_fd >= 0) {
+		b->uart_paused = 0;
+		bridge_uart_update_events(b);
+	}
+	if (b->from_uart != NULL && b->state == BRIDGE_RUNNING)
+		bridge_ring_submit(b);
+}
+
+static int bridge_usb_received(accessory_device *ad, unsigned char *buffer, int size, void *user_data) {
+	bridge *b = user_data;
+
+	if (size < 0) {
+		if (size == LIBUSB_ERROR_NO_DEVICE)
+			b->state = BRIDGE_DISCONNECTED;
+		else if (b->options.metrics != NULL)
+			metrics_count_usb_error(b->options.metrics, size);
+		return ACCESSORY_RX_CONSUMED;
+	}
+
+	// a held packet is delivered again once there is room, its latency starts from the first delivery
+	unsigned long long start_ns = b->rx_hold_ns != 0 ? b->rx_hold_ns : bridge_now(b);
+
+	if (b->threaded) {
+		// not enough room for the whole packet: keep it in the IN transfer, the phone is throttled meanwhile
+		if (ring_write(&b->worker.to_uart, buffer, size) == 0) {
+			b->rx_hold_ns = start_ns;
+			return ACCESSORY_RX_HOLD;
+		}
+		uart_worker_signal(b->worker.to_uart_data_fd);
+		if (b->options.trace != NULL)
+			b->options.trace(b->options.name, buffer, size, TRACE_RX);
+		bridge_count_received(b, size, start_ns);
+		return ACCESSORY_RX_CONSUMED;
+	}
+
+	if (b->options.closed_loop == 0) {
+		// the uart output queue has no room for the packet: hold it, EPOLLOUT resumes receiving
+		if (uart_get_pending_space(b->port) < size) {
+			b->rx_hold_ns = start_ns;
+			return ACCESSORY_RX_HOLD;
+		}
+		if (b->options.trace != NULL)
+			b->options.trace(b->options.name, buffer, size, TRACE_RX);
+		if (uart_send_buffer(b->port, buffer, size) < 0)
+			bridge_uart_failed(b, "Serial port write");
+		bridge_uart_update_events(b);
+		bridge_count_received(b, size, start_ns);
+		return ACCESSORY_RX_CONSUMED;
+	}
+
+	if (b->options.trace != NULL)
+		b->options.trace(b->options.name, buffer, size, TRACE_RX);
+	bridge_count_received(b, size, 0);
+	if (b->options.no_reply == 0) {
+		// the IN buffer is resubmitted on return, so the echo needs its own copy
+		unsigned char *slot = bridge_tx_acquire(b);
+		if (slot == NULL) {
+			fprintf(stderr, "USB send queue full, dropped %d bytes\n", size);
+			return ACCESSORY_RX_CONSUMED;
+		}
+		memcpy(slot, buffer, size);
+		bridge_tx_send(b, slot, size);
+	}
+
+	return ACCESSORY_RX_CONSUMED;
+}
+
+static void bridge_uart_ready(int fd, uint32_t events, void *user_data) {
+	bridge *b = user_data;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		if (b->listen_fd >= 0) {
+			bridge_uart_detach(b);
+			return;
+		}
+		fputs("Serial port error or hang-up !\n", stderr);
+		b->state = BRIDGE_ERROR;
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		if (uart_flush_pending(b->port) < 0) {
+			bridge_uart_failed(b, "Serial port write");
+			return;
+		}
+		bridge_uart_update_events(b);
+		accessory_resume_receiving(b->ad);
+	}
+
+	if (!(events & EPOLLIN))
+		return;
+
+	if (b->framed) {
+		bridge_uart_read_ring(b);
+		return;
+	}
+
+	unsigned char *slot = b->rx_slot != NULL ? b->rx_slot : bridge_tx_acquire(b);
+	if (slot == NULL) {
+		// every slot is in flight: leave data in the tty buffer until a transfer completes
+		b->uart_paused = 1;
+		bridge_uart_update_events(b);
+		return;
+	}
+
+	if (b->rx_fill == 0)
+		b->rx_start_ns = bridge_now(b);
+	ssize_t cnt = uart_receive(b->port, slot + b->rx_fill, b->options.buffer_size - b->rx_fill);
+	if (cnt < 0) {
+		bridge_uart_failed(b, "Serial port read");
+		cnt = 0;
+	}
+
+	if (b->gap_timer_fd < 0) {
+		if (cnt > 0)
+			bridge_tx_send(b, slot, cnt);
+		else
+			bridge_tx_unacquire(b);
+		return;
+	}
+
+	// idle gap framing: keep filling the slot, every new byte restarts the gap timer
+	b->rx_slot = slot;
+	b->rx_fill += cnt;
+	if (b->rx_fill == b->options.buffer_size)
+		bridge_gap_flush(b);
+	else if (cnt > 0)
+		evloop_timer_arm(b->gap_timer_fd, b->options.idle_gap_us, 0);
+	else if (b->rx_fill == 0) {
+		b->rx_slot = NULL;
+		bridge_tx_unacquire(b);
+	}
+}
+
+static void bridge_gap_expired(int fd, uint32_t events, void *user_data) {
+	bridge *b = user_data;
+
+	evloop_timer_ack(fd);
+
+	if (b->threaded) {
+		// everything received up to now is a complete frame
+		b->tx_ready = ring_used(b->from_uart);
+		bridge_ring_submit(b);
+	} else
+		bridge_gap_flush(b);
+}
+
+static void bridge_gap_flush(bridge *b) {
+	if (b->rx_slot == NULL)
+		return;
+
+	evloop_timer_arm(b->gap_timer_fd, 0, 0);
+	if (b->rx_fill > 0)
+		bridge_tx_send(b, b->rx_slot, b->rx_fill);
+	else
+		bridge_tx_unacquire(b);
+	b->rx_slot = NULL;
+	b->rx_fill = 0;
+}
+
+/**
+ * submit as OUT transfers, directly from the ring memory, the uart data not yet in flight
+ */
+static void bridge_ring_submit(bridge *b) {
+	ring_buffer *ring = b->from_uart;
+	size_t size;
+
+	while (b->tx_count < TX_SLOTS) {
+		unsigned char *data = ring_read_region(ring, b->tx_reserved, &size);
+		if (b->framed) {
+			size_t transfer = bridge_frame_next(b);
+			// a transfer across the end of the ring is copied to its slot, to keep frames in one transfer
+			if (transfer > size) {
+				data = &b->tx_buffers[(size_t) ((b->tx_tail + b->tx_count) % TX_SLOTS) * b->options.buffer_size];
+				ring_peek(ring, b->tx_reserved, data, transfer);
+			}
+			size = transfer;
+		} else if (b->gap_timer_fd >= 0) {
+			// idle gap framing: send only frames closed by the gap timer or already a full transfer long
+			if (b->tx_reserved + size > b->tx_ready && size < b->options.buffer_size)
+				size = b->tx_ready > b->tx_reserved ? b->tx_ready - b->tx_reserved : 0;
+		}
+		if (size == 0)
+			break;
+		if (size > b->options.buffer_size)
+			size = b->options.buffer_size;
+
+		if (b->options.no_reply) {
+			ring_read_commit(ring, size);
+			if (b->framed)
+				bridge_frame_commit(b, size);
+			if (b->threaded)
+				uart_worker_signal(b->worker.from_uart_space_fd);
+			continue;
+		}
+
+		// the worker read time is not known here, the latency of this direction starts at the submission
+		b->tx_times[(b->tx_tail + b->tx_count) % TX_SLOTS] = bridge_now(b);
+		b->tx_sizes[(b->tx_tail + b->tx_count++) % TX_SLOTS] = size;
+		int r = accessory_submit_data(b->ad, data, size, bridge_usb_sent, b);
+		if (r < 0) {
+			// data stays in the ring and is retried on the next uart event
+			b->tx_count--;
+			if (r == LIBUSB_ERROR_NO_DEVICE)
+				b->state = BRIDGE_DISCONNECTED;
+			else {
+				fprintf(stderr, "USB send error: %s\n", libusb_error_name(r));
+				if (b->options.metrics != NULL)
+					metrics_count_usb_error(b->options.metrics, r);
+			}
+			break;
+		}
+		b->tx_reserved += size;
+		if (b->tx_ready > 0 && b->tx_ready < b->tx_reserved)
+			b->tx_ready = b->tx_reserved;
+		// a frame longer than a transfer goes out in pieces, the scanner is still inside it
+		if (b->framed && b->frames_end < b->tx_reserved)
+			b->frames_end = b->tx_reserved;
+		if (b->flush_end <= b->tx_reserved)
+			b->flush_end = 0;
+
+		if (b->options.trace != NULL)
+			b->options.trace(b->options.name, data, size, TRACE_TX);
+	}
+}
+
+/**
+ * size of the next UART->USB transfer in frame aware mode: the complete frames not yet in flight, once they fill
+ * coalesce_size or waited coalesce_delay_us. Returns 0 when nothing is to be sent now.
+ */
+static size_t bridge_frame_next(bridge *b) {
+	ring_buffer *ring = b->from_uart;
+	size_t used = ring_used(ring);
+	size_t limit = b->tx_reserved + b->options.buffer_size;
+	size_t size;
+
+	if (b->options.coalesce_adaptive && used > b->arrived) {
+		// new uart data: average the time since the previous arrival (up to the maximum wait) and its size
+		unsigned long long now = metrics_now_ns();
+		unsigned long long gap = (now - b->last_arrival_ns) / 1000;
+		if (gap > b->options.coalesce_delay_us)
+			gap = b->options.coalesce_delay_us;
+		b->arrival_gap_x8 += gap - b->arrival_gap_x8 / 8;
+		b->arrival_size_x8 += (used - b->arrived) - b->arrival_size_x8 / 8;
+		b->last_arrival_ns = now;
+		b->arrived = used;
+	}
+
+	// scan no further than the end of the next transfer, what follows belongs to the ones after
+	if (limit > used)
+		limit = used;
+	while (b->scan_pos < limit) {
+		unsigned char *data = ring_read_region(ring, b->scan_pos, &size);
+		size_t offset = 0;
+
+		if (size > limit - b->scan_pos)
+			size = limit - b->scan_pos;
+		while (offset < size) {
+			ssize_t end = framer_find_end(&b->framer, data + offset, size - offset);
+			if (end < 0)
+				break;
+			offset += end;
+			b->frames_end = b->scan_pos + offset;
+		}
+		if (b->options.flush_byte_count > 0) {
+			size_t i;
+			for (i = size; i > 0; i--) {
+				if (b->flush_table[data[i - 1]]) {
+					b->flush_end = b->scan_pos + i;
+					break;
+				}
+			}
+		}
+		b->scan_pos += size;
+	}
+
+	size_t ready = b->frames_end - b->tx_reserved;
+	size_t coalesce_size = b->options.coalesce_size > 0 ? b->options.coalesce_size : b->options.buffer_size;
+	// a flush byte sends the held frames once the one it belongs to is complete
+	int flush = b->flush_end > 0 && b->frames_end >= b->flush_end;
+
+	// a whole transfer worth of data: send its complete frames, or a piece of a frame longer than a transfer
+	if (used - b->tx_reserved >= b->options.buffer_size)
+		size = ready > 0 ? ready : b->options.buffer_size;
+	else if (ready > 0 && (ready >= coalesce_size || b->coalesce_due || flush))
+		size = ready;
+	else if (ready > 0 && !b->coalesce_armed) {
+		unsigned long long wait_us = bridge_coalesce_wait(b, ready, coalesce_size);
+		if (wait_us > 0) {
+			evloop_timer_arm(b->coalesce_timer_fd, wait_us, 0);
+			b->coalesce_armed = 1;
+			return 0;
+		}
+		size = ready;
+	} else
+		return 0;
+
+	// the frames waiting for the timer are in this transfer
+	if (b->coalesce_armed) {
+		evloop_timer_arm(b->coalesce_timer_fd, 0, 0);
+		b->coalesce_armed = 0;
+	}
+	b->coalesce_due = 0;
+
+	return size;
+}
+
+/**
+ * the ring read position moved by size bytes
+ */
+static void bridge_frame_commit(bridge *b, size_t size) {
+	b->scan_pos -= size;
+	b->frames_end -= size;
+	b->flush_end = b->flush_end > size ? b->flush_end - size : 0;
+	if (b->options.coalesce_adaptive)
+		b->arrived -= size;
+}
+
+/**
+ * how long the ready frames wait for more data. Adaptive coalescing waits about the time the uart data rate
+ * needs to fill coalesce_size, up to the maximum wait, and does not wait at all when the data arrives further
+ * apart than that: holding it would add latency without saving transfers.
+ */
+static unsigned long long bridge_coalesce_wait(bridge *b, size_t ready, size_t coalesce_size) {
+	unsigned long long wait_us = b->options.coalesce_delay_us;
+
+	if (!b->options.coalesce_adaptive)
+		return wait_us;
+	unsigned long long gap_us = b->arrival_gap_x8 / 8;
+	if (gap_us >= b->options.coalesce_delay_us)
+		return 0;
+
+	unsigned long long arrival_size = b->arrival_size_x8 >= 8 ? b->arrival_size_x8 / 8 : 1;
+	unsigned long long arrivals = (coalesce_size - ready + arrival_size - 1) / arrival_size;
+	if (arrivals * gap_us < wait_us)
+		wait_us = arrivals * gap_us;
+
+	return wait_us;
+}
+
+static void bridge_coalesce_expired(int fd, uint32_t events, void *user_data) {
+	bridge *b = user_data;
+
+	evloop_timer_ack(fd);
+	b->coalesce_armed = 0;
+	b->coalesce_due = 1;
+	bridge_ring_submit(b);
+}
+
+/**
+ * frame aware mode without worker threads: uart data is read in rx_ring and sent from there
+ */
+static void bridge_uart_read_ring(bridge *b) {
+	size_t size;
+	unsigned char *region = ring_write_region(&b->rx_ring, &size);
+
+	if (size == 0) {
+		// the ring is full of data in flight: leave data in the tty buffer until a transfer completes
+		b->uart_paused = 1;
+		bridge_uart_update_events(b);
+		return;
+	}
+
+	ssize_t cnt = uart_receive(b->port, region, size);
+	if (cnt < 0) {
+		bridge_uart_failed(b, "Serial port read");
+		return;
+	}
+	ring_write_commit(&b->rx_ring, cnt);
+	bridge_ring_submit(b);
+}
+
+static void bridge_worker_data(int fd, uint32_t events, void *user_data) {
+	bridge *b = user_data;
+
+	uart_worker_drain(fd);
+
+	if (b->worker.error) {
+		fprintf(stderr, "Serial port error: %s\n", strerror(b->worker.error));
+		b->state = BRIDGE_ERROR;
+		return;
+	}
+
+	if (b->gap_timer_fd >= 0)
+		evloop_timer_arm(b->gap_timer_fd, b->options.idle_gap_us, 0);
+	bridge_ring_submit(b);
+}
+
+static void bridge_worker_space(int fd, uint32_t events, void *user_data) {
+	bridge *b = user_data;
+
+	uart_worker_drain(fd);
+
+	if (b->worker.error) {
+		fprintf(stderr, "Serial port error: %s\n", strerror(b->worker.error));
+		b->state = BRIDGE_ERROR;
+		return;
+	}
+
+	accessory_resume_receiving(b->ad);
+}
+
+static void bridge_print_ring_stats(bridge *b, const char *name, ring_buffer *ring) {
+	printf("%s%s ring: high water %zu of %zu bytes, full %lu times\n", b->options.name != NULL ? b->options.name : "", name, ring->high_water, ring->size, ring->full_count);
+}
+
+/**
+ * watch uart input unless paused or disabled, and uart output only while the pending queue is not empty
+ */
+static void bridge_uart_update_events(bridge *b) {
+	uint32_t events = 0;
+
+	if (b->uart_fd < 0)
+		return;
+	if (b->options.no_reply == 0 && !b->uart_paused)
+		events |= EPOLLIN;
+	if (uart_get_pending(b->port) > 0)
+		events |= EPOLLOUT;
+
+	evloop_modify(b->uart_fd, events);
+}
+
+/**
+ * the program playing the target device connected to the socket, forwarding to the uart starts from now
+ */
+static void bridge_uart_accept(int fd, uint32_t events, void *user_data) {
+	bridge *b = user_data;
+
+	if (uart_accept(b->port) < 0)
+		return;
+	if (bridge_uart_attach(b) < 0) {
+		b->state = BRIDGE_ERROR;
+		return;
+	}
+	printf(" - %sTarget program connected\n", b->options.name != NULL ? b->options.name : "");
+}
+
+static int bridge_uart_attach(bridge *b) {
+	int fd = uart_get_fd(b->port);
+
+	if (evloop_add(fd, b->options.no_reply ? 0 : EPOLLIN, bridge_uart_ready, b) < 0)
+		return -1;
+	b->uart_fd = fd;
+	// a pause waiting for slots is resumed by the next read, which pauses again if they are still busy
+	b->uart_paused = 0;
+	bridge_uart_update_events(b);
+
+	return 0;
+}
+
+/**
+ * the program on the socket went away: data from the accessory is dropped until the next one connects
+ */
+static void bridge_uart_detach(bridge *b) {
+	evloop_remove(b->uart_fd);
+	uart_disconnect(b->port);
+	b->uart_fd = -1;
+	printf(" - %sTarget program disconnected\n", b->options.name != NULL ? b->options.name : "");
+
+	// a packet held for room in the output queue can go now
+	accessory_resume_receiving(b->ad);
+}
+
+/**
+ * a serial port failing stops forwarding, a socket target just loses its program
+ */
+static void bridge_uart_failed(bridge *b, const char *message) {
+	if (b->listen_fd >= 0 && b->uart_fd >= 0) {
+		bridge_uart_detach(b);
+		return;
+	}
+
+	perror(message);
+	b->state = BRIDGE_ERROR;
+}
+
+/**
+ * account a packet taken from the accessory, start_ns is when it was first delivered (0 for no latency)
+ */
+static void bridge_count_received(bridge *b, int size, unsigned long long start_ns) {
+	metrics_slot *metrics = b->options.metrics;
+
+	b->rx_hold_ns = 0;
+	if (metrics == NULL)
+		return;
+
+	metrics_add(&metrics->bytes[METRICS_USB_TO_UART], size);
+	metrics_add(&metrics->packets[METRICS_USB_TO_UART], 1);
+	if (start_ns != 0)
+		metrics_observe(&metrics->latency[METRICS_USB_TO_UART], metrics_now_ns() - start_ns);
+}
+
+/**
+ * timestamp for the metrics, 0 when they are not collected so the clock is not even read
+ */
+static unsigned long long bridge_now(bridge *b) {
+	return b->options.metrics != NULL ? metrics_now_ns() : 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef BRIDGE_H_
+#define BRIDGE_H_
+
+#include "accessory.h"
+#include "framer.h"
+#include "metrics.h"
+#include "uart.h"
+
+#define BRIDGE_RUNNING					0
+#define BRIDGE_QUIT					1
+#define BRIDGE_DISCONNECTED			2
+#define BRIDGE_ERROR					3
+
+/**
+ * called with every packet forwarded, type is TRACE_RX for data from the accessory and TRACE_TX for data to it
+ */
+typedef void (*bridge_trace_callback)(const char *name, const unsigned char *buffer, int size, int type);
+
+typedef struct bridge bridge;
+
+typedef struct {
+	const char *name;				// prefix of the messages of this bridge, may be NULL
+	int closed_loop;
+	int no_reply;
+	int buffer_size;
+	int usb_queue_depth;
+	int threaded;
+	int ring_size;
+	unsigned int idle_gap_us;
+	framer_config framing;				// UART->USB frame boundaries, FRAMER_RAW (zero) sends data as read
+	unsigned int coalesce_delay_us;		// complete frames wait up to this long for more...
+	int coalesce_size;				// ...unless this many bytes of them are ready, 0 for buffer_size
+	int coalesce_adaptive;			// coalesce_delay_us is a maximum, the wait is tuned to the uart data rate
+	unsigned char flush_bytes[FRAMER_DELIMITER_MAX];	// any of them sends the frames held up to it at once
+	int flush_byte_count;
+	bridge_trace_callback trace;			// may be NULL
+	metrics_slot *metrics;				// may be NULL
+} bridge_options;
+
+bridge *bridge_start(accessory_device *ad, uart_port *port, const bridge_options *options);
+int bridge_get_state(bridge *b);
+void bridge_stop(bridge *b);
+int bridge_destroy(bridge *b);
+
+#endif /* BRIDGE_H_ */
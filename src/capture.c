@@ -0,0 +1,405 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+#include "trace.h"
+
+#define CAPTURE_RING_SIZE				(16 * 1024 * 1024)
+#define CAPTURE_BUFFER_SIZE			(1024 * 1024)
+#define CAPTURE_MAX_PACKET				65536
+#define CAPTURE_FLUSH_MS				50
+#define CAPTURE_NAME_SIZE				72
+
+/**
+ * every captured packet is queued as this header followed by its data
+ */
+typedef struct {
+	uint64_t timestamp_ns;
+	const char *name;
+	int32_t size;
+	int32_t type;
+} capture_record;
+
+static void *capture_thread(void *arg);
+static int capture_wait();
+static void capture_write_packet(const capture_record *record, const unsigned char *data);
+static int capture_interface(const char *name);
+static void capture_append_section_header();
+static void capture_append_interface(const char *name);
+static void capture_reserve(size_t size);
+static void capture_flush();
+static void capture_rotate();
+static unsigned char *capture_put_option(unsigned char *p, uint16_t code, const void *value, uint16_t size);
+static void capture_end_block(unsigned char *block, unsigned char *p);
+static uint64_t capture_time_ns();
+
+static ring_buffer ring;
+static int stop_fd = -1;
+static int started = 0;
+static pthread_t thread;
+static uint64_t clock_offset_ns;
+static unsigned long dropped_packets = 0;
+
+// used by the writer thread only once started
+static char *path = NULL;
+static uint64_t max_file_size = 0;
+static int file_fd = -1;
+static uint64_t section_size = 0;
+static unsigned long section_packets = 0;
+static int rotated_files = 0;
+static int write_failed = 0;
+static unsigned char *out = NULL;
+static size_t out_used = 0;
+static unsigned char *packet = NULL;
+static const char **interfaces = NULL;
+static int interface_count = 0;
+
+/**
+ * capture the packets traced from now on to file_name in pcapng format, one interface per device. The file
+ * is appended to as a new section. When rotate_size is not 0, a file reaching it is renamed to
+ * file_name.1, .2 ... and a new one is started.
+ */
+int capture_start(const char *file_name, uint64_t rotate_size) {
+	struct timespec realtime;
+	struct stat st;
+
+	// monotonic timestamps, shifted to the epoch so the capture lines up with a usbmon one
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_offset_ns = realtime.tv_sec * 1000000000ULL + realtime.tv_nsec - capture_time_ns();
+	max_file_size = rotate_size;
+	dropped_packets = 0;
+	rotated_files = 0;
+	write_failed = 0;
+
+	path = strdup(file_name);
+	out = malloc(CAPTURE_BUFFER_SIZE);
+	packet = malloc(CAPTURE_MAX_PACKET);
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (path == NULL || out == NULL || packet == NULL || stop_fd < 0 || ring_init(&ring, CAPTURE_RING_SIZE) < 0) {
+		capture_stop();
+		return -1;
+	}
+
+	file_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+		int error = errno;
+		capture_stop();
+		errno = error;
+		return -1;
+	}
+	section_size = st.st_size;
+	capture_append_section_header();
+
+	if (pthread_create(&thread, NULL, capture_thread, NULL) != 0) {
+		capture_stop();
+		return -1;
+	}
+	started = 1;
+
+	return 0;
+}
+
+/**
+ * write what is still queued, then close the capture
+ */
+void capture_stop() {
+	if (started) {
+		eventfd_write(stop_fd, 1);
+		pthread_join(thread, NULL);
+		started = 0;
+		if (dropped_packets > 0)
+			fprintf(stderr, "Capture: %lu packets not written, disk slower than forwarding\n", dropped_packets);
+	}
+
+	if (file_fd >= 0)
+		close(file_fd);
+	if (stop_fd >= 0)
+		close(stop_fd);
+	file_fd = stop_fd = -1;
+	ring_free(&ring);
+	free(path);
+	free(out);
+	free(packet);
+	free(interfaces);
+	path = NULL;
+	out = NULL;
+	packet = NULL;
+	interfaces = NULL;
+	interface_count = 0;
+	out_used = 0;
+}
+
+/**
+ * queue a packet for the writer thread. It polls the ring, so capturing costs the forwarding path a copy and
+ * no system call. When the ring is full the packet is dropped and accounted.
+ */
+void capture_packet(const char *name, const unsigned char *buffer, int size, int type) {
+	capture_record record;
+
+	if (!started)
+		return;
+
+	if (size > CAPTURE_MAX_PACKET || ring_space(&ring) < sizeof(record) + size) {
+		dropped_packets++;
+		return;
+	}
+
+	record.timestamp_ns = capture_time_ns();
+	record.name = name;
+	record.size = size;
+	record.type = type;
+	ring_write(&ring, &record, sizeof(record));
+	ring_write(&ring, buffer, size);
+}
+
+static void *capture_thread(void *arg) {
+	capture_record record;
+	int stopping = 0;
+
+	while (1) {
+		// header and data are written separately: a record is complete only when its data is there too
+		while (ring_peek(&ring, 0, &record, sizeof(record)) != 0 && ring_used(&ring) >= sizeof(record) + record.size) {
+			ring_peek(&ring, sizeof(record), packet, record.size);
+			ring_read_commit(&ring, sizeof(record) + record.size);
+			capture_write_packet(&record, packet);
+		}
+		capture_flush();
+
+		if (stopping)
+			break;
+		stopping = capture_wait();
+	}
+
+	return NULL;
+}
+
+/**
+ * sleep until the next flush. Returns 1 when asked to stop
+ */
+static int capture_wait() {
+	struct pollfd fds;
+
+	fds.fd = stop_fd;
+	fds.events = POLLIN;
+	while (poll(&fds, 1, CAPTURE_FLUSH_MS) < 0 && errno == EINTR)
+		;
+
+	return fds.revents != 0;
+}
+
+static void capture_write_packet(const capture_record *record, const unsigned char *data) {
+	size_t padded = (record->size + 3) & ~3;
+	size_t block_size = 28 + padded + 8 + 4 + 4;
+	uint32_t flags = record->type == TRACE_RX ? PCAPNG_EPB_FLAG_INBOUND : PCAPNG_EPB_FLAG_OUTBOUND;
+	uint64_t timestamp = record->timestamp_ns + clock_offset_ns;
+	uint32_t fields[7];
+
+	if (max_file_size != 0 && section_packets > 0 && section_size + block_size > max_file_size)
+		capture_rotate();
+
+	int interface_id = capture_interface(record->name);
+
+	capture_reserve(block_size);
+	unsigned char *block = out + out_used;
+	fields[0] = PCAPNG_BLOCK_ENHANCED_PACKET;
+	fields[1] = 0;
+	fields[2] = interface_id;
+	fields[3] = timestamp >> 32;
+	fields[4] = timestamp & 0xFFFFFFFF;
+	fields[5] = record->size;
+	fields[6] = record->size;
+	memcpy(block, fields, sizeof(fields));
+	unsigned char *p = block + sizeof(fields);
+	memcpy(p, data, record->size);
+	memset(p + record->size, 0, padded - record->size);
+	p = capture_put_option(p + padded, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+	p = capture_put_option(p, PCAPNG_OPT_END_OF_OPT, NULL, 0);
+	capture_end_block(block, p);
+	section_packets++;
+}
+
+/**
+ * interface id of a device, described in the current section on first use. Bridges are named by their
+ * pairing, whose name outlives the capture, so the pointer identifies the device.
+ */
+static int capture_interface(const char *name) {
+	int i;
+
+	for (i = 0; i < interface_count; i++) {
+		if (interfaces[i] == name)
+			return i;
+	}
+
+	const char **grown = realloc(interfaces, (interface_count + 1) * sizeof(*interfaces));
+	if (grown == NULL)
+		return 0;
+	interfaces = grown;
+	interfaces[interface_count] = name;
+	capture_append_interface(name);
+
+	return interface_count++;
+}
+
+static void capture_append_section_header() {
+	static const char application[] = "uartaccessory";
+	uint32_t fields[3] = { PCAPNG_BLOCK_SECTION_HEADER, 0, PCAPNG_BYTE_ORDER_MAGIC };
+	uint16_t version[2] = { 1, 0 };
+	int64_t section_length = -1;
+
+	capture_reserve(64);
+	unsigned char *block = out + out_used;
+	unsigned char *p = block;
+	memcpy(p, fields, sizeof(fields));
+	p += sizeof(fields);
+	memcpy(p, version, sizeof(version));
+	p += sizeof(version);
+	memcpy(p, &section_length, sizeof(section_length));
+	p += sizeof(section_length);
+	p = capture_put_option(p, PCAPNG_OPT_SHB_USERAPPL, application, sizeof(application) - 1);
+	p = capture_put_option(p, PCAPNG_OPT_END_OF_OPT, NULL, 0);
+	capture_end_block(block, p);
+}
+
+static void capture_append_interface(const char *name) {
+	uint32_t fields[4] = { PCAPNG_BLOCK_INTERFACE_DESCRIPTION, 0, CAPTURE_LINK_TYPE, 0 };
+	unsigned char resolution = PCAPNG_TSRESOL_NS;
+	char interface_name[CAPTURE_NAME_SIZE];
+	int length = 0;
+
+	// pairing names are shown as "[selector] ", keep the selector only
+	for (; name != NULL && *name != 0 && length < CAPTURE_NAME_SIZE - 1; name++) {
+		if (*name != '[' && *name != ']')
+			interface_name[length++] = *name;
+	}
+	while (length > 0 && interface_name[length - 1] == ' ')
+		length--;
+	if (length == 0)
+		length = snprintf(interface_name, sizeof(interface_name), "accessory");
+
+	capture_reserve(64 + CAPTURE_NAME_SIZE);
+	unsigned char *block = out + out_used;
+	memcpy(block, fields, sizeof(fields));
+	unsigned char *p = capture_put_option(block + sizeof(fields), PCAPNG_OPT_IF_NAME, interface_name, length);
+	p = capture_put_option(p, PCAPNG_OPT_IF_TSRESOL, &resolution, sizeof(resolution));
+	p = capture_put_option(p, PCAPNG_OPT_END_OF_OPT, NULL, 0);
+	capture_end_block(block, p);
+}
+
+static void capture_reserve(size_t size) {
+	if (out_used + size > CAPTURE_BUFFER_SIZE)
+		capture_flush();
+}
+
+static void capture_flush() {
+	size_t done = 0;
+
+	while (done < out_used && !write_failed) {
+		ssize_t r = write(file_fd, out + done, out_used - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			// keep draining the ring so forwarding is unaffected, only the capture stops
+			fprintf(stderr, "Capture: write to %s failed: %s, capture stopped\n", path, strerror(errno));
+			write_failed = 1;
+			break;
+		}
+		done += r;
+	}
+	out_used = 0;
+}
+
+/**
+ * move the full file aside and start a new one, with its own section and interfaces
+ */
+static void capture_rotate() {
+	char rotated[PATH_MAX];
+	int i;
+
+	capture_flush();
+	if (write_failed)
+		return;
+
+	close(file_fd);
+	snprintf(rotated, sizeof(rotated), "%s.%d", path, ++rotated_files);
+	if (rename(path, rotated) < 0)
+		fprintf(stderr, "Capture: unable to rename %s to %s: %s\n", path, rotated, strerror(errno));
+
+	file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (file_fd < 0) {
+		fprintf(stderr, "Capture: unable to create %s: %s, capture stopped\n", path, strerror(errno));
+		write_failed = 1;
+		return;
+	}
+
+	section_size = 0;
+	section_packets = 0;
+	capture_append_section_header();
+	for (i = 0; i < interface_count; i++)
+		capture_append_interface(interfaces[i]);
+}
+
+static unsigned char *capture_put_option(unsigned char *p, uint16_t code, const void *value, uint16_t size) {
+	uint16_t header[2] = { code, size };
+	size_t padded = (size + 3) & ~3;
+
+	memcpy(p, header, sizeof(header));
+	if (size > 0)
+		memcpy(p + sizeof(header), value, size);
+	memset(p + sizeof(header) + size, 0, padded - size);
+
+	return p + sizeof(header) + padded;
+}
+
+/**
+ * set the total length at both ends of the block started at block, p being where the trailing length goes
+ */
+static void capture_end_block(unsigned char *block, unsigned char *p) {
+	uint32_t length = p - block + sizeof(length);
+
+	memcpy(block + 4, &length, sizeof(length));
+	memcpy(p, &length, sizeof(length));
+	out_used += length;
+	section_size += length;
+}
+
+static uint64_t capture_time_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
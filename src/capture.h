@@ -0,0 +1,50 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+
+// pcapng LINKTYPE_USER0: the raw bytes exchanged with the accessory, no pseudo header
+#define CAPTURE_LINK_TYPE				147
+
+// pcapng blocks and options, see draft-ietf-opsawg-pcapng
+#define PCAPNG_BLOCK_SECTION_HEADER			0x0A0D0D0A
+#define PCAPNG_BLOCK_INTERFACE_DESCRIPTION	0x00000001
+#define PCAPNG_BLOCK_ENHANCED_PACKET			0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC				0x1A2B3C4D
+#define PCAPNG_OPT_END_OF_OPT				0
+#define PCAPNG_OPT_SHB_USERAPPL				4
+#define PCAPNG_OPT_IF_NAME					2
+#define PCAPNG_OPT_IF_TSRESOL				9
+#define PCAPNG_OPT_EPB_FLAGS					2
+#define PCAPNG_EPB_FLAG_INBOUND				1
+#define PCAPNG_EPB_FLAG_OUTBOUND				2
+#define PCAPNG_TSRESOL_NS					9
+
+int capture_start(const char *file_name, uint64_t rotate_size);
+void capture_stop();
+void capture_packet(const char *name, const unsigned char *buffer, int size, int type);
+
+#endif /* CAPTURE_H_ */
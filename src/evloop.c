@@ -0,0 +1,171 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "evloop.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define EVLOOP_MAX_FDS					1024
+#define EVLOOP_MAX_EVENTS				32
+
+typedef struct {
+	evloop_callback callback;
+	void *user_data;
+	uint32_t events;
+} evloop_watch;
+
+static int epfd = -1;
+static evloop_watch watches[EVLOOP_MAX_FDS];
+
+int evloop_init() {
+	if (epfd >= 0)
+		return -1;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+
+	memset(watches, 0, sizeof(watches));
+
+	return 0;
+}
+
+void evloop_finalize() {
+	if (epfd >= 0) {
+		close(epfd);
+		epfd = -1;
+	}
+}
+
+int evloop_add(int fd, uint32_t events, evloop_callback callback, void *user_data) {
+	struct epoll_event ev;
+
+	if (epfd < 0 || fd < 0 || fd >= EVLOOP_MAX_FDS || callback == NULL)
+		return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	watches[fd].callback = callback;
+	watches[fd].user_data = user_data;
+	watches[fd].events = events;
+
+	return 0;
+}
+
+int evloop_modify(int fd, uint32_t events) {
+	struct epoll_event ev;
+
+	if (epfd < 0 || fd < 0 || fd >= EVLOOP_MAX_FDS || watches[fd].callback == NULL)
+		return -1;
+
+	if (watches[fd].events == events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		return -1;
+
+	watches[fd].events = events;
+
+	return 0;
+}
+
+int evloop_remove(int fd) {
+	if (epfd < 0 || fd < 0 || fd >= EVLOOP_MAX_FDS || watches[fd].callback == NULL)
+		return -1;
+
+	// the descriptor could be already closed, so ignore the epoll result
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	memset(&watches[fd], 0, sizeof(evloop_watch));
+
+	return 0;
+}
+
+/**
+ * wait up to timeout_ms (-1 forever) for ready descriptors and dispatch them. Returns the number of dispatched
+ * events, 0 on timeout or -1 on error. A watch removed by a previous callback of the same batch is skipped.
+ */
+int evloop_run_once(int timeout_ms) {
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	int i, n;
+
+	if (epfd < 0)
+		return -1;
+
+	n = epoll_wait(epfd, events, EVLOOP_MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if (watches[fd].callback != NULL)
+			watches[fd].callback(fd, events[i].events, watches[fd].user_data);
+	}
+
+	return n;
+}
+
+/**
+ * create a not armed monotonic timer descriptor, to be watched with evloop_add() like any other
+ */
+int evloop_timer_create() {
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+/**
+ * arm timer_fd to expire after delay_us and then every interval_us (0 for one shot), a delay of 0 disarms it
+ */
+int evloop_timer_arm(int timer_fd, unsigned long long delay_us, unsigned long long interval_us) {
+	struct itimerspec its;
+
+	its.it_value.tv_sec = delay_us / 1000000;
+	its.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+	its.it_interval.tv_sec = interval_us / 1000000;
+	its.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+
+	return timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+/**
+ * consume the expirations of a ready timer, returns how many there were (0 if it was not expired)
+ */
+int evloop_timer_ack(int timer_fd) {
+	uint64_t expirations = 0;
+
+	if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+
+	return (int) expirations;
+}
@@ -0,0 +1,42 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EVLOOP_H_
+#define EVLOOP_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+typedef void (*evloop_callback)(int fd, uint32_t events, void *user_data);
+
+int evloop_init();
+void evloop_finalize();
+int evloop_add(int fd, uint32_t events, evloop_callback callback, void *user_data);
+int evloop_modify(int fd, uint32_t events);
+int evloop_remove(int fd);
+int evloop_run_once(int timeout_ms);
+int evloop_timer_create();
+int evloop_timer_arm(int timer_fd, unsigned long long delay_us, unsigned long long interval_us);
+int evloop_timer_ack(int timer_fd);
+
+#endif /* EVLOOP_H_ */
@@ -0,0 +1,170 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "framer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * parse a framing spec: raw, slip, cobs, idle[:<us>], delim:<hex bytes> (e.g. delim:0a, delim:0x7e,
+ * delim:0d0a) or len:<1|2|4>[be|le][+|-<n>] (big endian by default, n added to the header value).
+ * Returns -1 if not valid.
+ */
+int framer_parse(const char *spec, framer_config *config) {
+	memset(config, 0, sizeof(framer_config));
+
+	if (strcmp(spec, "raw") == 0)
+		config->mode = FRAMER_RAW;
+	else if (strcmp(spec, "slip") == 0) {
+		config->mode = FRAMER_SLIP;
+		config->delimiter[0] = FRAMER_SLIP_END;
+		config->delimiter_size = 1;
+	} else if (strcmp(spec, "cobs") == 0) {
+		config->mode = FRAMER_COBS;
+		config->delimiter[0] = 0x00;
+		config->delimiter_size = 1;
+	} else if (strcmp(spec, "idle") == 0)
+		config->mode = FRAMER_IDLE;
+	else if (strncmp(spec, "idle:", 5) == 0) {
+		config->mode = FRAMER_IDLE;
+		config->idle_gap_us = atoi(spec + 5);
+		if (config->idle_gap_us == 0)
+			return -1;
+	} else if (strncmp(spec, "delim:", 6) == 0) {
+		config->mode = FRAMER_DELIMITER;
+		config->delimiter_size = framer_parse_bytes(spec + 6, config->delimiter, FRAMER_DELIMITER_MAX);
+		if (config->delimiter_size <= 0)
+			return -1;
+	} else if (strncmp(spec, "len:", 4) == 0) {
+		char *end;
+
+		config->mode = FRAMER_LENGTH;
+		config->length_size = strtol(spec + 4, &end, 10);
+		if (config->length_size != 1 && config->length_size != 2 && config->length_size != 4)
+			return -1;
+		config->length_big_endian = 1;
+		if (strncmp(end, "be", 2) == 0)
+			end += 2;
+		else if (strncmp(end, "le", 2) == 0) {
+			config->length_big_endian = 0;
+			end += 2;
+		}
+		if (*end == '+' || *end == '-')
+			config->length_adjust = strtol(end, &end, 10);
+		if (*end != '\0')
+			return -1;
+	} else
+		return -1;
+
+	return 0;
+}
+
+void framer_init(framer *f, const framer_config *config) {
+	memset(f, 0, sizeof(framer));
+	f->config = *config;
+}
+
+/**
+ * scan the next bytes of the stream. Returns the offset just past the first frame end in data, or -1 when
+ * no frame ends there. Modes without byte boundaries (raw and idle) end a frame with every chunk.
+ */
+ssize_t framer_find_end(framer *f, const unsigned char *data, size_t size) {
+	const framer_config *config = &f->config;
+	size_t i;
+
+	switch (config->mode) {
+	case FRAMER_DELIMITER:
+	case FRAMER_SLIP:
+	case FRAMER_COBS:
+		if (config->delimiter_size == 1) {
+			const unsigned char *end = memchr(data, config->delimiter[0], size);
+			return end != NULL ? end - data + 1 : -1;
+		}
+		for (i = 0; i < size; i++) {
+			// a mismatch restarts from this byte, enough for delimiters without a repeated prefix like \r\n
+			if (data[i] == config->delimiter[f->matched])
+				f->matched++;
+			else
+				f->matched = data[i] == config->delimiter[0];
+			if (f->matched == config->delimiter_size) {
+				f->matched = 0;
+				return i + 1;
+			}
+		}
+		return -1;
+
+	case FRAMER_LENGTH:
+		i = 0;
+		while (i < size) {
+			if (f->header_fill < config->length_size) {
+				unsigned long byte = data[i++];
+				if (config->length_big_endian)
+					f->header_value = f->header_value << 8 | byte;
+				else
+					f->header_value |= byte << (8 * f->header_fill);
+				if (++f->header_fill < config->length_size)
+					continue;
+				// a negative adjustment larger than the value leaves an empty payload
+				long payload = (long) f->header_value + config->length_adjust;
+				f->remaining = payload > 0 ? payload : 0;
+			} else {
+				size_t take = size - i < f->remaining ? size - i : f->remaining;
+				i += take;
+				f->remaining -= take;
+			}
+			if (f->remaining == 0) {
+				f->header_fill = 0;
+				f->header_value = 0;
+				return i;
+			}
+		}
+		return -1;
+
+	default:
+		return size > 0 ? (ssize_t) size : -1;
+	}
+}
+
+/**
+ * hex digits, optionally prefixed by 0x, into at most max bytes. Returns the bytes or -1
+ */
+int framer_parse_bytes(const char *hex, unsigned char *bytes, int max) {
+	int count = 0;
+
+	if (strncmp(hex, "0x", 2) == 0 || strncmp(hex, "0X", 2) == 0)
+		hex += 2;
+	if (*hex == '\0' || strlen(hex) % 2 != 0 || strlen(hex) / 2 > max)
+		return -1;
+
+	while (*hex != '\0') {
+		char digits[3] = { hex[0], hex[1], '\0' };
+		char *end;
+		bytes[count++] = strtoul(digits, &end, 16);
+		if (*end != '\0')
+			return -1;
+		hex += 2;
+	}
+
+	return count;
+}
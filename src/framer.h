@@ -0,0 +1,65 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FRAMER_H_
+#define FRAMER_H_
+
+#include <sys/types.h>
+
+#define FRAMER_RAW						0		// every byte may end a transfer, as read
+#define FRAMER_DELIMITER				1		// frames end with a byte sequence, e.g. \n or 0x7E
+#define FRAMER_LENGTH					2		// frames start with their length
+#define FRAMER_SLIP					3		// RFC 1055, frames end with END (0xC0)
+#define FRAMER_COBS					4		// frames end with a 0x00
+#define FRAMER_IDLE					5		// frames end with an idle line, see uart_frame_gap_us()
+
+#define FRAMER_DELIMITER_MAX			8
+#define FRAMER_SLIP_END				0xC0
+
+typedef struct {
+	int mode;
+	unsigned char delimiter[FRAMER_DELIMITER_MAX];
+	int delimiter_size;
+	int length_size;				// 1, 2 or 4 bytes of length header
+	int length_big_endian;
+	int length_adjust;				// added to the header value, e.g. for a checksum after the payload
+	unsigned int idle_gap_us;			// 0 for the gap of the baud rate
+} framer_config;
+
+/**
+ * frame boundary scanner, fed with the bytes of the stream in order
+ */
+typedef struct {
+	framer_config config;
+	int matched;					// delimiter bytes matched so far
+	int header_fill;				// length header bytes seen so far
+	unsigned long header_value;
+	unsigned long remaining;			// bytes left in the current length prefixed frame
+} framer;
+
+int framer_parse(const char *spec, framer_config *config);
+void framer_init(framer *f, const framer_config *config);
+ssize_t framer_find_end(framer *f, const unsigned char *data, size_t size);
+int framer_parse_bytes(const char *hex, unsigned char *bytes, int max);
+
+#endif /* FRAMER_H_ */
@@ -0,0 +1,193 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "hid_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "evloop.h"
+
+/**
+ * HID input reports of report_size bytes read from a file or a pipe and sent to the phone no faster than rate_hz.
+ * Pipes are read only when readable and paused between reports, regular files are read at every tick.
+ */
+struct hid_stream {
+	accessory_device *ad;
+	int id;
+	int fd;
+	int is_file;
+	int timer_fd;
+	unsigned int period_us;
+	unsigned char *report;
+	int report_size;
+	int fill;
+	unsigned long reports_sent;
+	unsigned long reports_failed;
+};
+
+static void hid_stream_readable(int fd, uint32_t events, void *user_data);
+static void hid_stream_tick(int fd, uint32_t events, void *user_data);
+static int hid_stream_read(hid_stream *stream);
+static void hid_stream_send(hid_stream *stream);
+static void hid_stream_end(hid_stream *stream);
+
+/**
+ * stream the reports of file_name as HID device id, already registered on ad. Returns NULL on error
+ */
+hid_stream *hid_stream_start(accessory_device *ad, int id, const char *file_name, int report_size, unsigned int rate_hz) {
+	struct stat st;
+	hid_stream *stream;
+
+	if (report_size <= 0 || rate_hz == 0)
+		return NULL;
+
+	stream = calloc(1, sizeof(hid_stream));
+	if (stream == NULL)
+		return NULL;
+	stream->ad = ad;
+	stream->id = id;
+	stream->report_size = report_size;
+	stream->period_us = 1000000 / rate_hz;
+	stream->timer_fd = -1;
+
+	// a FIFO opened read-write never reports end of file while no writer is connected
+	if (stat(file_name, &st) == 0 && S_ISFIFO(st.st_mode))
+		stream->fd = open(file_name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	else
+		stream->fd = open(file_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	stream->is_file = fstat(stream->fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	stream->report = malloc(report_size);
+	stream->timer_fd = evloop_timer_create();
+	if (stream->fd < 0 || stream->report == NULL || stream->timer_fd < 0
+			|| evloop_add(stream->timer_fd, EPOLLIN, hid_stream_tick, stream) < 0) {
+		hid_stream_stop(stream);
+		return NULL;
+	}
+
+	if (stream->is_file)
+		evloop_timer_arm(stream->timer_fd, stream->period_us, stream->period_us);
+	else if (evloop_add(stream->fd, EPOLLIN, hid_stream_readable, stream) < 0) {
+		hid_stream_stop(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+void hid_stream_stop(hid_stream *stream) {
+	if (stream == NULL)
+		return;
+
+	if (stream->reports_sent > 0 || stream->reports_failed > 0)
+		printf("HID: %lu reports sent, %lu failed\n", stream->reports_sent, stream->reports_failed);
+
+	hid_stream_end(stream);
+	if (stream->timer_fd >= 0) {
+		evloop_remove(stream->timer_fd);
+		close(stream->timer_fd);
+	}
+	free(stream->report);
+	free(stream);
+}
+
+static void hid_stream_readable(int fd, uint32_t events, void *user_data) {
+	hid_stream *stream = user_data;
+
+	if (hid_stream_read(stream) < 0) {
+		hid_stream_end(stream);
+		return;
+	}
+
+	if (stream->fill == stream->report_size) {
+		hid_stream_send(stream);
+		// pace the reports: the pipe is not read again until the period is over
+		evloop_modify(stream->fd, 0);
+		evloop_timer_arm(stream->timer_fd, stream->period_us, 0);
+	}
+}
+
+static void hid_stream_tick(int fd, uint32_t events, void *user_data) {
+	hid_stream *stream = user_data;
+
+	evloop_timer_ack(fd);
+
+	if (stream->fd < 0)
+		return;
+
+	if (!stream->is_file) {
+		evloop_modify(stream->fd, EPOLLIN);
+		return;
+	}
+
+	if (hid_stream_read(stream) < 0) {
+		hid_stream_end(stream);
+		evloop_timer_arm(stream->timer_fd, 0, 0);
+		return;
+	}
+	if (stream->fill == stream->report_size)
+		hid_stream_send(stream);
+}
+
+/**
+ * read what is missing of the current report. Returns -1 at end of file or on error
+ */
+static int hid_stream_read(hid_stream *stream) {
+	while (stream->fill < stream->report_size) {
+		ssize_t cnt = read(stream->fd, stream->report + stream->fill, stream->report_size - stream->fill);
+		if (cnt > 0)
+			stream->fill += cnt;
+		else if (cnt == 0)
+			return -1;
+		else
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+
+	return 0;
+}
+
+static void hid_stream_send(hid_stream *stream) {
+	if (accessory_send_hid_event(stream->ad, stream->id, stream->report, stream->report_size) == 0)
+		stream->reports_sent++;
+	else
+		stream->reports_failed++;
+	stream->fill = 0;
+}
+
+/**
+ * stop reading: end of file, error or stop
+ */
+static void hid_stream_end(hid_stream *stream) {
+	if (stream->fd < 0)
+		return;
+
+	if (!stream->is_file)
+		evloop_remove(stream->fd);
+	close(stream->fd);
+	stream->fd = -1;
+}
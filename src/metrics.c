@@ -0,0 +1,328 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE					// accept4()
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libusb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "evloop.h"
+
+#define METRICS_PREFIX					"uartaccessory_"
+
+static void metrics_timer_expired(int fd, uint32_t events, void *user_data);
+static void metrics_client_connected(int fd, uint32_t events, void *user_data);
+static void metrics_write_file();
+static void metrics_render(FILE *out);
+static void metrics_render_counter(FILE *out, const char *name, const char *help, size_t offset);
+static void metrics_put_label(FILE *out, const char *value);
+static unsigned long long metrics_get(const metrics_counter *counter);
+
+static const char *direction_names[2] = { "usb_to_uart", "uart_to_usb" };
+
+static metrics_slot *slots = NULL;
+static char *file_path = NULL;
+static char *temp_path = NULL;
+static int timer_fd = -1;
+static char *socket_file = NULL;
+static int listen_fd = -1;
+
+/**
+ * add the counters of a pairing to the exported ones, slot must stay valid until metrics_stop()
+ */
+void metrics_register(metrics_slot *slot, const char *label) {
+	snprintf(slot->label, sizeof(slot->label), "%s", label);
+	slot->next = NULL;
+
+	metrics_slot **last = &slots;
+	while (*last != NULL)
+		last = &(*last)->next;
+	*last = slot;
+}
+
+/**
+ * export the registered counters in Prometheus text format: rewritten to file_name every interval_ms and/or
+ * sent to every client connecting to the unix socket at socket_path (either may be NULL). The work is done
+ * by the event loop between forwarding events. Returns -1 on error with errno set.
+ */
+int metrics_start(const char *file_name, const char *socket_path, unsigned int interval_ms) {
+	if (file_name != NULL) {
+		file_path = strdup(file_name);
+		temp_path = malloc(strlen(file_name) + 5);
+		if (file_path == NULL || temp_path == NULL) {
+			metrics_stop();
+			return -1;
+		}
+		sprintf(temp_path, "%s.tmp", file_name);
+
+		timer_fd = evloop_timer_create();
+		if (timer_fd < 0 || evloop_add(timer_fd, EPOLLIN, metrics_timer_expired, NULL) < 0) {
+			metrics_stop();
+			return -1;
+		}
+		evloop_timer_arm(timer_fd, (unsigned long long) interval_ms * 1000, (unsigned long long) interval_ms * 1000);
+		metrics_write_file();
+	}
+
+	if (socket_path != NULL) {
+		struct sockaddr_un address;
+		struct stat status;
+
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (strlen(socket_path) >= sizeof(address.sun_path)) {
+			metrics_stop();
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(address.sun_path, socket_path);
+
+		// a socket left by a previous run would make bind fail, anything else at the path is not ours to remove
+		if (lstat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode))
+			unlink(socket_path);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+			metrics_stop();
+			return -1;
+		}
+		socket_file = strdup(socket_path);
+		if (socket_file == NULL || listen(listen_fd, 8) < 0 || evloop_add(listen_fd, EPOLLIN, metrics_client_connected, NULL) < 0) {
+			metrics_stop();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * write the file a last time, then close the socket and forget the registered slots
+ */
+void metrics_stop() {
+	int error = errno;
+
+	if (timer_fd >= 0) {
+		metrics_write_file();
+		evloop_remove(timer_fd);
+		close(timer_fd);
+		timer_fd = -1;
+	}
+	free(file_path);
+	free(temp_path);
+	file_path = NULL;
+	temp_path = NULL;
+
+	if (listen_fd >= 0) {
+		evloop_remove(listen_fd);
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (socket_file != NULL)
+		unlink(socket_file);
+	free(socket_file);
+	socket_file = NULL;
+
+	slots = NULL;
+	errno = error;
+}
+
+/**
+ * count a libusb error code, the ones not known here are counted as LIBUSB_ERROR_OTHER
+ */
+void metrics_count_usb_error(metrics_slot *slot, int code) {
+	int index = code < 0 && code >= -(METRICS_USB_ERROR_CODES - 1) ? -code - 1 : METRICS_USB_ERROR_CODES - 1;
+
+	metrics_add(&slot->usb_errors[index], 1);
+}
+
+void metrics_observe(metrics_histogram *histogram, unsigned long long ns) {
+	// rounded up: bucket n holds the latencies up to 2^n us, 1.5 us is not within 1 us
+	unsigned long long us = (ns + 999) / 1000;
+	int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+	if (bucket > METRICS_LATENCY_BUCKETS - 1)
+		bucket = METRICS_LATENCY_BUCKETS - 1;
+	metrics_add(&histogram->buckets[bucket], 1);
+	metrics_add(&histogram->sum_ns, ns);
+}
+
+static void metrics_timer_expired(int fd, uint32_t events, void *user_data) {
+	evloop_timer_ack(fd);
+	metrics_write_file();
+}
+
+/**
+ * every client gets a snapshot and the connection closed, e.g. socat - UNIX-CONNECT:<path>
+ */
+static void metrics_client_connected(int fd, uint32_t events, void *user_data) {
+	char *text = NULL;
+	size_t size = 0;
+
+	int client_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (client_fd < 0)
+		return;
+
+	FILE *out = open_memstream(&text, &size);
+	if (out != NULL) {
+		metrics_render(out);
+		fclose(out);
+
+		// the text is a few KB and fits in the socket buffer: the event loop never waits for the client, one not
+		// reading it gets it truncated when the buffer is full (EAGAIN)
+		size_t sent = 0;
+		while (sent < size) {
+			ssize_t cnt = send(client_fd, text + sent, size - sent, MSG_NOSIGNAL);
+			if (cnt <= 0)
+				break;
+			sent += cnt;
+		}
+	}
+	free(text);
+	close(client_fd);
+}
+
+/**
+ * written aside and renamed, so a collector reading the file never sees it half written
+ */
+static void metrics_write_file() {
+	FILE *out = fopen(temp_path, "w");
+
+	if (out == NULL) {
+		perror(temp_path);
+		return;
+	}
+	metrics_render(out);
+	if (fclose(out) != 0 || rename(temp_path, file_path) < 0) {
+		perror(file_path);
+		unlink(temp_path);
+	}
+}
+
+static void metrics_render(FILE *out) {
+	metrics_slot *slot;
+	int i, d;
+
+	fprintf(out, "# HELP " METRICS_PREFIX "bytes_total Bytes forwarded.\n# TYPE " METRICS_PREFIX "bytes_total counter\n");
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		for (d = 0; d < 2; d++) {
+			fprintf(out, METRICS_PREFIX "bytes_total{pairing=");
+			metrics_put_label(out, slot->label);
+			fprintf(out, ",direction=\"%s\"} %llu\n", direction_names[d], metrics_get(&slot->bytes[d]));
+		}
+	}
+	fprintf(out, "# HELP " METRICS_PREFIX "packets_total USB transfers forwarded.\n# TYPE " METRICS_PREFIX "packets_total counter\n");
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		for (d = 0; d < 2; d++) {
+			fprintf(out, METRICS_PREFIX "packets_total{pairing=");
+			metrics_put_label(out, slot->label);
+			fprintf(out, ",direction=\"%s\"} %llu\n", direction_names[d], metrics_get(&slot->packets[d]));
+		}
+	}
+
+	metrics_render_counter(out, "usb_timeouts_total", "USB OUT transfers timed out.", offsetof(metrics_slot, usb_timeouts));
+	metrics_render_counter(out, "uart_short_writes_total", "Uart writes not accepted in full by the driver.", offsetof(metrics_slot, uart_short_writes));
+	metrics_render_counter(out, "uart_dropped_bytes_total", "Bytes dropped with the uart output queue full.", offsetof(metrics_slot, uart_dropped_bytes));
+	metrics_render_counter(out, "reconnects_total", "Accessory connections after the first one.", offsetof(metrics_slot, reconnects));
+
+	fprintf(out, "# HELP " METRICS_PREFIX "usb_errors_total USB transfer errors by libusb code.\n# TYPE " METRICS_PREFIX "usb_errors_total counter\n");
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		for (i = 0; i < METRICS_USB_ERROR_CODES; i++) {
+			unsigned long long value = metrics_get(&slot->usb_errors[i]);
+			if (value == 0)
+				continue;
+			fprintf(out, METRICS_PREFIX "usb_errors_total{pairing=");
+			metrics_put_label(out, slot->label);
+			fprintf(out, ",code=\"%s\"} %llu\n", libusb_error_name(i < METRICS_USB_ERROR_CODES - 1 ? -i - 1 : LIBUSB_ERROR_OTHER), value);
+		}
+	}
+
+	fprintf(out, "# HELP " METRICS_PREFIX "latency_seconds Forwarding latency, USB IN completion to uart write and uart read to USB OUT completion.\n# TYPE " METRICS_PREFIX "latency_seconds histogram\n");
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		for (d = 0; d < 2; d++) {
+			metrics_histogram *histogram = &slot->latency[d];
+			unsigned long long cumulative = 0;
+
+			for (i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+				cumulative += metrics_get(&histogram->buckets[i]);
+				fprintf(out, METRICS_PREFIX "latency_seconds_bucket{pairing=");
+				metrics_put_label(out, slot->label);
+				if (i < METRICS_LATENCY_BUCKETS - 1)
+					fprintf(out, ",direction=\"%s\",le=\"%.9g\"} %llu\n", direction_names[d], (1ULL << i) / 1e6, cumulative);
+				else
+					fprintf(out, ",direction=\"%s\",le=\"+Inf\"} %llu\n", direction_names[d], cumulative);
+			}
+			// sum and buckets are read one after the other, the sum may include a few more samples
+			fprintf(out, METRICS_PREFIX "latency_seconds_sum{pairing=");
+			metrics_put_label(out, slot->label);
+			fprintf(out, ",direction=\"%s\"} %.9f\n", direction_names[d], metrics_get(&histogram->sum_ns) / 1e9);
+			fprintf(out, METRICS_PREFIX "latency_seconds_count{pairing=");
+			metrics_put_label(out, slot->label);
+			fprintf(out, ",direction=\"%s\"} %llu\n", direction_names[d], cumulative);
+		}
+	}
+}
+
+/**
+ * a counter with one value per pairing, found at offset in the slot
+ */
+static void metrics_render_counter(FILE *out, const char *name, const char *help, size_t offset) {
+	metrics_slot *slot;
+
+	fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s counter\n", name, help, name);
+	for (slot = slots; slot != NULL; slot = slot->next) {
+		fprintf(out, METRICS_PREFIX "%s{pairing=", name);
+		metrics_put_label(out, slot->label);
+		fprintf(out, "} %llu\n", metrics_get((metrics_counter *) ((char *) slot + offset)));
+	}
+}
+
+/**
+ * quoted label value, with backslash, double quote and line feed escaped
+ */
+static void metrics_put_label(FILE *out, const char *value) {
+	fputc('"', out);
+	for (; *value != '\0'; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', out);
+		if (*value == '\n')
+			fputs("\\n", out);
+		else
+			fputc(*value, out);
+	}
+	fputc('"', out);
+}
+
+static unsigned long long metrics_get(const metrics_counter *counter) {
+	return atomic_load_explicit((metrics_counter *) counter, memory_order_relaxed);
+}
@@ -0,0 +1,86 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define METRICS_USB_TO_UART				0
+#define METRICS_UART_TO_USB				1
+
+// latency buckets are powers of two microseconds, 1 us to 8.4 s, the last one counts the longer ones
+#define METRICS_LATENCY_BUCKETS			24
+// LIBUSB_ERROR_IO (-1) to LIBUSB_ERROR_NOT_SUPPORTED (-12), then any other code
+#define METRICS_USB_ERROR_CODES			13
+
+/**
+ * every counter has a single writer thread, so it is updated with a relaxed load and store: no locked
+ * instruction and no syscall on the forwarding path, a reader on another thread never sees a torn value
+ */
+typedef atomic_ullong metrics_counter;
+
+typedef struct {
+	metrics_counter buckets[METRICS_LATENCY_BUCKETS];
+	metrics_counter sum_ns;
+} metrics_histogram;
+
+/**
+ * the counters of one pairing, kept across reconnections. The event loop thread writes all of them but
+ * uart_short_writes, owned by the thread writing the uart (the worker one in threaded mode).
+ */
+typedef struct metrics_slot {
+	char label[80];					// value of the pairing label
+	metrics_counter bytes[2];			// indexed by METRICS_USB_TO_UART / METRICS_UART_TO_USB
+	metrics_counter packets[2];
+	metrics_counter usb_timeouts;
+	metrics_counter usb_errors[METRICS_USB_ERROR_CODES];
+	metrics_counter uart_short_writes;
+	metrics_counter uart_dropped_bytes;
+	metrics_counter reconnects;
+	metrics_histogram latency[2];
+	struct metrics_slot *next;
+} metrics_slot;
+
+void metrics_register(metrics_slot *slot, const char *label);
+int metrics_start(const char *file_name, const char *socket_path, unsigned int interval_ms);
+void metrics_stop();
+void metrics_count_usb_error(metrics_slot *slot, int code);
+void metrics_observe(metrics_histogram *histogram, unsigned long long ns);
+
+static inline void metrics_add(metrics_counter *counter, unsigned long long n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/**
+ * monotonic time for latencies, served by the vDSO without entering the kernel
+ */
+static inline unsigned long long metrics_now_ns() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,724 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "mux.h"
+
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define MUX_TX_SLOTS					4
+#define MUX_CONTROL_MAX				8
+#define MUX_PAYLOAD_MAX				65535
+#define MUX_HELLO_INTERVAL_US			1000000
+
+typedef struct {
+	mux *m;
+	const mux_channel_config *config;
+	uart_port *port;				// opened by the caller, who keeps it across sessions
+	int listen_fd;					// socket channels, -1 for the others
+	int fd;						// data descriptor while in the event loop, -1 while no socket client is connected
+	uint32_t events;
+	size_t capacity;				// output queue size of the port, the most credit granted at once
+	size_t rx_outstanding;				// credit granted to the phone and not yet used
+	uint32_t tx_credit;				// data bytes the phone accepts
+	unsigned long long dropped;
+} mux_channel;
+
+struct mux {
+	accessory_device *ad;
+	bridge_options options;
+	int state;
+	mux_channel channels[MUX_CHANNELS_MAX];
+	int channel_count;
+	int channel_index[256];				// by channel id, -1 for the unknown ones
+
+	// OUT transfers: frames of every channel are packed in the open slot, the one after the slots in flight.
+	// It is submitted as soon as nothing is in flight or when full, so transfers grow with the load.
+	unsigned char *tx_buffers;
+	int tx_tail;
+	int tx_count;
+	int tx_fill;
+	// for the metrics: size of each submitted slot, the DATA it carries and when the first frame was read
+	int tx_sizes[MUX_TX_SLOTS];
+	int tx_data_bytes[MUX_TX_SLOTS];
+	int tx_data_frames[MUX_TX_SLOTS];
+	unsigned long long tx_times[MUX_TX_SLOTS];
+	unsigned long long rx_start_ns;			// delivery of the IN transfer being parsed, 0 without metrics
+
+	// IN frames may span several transfers: header and control payloads are collected here
+	unsigned char header[MUX_HEADER_SIZE];
+	int header_fill;
+	mux_channel *rx_channel;
+	int rx_type;
+	int rx_remaining;
+	unsigned char control[MUX_CONTROL_MAX];
+	int control_fill;
+
+	unsigned char hello_sequence;
+	int hello_pending;				// a HELLO is due but did not fit in the open slot
+	int synchronized;				// the phone answered the last HELLO
+	int hello_timer_fd;				// a new HELLO every MUX_HELLO_INTERVAL_US until answered
+};
+
+static int mux_channel_open(mux *m, mux_channel *ch, const mux_channel_config *config);
+static int mux_channel_attach(mux_channel *ch);
+static void mux_channel_ready(int fd, uint32_t events, void *user_data);
+static void mux_channel_accept(int fd, uint32_t events, void *user_data);
+static void mux_channel_disconnect(mux_channel *ch);
+static void mux_channel_read(mux_channel *ch);
+static void mux_channel_write(mux_channel *ch, const unsigned char *data, int size);
+static int mux_channel_flush(mux_channel *ch);
+static void mux_channel_failed(mux_channel *ch, const char *message);
+static size_t mux_channel_pending(mux_channel *ch);
+static void mux_channel_grant(mux_channel *ch);
+static void mux_channel_update_events(mux_channel *ch);
+static void mux_update_all(mux *m);
+static void mux_send_hello(mux *m);
+static void mux_hello_expired(int fd, uint32_t events, void *user_data);
+static int mux_put_frame(mux *m, int channel, int type, const void *payload, int size);
+static int mux_tx_room(mux *m);
+static void mux_tx_flush(mux *m);
+static void mux_tx_forget(mux *m, int slot);
+static void mux_usb_sent(accessory_device *ad, unsigned char *buffer, int result, void *user_data);
+static int mux_usb_received(accessory_device *ad, unsigned char *buffer, int size, void *user_data);
+static void mux_frame_start(mux *m);
+static void mux_frame_end(mux *m);
+
+/**
+ * parse a channel given as <id>=<device>[,baud-rate[,framing]]. device is a uart path, UART_PTY, a socket target
+ * as for uart_open() or just the number of a /dev/ttyUSBx port. Returns -1 if not valid.
+ */
+int mux_parse_channel(const char *spec, const uart_config *defaults, mux_channel_config *config) {
+	char text[MUX_DEVICE_NAME_SIZE + 32];
+	char *end;
+
+	memset(config, 0, sizeof(mux_channel_config));
+	config->uart = *defaults;
+
+	config->id = strtol(spec, &end, 10);
+	if (end == spec || *end != '=' || config->id < 1 || config->id > 255)
+		return -1;
+	snprintf(text, sizeof(text), "%s", end + 1);
+
+	char *device = strtok(text, ",");
+	char *baud_rate = strtok(NULL, ",");
+	char *framing = strtok(NULL, ",");
+	if (device == NULL || strtok(NULL, ",") != NULL)
+		return -1;
+
+	if (baud_rate != NULL) {
+		config->uart.baud_rate = strtoul(baud_rate, NULL, 10);
+		if (config->uart.baud_rate == 0)
+			return -1;
+	}
+	if (framing != NULL && uart_parse_framing(framing, &config->uart) < 0)
+		return -1;
+
+	if (device[0] == '/' || strcmp(device, UART_PTY) == 0 || strchr(device, ':') != NULL)
+		snprintf(config->device, sizeof(config->device), "%s", device);
+	else
+		snprintf(config->device, sizeof(config->device), "/dev/ttyUSB%s", device);
+	snprintf(config->name, sizeof(config->name), "[channel %d] ", config->id);
+
+	return 0;
+}
+
+/**
+ * start the multiplexed link over the accessory, driven by the shared event loop like a bridge. The channel ports
+ * must be open and, with the channel configurations, stay valid until mux_destroy(). Returns NULL on error.
+ */
+mux *mux_start(accessory_device *ad, const mux_channel_config *channels, int count, const bridge_options *options) {
+	mux *m;
+	int i, r;
+
+	m = calloc(1, sizeof(mux));
+	if (m == NULL)
+		return NULL;
+
+	m->ad = ad;
+	m->options = *options;
+	m->state = BRIDGE_RUNNING;
+	m->hello_timer_fd = -1;
+	memset(m->channel_index, -1, sizeof(m->channel_index));
+
+	m->tx_buffers = malloc((size_t) MUX_TX_SLOTS * options->buffer_size);
+	if (m->tx_buffers == NULL) {
+		free(m);
+		return NULL;
+	}
+
+	for (i = 0; i < count && i < MUX_CHANNELS_MAX; i++) {
+		if (mux_channel_open(m, &m->channels[i], &channels[i]) < 0) {
+			m->state = BRIDGE_ERROR;
+			return m;
+		}
+		m->channel_count++;
+		m->channel_index[channels[i].id] = i;
+	}
+
+	r = accessory_start_receiving(ad, options->usb_queue_depth, options->buffer_size, mux_usb_received, m);
+	if (r < 0) {
+		m->state = r == LIBUSB_ERROR_NO_DEVICE ? BRIDGE_DISCONNECTED : BRIDGE_ERROR;
+		return m;
+	}
+
+	// the app may not be reading yet, or be a previous instance: repeat the HELLO until it is answered
+	m->hello_timer_fd = evloop_timer_create();
+	if (m->hello_timer_fd < 0 || evloop_add(m->hello_timer_fd, EPOLLIN, mux_hello_expired, m) < 0) {
+		m->state = BRIDGE_ERROR;
+		return m;
+	}
+	mux_send_hello(m);
+
+	return m;
+}
+
+/**
+ * BRIDGE_RUNNING while data is forwarded, otherwise the reason why forwarding stopped
+ */
+int mux_get_state(mux *m) {
+	if (m->ad->is_disconnected && m->state == BRIDGE_RUNNING)
+		m->state = BRIDGE_DISCONNECTED;
+
+	return m->state;
+}
+
+void mux_stop(mux *m) {
+	if (m->state == BRIDGE_RUNNING)
+		m->state = BRIDGE_QUIT;
+}
+
+/**
+ * stop forwarding and release the link. Accessory and channel ports are left to the caller, a socket client stays
+ * connected. Returns the final state.
+ */
+int mux_destroy(mux *m) {
+	int state = mux_get_state(m);
+	int i;
+
+	for (i = 0; i < m->channel_count; i++) {
+		if (m->channels[i].fd >= 0)
+			evloop_remove(m->channels[i].fd);
+		if (m->channels[i].listen_fd >= 0)
+			evloop_remove(m->channels[i].listen_fd);
+	}
+	if (m->hello_timer_fd >= 0) {
+		evloop_remove(m->hello_timer_fd);
+		close(m->hello_timer_fd);
+	}
+
+	// waits for OUT transfers too, so slots are no more in use after this
+	accessory_stop_transfers(m->ad);
+
+	for (i = 0; i < m->channel_count; i++) {
+		if (m->channels[i].dropped > 0)
+			printf("%s%sdropped %llu bytes over the credit granted\n", m->options.name != NULL ? m->options.name : "", m->channels[i].config->name, m->channels[i].dropped);
+	}
+
+	// a transfer libusb could not cancel in time may still use its slot, leak the link rather than free it in use
+	if (accessory_transfers_pending(m->ad) == 0) {
+		free(m->tx_buffers);
+		free(m);
+	}
+
+	return state;
+}
+
+static int mux_channel_open(mux *m, mux_channel *ch, const mux_channel_config *config) {
+	ch->m = m;
+	ch->config = config;
+	ch->port = config->port;
+	ch->fd = -1;
+	ch->listen_fd = uart_get_listen_fd(ch->port);
+	ch->capacity = uart_get_pending(ch->port) + uart_get_pending_space(ch->port);
+	uart_set_metrics(ch->port, m->options.metrics);
+
+	if (ch->listen_fd >= 0 && evloop_add(ch->listen_fd, EPOLLIN, mux_channel_accept, ch) < 0)
+		return -1;
+
+	// a socket client may have stayed connected from a previous session
+	if (uart_get_fd(ch->port) >= 0 && mux_channel_attach(ch) < 0) {
+		// not counted in channel_count, so mux_destroy() would not remove the listening socket
+		if (ch->listen_fd >= 0)
+			evloop_remove(ch->listen_fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mux_channel_attach(mux_channel *ch) {
+	int fd = uart_get_fd(ch->port);
+
+	if (evloop_add(fd, 0, mux_channel_ready, ch) < 0)
+		return -1;
+	ch->fd = fd;
+	ch->events = 0;
+	mux_channel_update_events(ch);
+
+	return 0;
+}
+
+static void mux_channel_ready(int fd, uint32_t events, void *user_data) {
+	mux_channel *ch = user_data;
+	mux *m = ch->m;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		if (ch->listen_fd >= 0) {
+			mux_channel_disconnect(ch);
+			return;
+		}
+		fprintf(stderr, "%s%sSerial port error or hang-up !\n", m->options.name != NULL ? m->options.name : "", ch->config->name);
+		m->state = BRIDGE_ERROR;
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		if (mux_channel_flush(ch) < 0)
+			return;
+		mux_channel_grant(ch);
+	}
+	if (events & EPOLLIN)
+		mux_channel_read(ch);
+
+	mux_tx_flush(m);
+	mux_update_all(m);
+}
+
+/**
+ * one client at a time per socket channel, the others are turned away
+ */
+static void mux_channel_accept(int fd, uint32_t events, void *user_data) {
+	mux_channel *ch = user_data;
+
+	if (uart_accept(ch->port) < 0)
+		return;
+	if (mux_channel_attach(ch) < 0) {
+		uart_disconnect(ch->port);
+		return;
+	}
+	printf(" - %s%sClient connected\n", ch->m->options.name != NULL ? ch->m->options.name : "", ch->config->name);
+}
+
+/**
+ * the socket client went away, data from the phone is dropped until the next one connects
+ */
+static void mux_channel_disconnect(mux_channel *ch) {
+	evloop_remove(ch->fd);
+	uart_disconnect(ch->port);
+	ch->fd = -1;
+	ch->events = 0;
+	printf(" - %s%sClient disconnected\n", ch->m->options.name != NULL ? ch->m->options.name : "", ch->config->name);
+}
+
+/**
+ * read channel data, within the credit of the phone, straight into a DATA frame of the open slot
+ */
+static void mux_channel_read(mux_channel *ch) {
+	mux *m = ch->m;
+	int room = mux_tx_room(m) - MUX_HEADER_SIZE;
+	ssize_t cnt;
+
+	if (room <= 0 || ch->tx_credit == 0)
+		return;
+	if (room > ch->tx_credit)
+		room = ch->tx_credit;
+	if (room > MUX_PAYLOAD_MAX)
+		room = MUX_PAYLOAD_MAX;
+
+	unsigned char *frame = &m->tx_buffers[(size_t) ((m->tx_tail + m->tx_count) % MUX_TX_SLOTS) * m->options.buffer_size + m->tx_fill];
+	cnt = uart_receive(ch->port, frame + MUX_HEADER_SIZE, room);
+	if (cnt < 0) {
+		mux_channel_failed(ch, "Serial port read");
+		return;
+	}
+	if (cnt == 0)
+		return;
+
+	frame[0] = ch->config->id;
+	frame[1] = MUX_FRAME_DATA;
+	frame[2] = cnt >> 8;
+	frame[3] = cnt;
+	m->tx_fill += MUX_HEADER_SIZE + cnt;
+	ch->tx_credit -= cnt;
+
+	if (m->options.metrics != NULL) {
+		int slot = (m->tx_tail + m->tx_count) % MUX_TX_SLOTS;
+		if (m->tx_data_frames[slot]++ == 0)
+			m->tx_times[slot] = metrics_now_ns();
+		m->tx_data_bytes[slot] += cnt;
+	}
+}
+
+/**
+ * DATA from the phone: written at once when possible, queued otherwise. The credit keeps it within the
+ * queue, what a misbehaving phone sends beyond it is dropped.
+ */
+static void mux_channel_write(mux_channel *ch, const unsigned char *data, int size) {
+	ch->rx_outstanding = ch->rx_outstanding > size ? ch->rx_outstanding - size : 0;
+
+	int r = uart_send_buffer(ch->port, (void *) data, size);
+	if (r < 0)
+		mux_channel_failed(ch, "Serial port write");
+	else
+		ch->dropped += size - r;
+
+	metrics_slot *metrics = ch->m->options.metrics;
+	if (metrics != NULL && r > 0 && ch->m->rx_start_ns != 0) {
+		metrics_add(&metrics->bytes[METRICS_USB_TO_UART], r);
+		metrics_add(&metrics->packets[METRICS_USB_TO_UART], 1);
+		metrics_observe(&metrics->latency[METRICS_USB_TO_UART], metrics_now_ns() - ch->m->rx_start_ns);
+	}
+
+	mux_channel_grant(ch);
+}
+
+/**
+ * write as much of the queued data as the channel accepts. Returns -1 if the channel failed
+ */
+static int mux_channel_flush(mux_channel *ch) {
+	if (uart_flush_pending(ch->port) < 0) {
+		mux_channel_failed(ch, "Serial port write");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * a serial port failing stops forwarding, a socket channel just loses its client
+ */
+static void mux_channel_failed(mux_channel *ch, const char *message) {
+	if (ch->listen_fd >= 0 && ch->fd >= 0) {
+		mux_channel_disconnect(ch);
+		return;
+	}
+
+	perror(message);
+	ch->m->state = BRIDGE_ERROR;
+}
+
+static size_t mux_channel_pending(mux_channel *ch) {
+	return uart_get_pending(ch->port);
+}
+
+/**
+ * give the phone credit for the room left in the output queue, once it is worth a frame: at least a quarter of it
+ */
+static void mux_channel_grant(mux_channel *ch) {
+	size_t used = mux_channel_pending(ch) + ch->rx_outstanding;
+	unsigned char credit[4];
+
+	if (used >= ch->capacity || ch->capacity - used < ch->capacity / 4)
+		return;
+
+	size_t grant = ch->capacity - used;
+	credit[0] = grant >> 24;
+	credit[1] = grant >> 16;
+	credit[2] = grant >> 8;
+	credit[3] = grant;
+	// without room in the open slot the grant is retried when a transfer completes
+	if (mux_put_frame(ch->m, ch->config->id, MUX_FRAME_CREDIT, credit, sizeof(credit)) == 0)
+		ch->rx_outstanding += grant;
+}
+
+/**
+ * read the channel only while the phone gives credit and the open slot has room, write it while data is queued
+ */
+static void mux_channel_update_events(mux_channel *ch) {
+	mux *m = ch->m;
+	uint32_t events = 0;
+
+	if (ch->fd < 0)
+		return;
+
+	if (m->synchronized && ch->tx_credit > 0 && mux_tx_room(m) > MUX_HEADER_SIZE)
+		events |= EPOLLIN;
+	if (mux_channel_pending(ch) > 0)
+		events |= EPOLLOUT;
+
+	if (events != ch->events) {
+		evloop_modify(ch->fd, events);
+		ch->events = events;
+	}
+}
+
+static void mux_update_all(mux *m) {
+	int i;
+
+	for (i = 0; i < m->channel_count; i++)
+		mux_channel_update_events(&m->channels[i]);
+}
+
+/**
+ * start a session: the phone forgets credits and data in flight, and grants credit again once it answers
+ */
+static void mux_send_hello(mux *m) {
+	unsigned char hello[2];
+	int i;
+
+	// what the phone sent so far belongs to the previous session: a frame an app left unfinished when it died
+	// would otherwise swallow the first frames of the new one as its payload
+	m->header_fill = 0;
+	m->rx_channel = NULL;
+	m->rx_type = MUX_FRAME_DATA;
+	m->rx_remaining = 0;
+	m->control_fill = 0;
+
+	hello[0] = MUX_VERSION;
+	hello[1] = ++m->hello_sequence;
+	if (mux_put_frame(m, MUX_CONTROL_CHANNEL, MUX_FRAME_HELLO, hello, sizeof(hello)) < 0) {
+		m->hello_pending = 1;
+		return;
+	}
+	m->hello_pending = 0;
+	m->synchronized = 0;
+	evloop_timer_arm(m->hello_timer_fd, MUX_HELLO_INTERVAL_US, 0);
+
+	for (i = 0; i < m->channel_count; i++) {
+		m->channels[i].tx_credit = 0;
+		m->channels[i].rx_outstanding = 0;
+		mux_channel_grant(&m->channels[i]);
+	}
+	mux_tx_flush(m);
+	mux_update_all(m);
+}
+
+/**
+ * no answer to the last HELLO: it may have reached an app not reading yet, or restarting, start over
+ */
+static void mux_hello_expired(int fd, uint32_t events, void *user_data) {
+	mux *m = user_data;
+
+	evloop_timer_ack(fd);
+	if (m->state != BRIDGE_RUNNING || m->synchronized)
+		return;
+
+	if (m->hello_pending)
+		evloop_timer_arm(fd, MUX_HELLO_INTERVAL_US, 0);
+	else
+		mux_send_hello(m);
+}
+
+/**
+ * append a frame to the open slot. Returns -1 if it does not fit
+ */
+static int mux_put_frame(mux *m, int channel, int type, const void *payload, int size) {
+	if (mux_tx_room(m) < MUX_HEADER_SIZE + size)
+		return -1;
+
+	unsigned char *frame = &m->tx_buffers[(size_t) ((m->tx_tail + m->tx_count) % MUX_TX_SLOTS) * m->options.buffer_size + m->tx_fill];
+	frame[0] = channel;
+	frame[1] = type;
+	frame[2] = size >> 8;
+	frame[3] = size;
+	memcpy(frame + MUX_HEADER_SIZE, payload, size);
+	m->tx_fill += MUX_HEADER_SIZE + size;
+
+	return 0;
+}
+
+/**
+ * free bytes in the open slot, 0 when every slot is in flight
+ */
+static int mux_tx_room(mux *m) {
+	return m->tx_count < MUX_TX_SLOTS ? m->options.buffer_size - m->tx_fill : 0;
+}
+
+/**
+ * submit the open slot when the pipe is idle, otherwise it keeps filling until a transfer completes or it is
+ * too full for another data frame
+ */
+static void mux_tx_flush(mux *m) {
+	if (m->tx_fill == 0 || (m->tx_count > 0 && mux_tx_room(m) > 2 * MUX_HEADER_SIZE))
+		return;
+
+	unsigned char *slot = &m->tx_buffers[(size_t) ((m->tx_tail + m->tx_count) % MUX_TX_SLOTS) * m->options.buffer_size];
+	int size = m->tx_fill;
+	int r = accessory_submit_data(m->ad, slot, size, mux_usb_sent, m);
+
+	m->tx_fill = 0;
+	if (r < 0) {
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			m->state = BRIDGE_DISCONNECTED;
+		else {
+			fprintf(stderr, "USB send error: %s, dropped %d bytes\n", libusb_error_name(r), size);
+			if (m->options.metrics != NULL)
+				metrics_count_usb_error(m->options.metrics, r);
+		}
+		mux_tx_forget(m, (m->tx_tail + m->tx_count) % MUX_TX_SLOTS);
+		return;
+	}
+	m->tx_sizes[(m->tx_tail + m->tx_count) % MUX_TX_SLOTS] = size;
+	m->tx_count++;
+
+	if (m->options.trace != NULL)
+		m->options.trace(m->options.name, slot, size, TRACE_TX);
+}
+
+/**
+ * clear the metrics bookkeeping of a slot that completed or was never submitted
+ */
+static void mux_tx_forget(mux *m, int slot) {
+	m->tx_data_bytes[slot] = 0;
+	m->tx_data_frames[slot] = 0;
+	m->tx_times[slot] = 0;
+}
+
+static void mux_usb_sent(accessory_device *ad, unsigned char *buffer, int result, void *user_data) {
+	mux *m = user_data;
+	metrics_slot *metrics = m->options.metrics;
+	int slot = m->tx_tail;
+	int i;
+
+	m->tx_tail = (m->tx_tail + 1) % MUX_TX_SLOTS;
+	m->tx_count--;
+
+	if (result == LIBUSB_ERROR_NO_DEVICE)
+		m->state = BRIDGE_DISCONNECTED;
+	else if (result < 0)
+		fprintf(stderr, "USB send error: %s\n", libusb_error_name(result));
+
+	// only the DATA frames count as traffic, control frames are overhead of the link
+	if (metrics != NULL && result != LIBUSB_ERROR_NO_DEVICE) {
+		if (result < 0)
+			metrics_count_usb_error(metrics, result);
+		else if (result < m->tx_sizes[slot])
+			metrics_add(&metrics->usb_timeouts, 1);
+		if (result >= 0 && m->tx_data_frames[slot] > 0) {
+			// a short transfer lost the tail of the slot, at most that much of the payload arrived
+			int bytes = m->tx_data_bytes[slot] < result ? m->tx_data_bytes[slot] : result;
+			metrics_add(&metrics->bytes[METRICS_UART_TO_USB], bytes);
+			metrics_add(&metrics->packets[METRICS_UART_TO_USB], m->tx_data_frames[slot]);
+			metrics_observe(&metrics->latency[METRICS_UART_TO_USB], metrics_now_ns() - m->tx_times[slot]);
+		}
+	}
+	mux_tx_forget(m, slot);
+
+	if (m->state != BRIDGE_RUNNING)
+		return;
+
+	// room again for what did not fit before
+	if (m->hello_pending)
+		mux_send_hello(m);
+	for (i = 0; i < m->channel_count; i++)
+		mux_channel_grant(&m->channels[i]);
+	mux_tx_flush(m);
+	mux_update_all(m);
+}
+
+static int mux_usb_received(accessory_device *ad, unsigned char *buffer, int size, void *user_data) {
+	mux *m = user_data;
+	int offset = 0;
+
+	if (size < 0) {
+		if (size == LIBUSB_ERROR_NO_DEVICE)
+			m->state = BRIDGE_DISCONNECTED;
+		else if (m->options.metrics != NULL)
+			metrics_count_usb_error(m->options.metrics, size);
+		return ACCESSORY_RX_CONSUMED;
+	}
+	if (m->options.metrics != NULL)
+		m->rx_start_ns = metrics_now_ns();
+
+	if (m->options.trace != NULL)
+		m->options.trace(m->options.name, buffer, size, TRACE_RX);
+
+	while (offset < size) {
+		if (m->header_fill < MUX_HEADER_SIZE) {
+			m->header[m->header_fill++] = buffer[offset++];
+			if (m->header_fill == MUX_HEADER_SIZE)
+				mux_frame_start(m);
+			continue;
+		}
+
+		int cnt = size - offset < m->rx_remaining ? size - offset : m->rx_remaining;
+		if (m->rx_type == MUX_FRAME_DATA) {
+			if (m->rx_channel != NULL)
+				mux_channel_write(m->rx_channel, buffer + offset, cnt);
+		} else {
+			int copy = MUX_CONTROL_MAX - m->control_fill < cnt ? MUX_CONTROL_MAX - m->control_fill : cnt;
+			memcpy(m->control + m->control_fill, buffer + offset, copy);
+			m->control_fill += copy;
+		}
+		offset += cnt;
+		m->rx_remaining -= cnt;
+		if (m->rx_remaining == 0)
+			mux_frame_end(m);
+	}
+
+	mux_tx_flush(m);
+	mux_update_all(m);
+
+	return ACCESSORY_RX_CONSUMED;
+}
+
+static void mux_frame_start(mux *m) {
+	int index = m->channel_index[m->header[0]];
+
+	m->rx_channel = index >= 0 ? &m->channels[index] : NULL;
+	m->rx_type = m->header[1];
+	m->rx_remaining = m->header[2] << 8 | m->header[3];
+	m->control_fill = 0;
+
+	if (m->rx_remaining == 0)
+		mux_frame_end(m);
+}
+
+static void mux_frame_end(mux *m) {
+	const char *name = m->options.name != NULL ? m->options.name : "";
+
+	m->header_fill = 0;
+
+	switch (m->rx_type) {
+	case MUX_FRAME_CREDIT:
+		// credit granted before the answer to the last HELLO belongs to a previous session
+		if (m->rx_channel != NULL && m->control_fill == 4 && m->synchronized)
+			m->rx_channel->tx_credit += (uint32_t) m->control[0] << 24 | m->control[1] << 16 | m->control[2] << 8 | m->control[3];
+		break;
+
+	case MUX_FRAME_HELLO:
+		if (m->control_fill < 2 || m->control[1] != m->hello_sequence || m->synchronized)
+			break;
+		if (m->control[0] != MUX_VERSION) {
+			fprintf(stderr, "%sMultiplexing version %d not supported by the phone (%d)\n", name, MUX_VERSION, m->control[0]);
+			m->state = BRIDGE_ERROR;
+			break;
+		}
+		m->synchronized = 1;
+		evloop_timer_arm(m->hello_timer_fd, 0, 0);
+		printf(" - %sMultiplexed link up, %d channels\n", name, m->channel_count);
+		break;
+
+	case MUX_FRAME_RESET:
+		mux_send_hello(m);
+		break;
+	}
+}
@@ -0,0 +1,79 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MUX_H_
+#define MUX_H_
+
+#include "accessory.h"
+#include "bridge.h"
+#include "uart.h"
+
+/*
+ * multiplexed link: the accessory bulk endpoints carry frames of several virtual channels, each one bridged to
+ * its own uart, pseudo terminal or socket. A frame is
+ *
+ *   channel (1 byte) | type (1 byte) | payload length (2 bytes, big endian) | payload
+ *
+ * MUX_FRAME_DATA	bytes of the channel
+ * MUX_FRAME_CREDIT	4 bytes big endian: how many more data bytes the sender of the credit accepts on the channel
+ * MUX_FRAME_HELLO	channel 0, version and sequence bytes. The host starts every session with one: the phone
+ *			drops its channel state and credits, answers with a HELLO of the same sequence and grants its
+ *			credits. The host ignores credits until that answer, and sends a new HELLO every second
+ *			while there is none, so an app opening the accessory late gets in sync anyway.
+ * MUX_FRAME_RESET	channel 0, no payload: the phone asks for a new HELLO, e.g. when the app restarts
+ *
+ * Every HELLO the host sends restarts its frame parser. The phone writes each frame with a single bulk write,
+ * so a frame is never left half sent by an app that dies and the RESET of its next instance starts on a
+ * frame boundary.
+ *
+ * Data is sent only within the credit granted by the other side, so neither end ever needs to stall the
+ * bulk pipe because one channel is slow.
+ */
+#define MUX_VERSION						1
+#define MUX_HEADER_SIZE				4
+#define MUX_CONTROL_CHANNEL			0
+#define MUX_FRAME_DATA					0
+#define MUX_FRAME_CREDIT				1
+#define MUX_FRAME_HELLO				2
+#define MUX_FRAME_RESET				3
+
+#define MUX_CHANNELS_MAX				16
+#define MUX_DEVICE_NAME_SIZE			256
+
+typedef struct {
+	int id;						// 1 to 255
+	char device[MUX_DEVICE_NAME_SIZE];		// uart device, UART_PTY or socket target, as for uart_open()
+	uart_config uart;
+	char name[24];					// message prefix and trace name
+	uart_port *port;				// opened by the caller before mux_start()
+} mux_channel_config;
+
+typedef struct mux mux;
+
+int mux_parse_channel(const char *spec, const uart_config *defaults, mux_channel_config *config);
+mux *mux_start(accessory_device *ad, const mux_channel_config *channels, int count, const bridge_options *options);
+int mux_get_state(mux *m);
+void mux_stop(mux *m);
+int mux_destroy(mux *m);
+
+#endif /* MUX_H_ */
@@ -0,0 +1,132 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pairing.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_SIZE						512
+
+static int pairing_parse_line(char *line, const uart_config *defaults, pairing *p);
+
+/**
+ * read the pairings of file_name, one per line:
+ *
+ *   <selector> <uart-port> [baud-rate] [framing]
+ *
+ * where selector is path=<bus-port.port...>, serial=<iSerialNumber>, id=<vid>:<pid>, any or loopback and uart-port
+ * may be "pty". Empty lines and text after '#' are ignored, missing uart settings are taken from defaults. Returns the number of pairings, stored in a new array,
+ * or -1 on error.
+ */
+int pairing_load(const char *file_name, const uart_config *defaults, pairing **pairings) {
+	char line[LINE_SIZE];
+	pairing *list = NULL;
+	int count = 0;
+	int line_number = 0;
+	FILE *file;
+
+	file = fopen(file_name, "r");
+	if (file == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		line_number++;
+
+		char *comment = strchr(line, '#');
+		if (comment != NULL)
+			*comment = 0;
+		if (strspn(line, " \t\r\n") == strlen(line))
+			continue;
+
+		pairing *grown = realloc(list, (count + 1) * sizeof(pairing));
+		if (grown == NULL) {
+			errno = ENOMEM;
+			break;
+		}
+		list = grown;
+
+		if (pairing_parse_line(line, defaults, &list[count]) < 0) {
+			fprintf(stderr, "%s:%d: invalid pairing, expected <path=...|serial=...|id=...|any|loopback> <uart-port> [baud-rate] [framing]\n", file_name, line_number);
+			errno = EINVAL;
+			break;
+		}
+		count++;
+	}
+
+	if (ferror(file) || !feof(file)) {
+		fclose(file);
+		free(list);
+		return -1;
+	}
+	fclose(file);
+
+	*pairings = list;
+	return count;
+}
+
+static int pairing_parse_line(char *line, const uart_config *defaults, pairing *p) {
+	char *selector = strtok(line, " \t\r\n");
+	char *uart_port = strtok(NULL, " \t\r\n");
+	char *baud_rate = strtok(NULL, " \t\r\n");
+	char *framing = strtok(NULL, " \t\r\n");
+
+	memset(p, 0, sizeof(pairing));
+
+	if (selector == NULL || uart_port == NULL || strtok(NULL, " \t\r\n") != NULL)
+		return -1;
+
+	if (accessory_selector_parse(selector, &p->selector) < 0)
+		return -1;
+
+	p->uart = *defaults;
+	if (baud_rate != NULL) {
+		p->uart.baud_rate = strtoul(baud_rate, NULL, 10);
+		if (p->uart.baud_rate == 0)
+			return -1;
+	}
+	if (framing != NULL && uart_parse_framing(framing, &p->uart) < 0)
+		return -1;
+
+	pairing_set_uart_device(p, uart_port);
+	snprintf(p->name, sizeof(p->name), "[%.64s] ", strcmp(selector, "any") == 0 ? p->uart_device : selector);
+
+	return 0;
+}
+
+/**
+ * uart_port is a device path, UART_PTY, a socket target or, as for --uart-port, just the number of a
+ * /dev/ttyUSBx port
+ */
+void pairing_set_uart_device(pairing *p, const char *uart_port) {
+	if (uart_port[0] == '/' || strcmp(uart_port, UART_PTY) == 0 || strchr(uart_port, ':') != NULL)
+		snprintf(p->uart_device, sizeof(p->uart_device), "%s", uart_port);
+	else
+		snprintf(p->uart_device, sizeof(p->uart_device), "/dev/ttyUSB%s", uart_port);
+}
+
+int pairing_matches(const pairing *p, const struct accessory_device *ad) {
+	return accessory_selector_matches(&p->selector, ad);
+}
@@ -0,0 +1,58 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PAIRING_H_
+#define PAIRING_H_
+
+#include "accessory.h"
+#include "bridge.h"
+#include "hid_stream.h"
+#include "metrics.h"
+#include "mux.h"
+#include "uart.h"
+
+#define PAIRING_DEVICE_NAME_SIZE		256
+
+/**
+ * an accessory selector with the uart it is bridged to, plus the session state while bridged
+ */
+typedef struct {
+	accessory_selector selector;
+	char uart_device[PAIRING_DEVICE_NAME_SIZE];
+	uart_config uart;
+	char name[72];					// message prefix, empty for a single pairing
+	accessory_device *ad;
+	uart_port *port;
+	bridge *bridge;
+	mux *mux;					// instead of the bridge when channels are multiplexed
+	int hid_registered;
+	hid_stream *hid;
+	unsigned long sessions;				// accessory connections so far
+	metrics_slot metrics;
+} pairing;
+
+int pairing_load(const char *file_name, const uart_config *defaults, pairing **pairings);
+void pairing_set_uart_device(pairing *p, const char *uart_port);
+int pairing_matches(const pairing *p, const struct accessory_device *ad);
+
+#endif /* PAIRING_H_ */
@@ -0,0 +1,213 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "probe_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// seconds before a device found not AOA capable is probed again, its USB mode may have changed meanwhile
+#define NEGATIVE_TTL					60
+
+static probe_entry *probe_cache_get(const char *port_path, uint16_t vendor_id, uint16_t product_id, int create);
+static void probe_cache_save();
+
+static probe_entry *entries = NULL;
+static int entry_count = 0;
+static int entry_size = 0;
+static char *cache_file_name = NULL;
+
+/**
+ * load the entries saved in file_name, if present, and keep it updated at every change. Without this call the
+ * cache lives only in memory. Returns -1 if the file exists but cannot be read.
+ */
+int probe_cache_open(const char *file_name) {
+	char line[128];
+	FILE *file;
+
+	free(cache_file_name);
+	cache_file_name = strdup(file_name);
+	if (cache_file_name == NULL)
+		return -1;
+
+	file = fopen(file_name, "r");
+	if (file == NULL)
+		return 0;
+
+	// one entry per line: port-path vid:pid aoa-version endpoint-in endpoint-out max-packet-size expires
+	while (fgets(line, sizeof(line), file) != NULL) {
+		probe_entry entry;
+		unsigned int vendor_id, product_id, endpoint_in, endpoint_out, max_packet_size;
+		long long expires;
+
+		memset(&entry, 0, sizeof(entry));
+		if (sscanf(line, "%31s %x:%x %d %x %x %u %lld", entry.port_path, &vendor_id, &product_id, &entry.aoa_version,
+				&endpoint_in, &endpoint_out, &max_packet_size, &expires) != 8)
+			continue;
+
+		probe_entry *e = probe_cache_get(entry.port_path, vendor_id, product_id, 1);
+		if (e == NULL)
+			break;
+		e->aoa_version = entry.aoa_version;
+		e->endpoint_in = endpoint_in;
+		e->endpoint_out = endpoint_out;
+		e->max_packet_size = max_packet_size;
+		e->expires = expires;
+	}
+
+	int r = ferror(file) ? -1 : 0;
+	fclose(file);
+
+	return r;
+}
+
+void probe_cache_close() {
+	free(entries);
+	entries = NULL;
+	entry_count = entry_size = 0;
+	free(cache_file_name);
+	cache_file_name = NULL;
+}
+
+/**
+ * the entry of VID:PID at port_path, NULL when unknown or expired
+ */
+const probe_entry *probe_cache_lookup(const char *port_path, uint16_t vendor_id, uint16_t product_id) {
+	probe_entry *e = probe_cache_get(port_path, vendor_id, product_id, 0);
+
+	if (e != NULL && e->expires != 0 && e->expires <= time(NULL)) {
+		probe_cache_remove(port_path, vendor_id, product_id);
+		return NULL;
+	}
+
+	return e;
+}
+
+void probe_cache_set_negative(const char *port_path, uint16_t vendor_id, uint16_t product_id) {
+	probe_entry *e = probe_cache_get(port_path, vendor_id, product_id, 1);
+
+	if (e == NULL)
+		return;
+
+	e->aoa_version = 0;
+	e->endpoint_in = e->endpoint_out = 0;
+	e->max_packet_size = 0;
+	e->expires = time(NULL) + NEGATIVE_TTL;
+	probe_cache_save();
+}
+
+void probe_cache_set_version(const char *port_path, uint16_t vendor_id, uint16_t product_id, int aoa_version) {
+	probe_entry *e = probe_cache_get(port_path, vendor_id, product_id, 1);
+
+	if (e == NULL || (e->aoa_version == aoa_version && e->expires == 0))
+		return;
+
+	e->aoa_version = aoa_version;
+	e->expires = 0;
+	probe_cache_save();
+}
+
+/**
+ * endpoints of the accessory interface exposed after the switch by the device found as VID:PID at port_path
+ */
+void probe_cache_set_endpoints(const char *port_path, uint16_t vendor_id, uint16_t product_id, uint8_t endpoint_in, uint8_t endpoint_out, uint16_t max_packet_size) {
+	probe_entry *e = probe_cache_get(port_path, vendor_id, product_id, 1);
+
+	if (e == NULL)
+		return;
+	if (e->endpoint_in == endpoint_in && e->endpoint_out == endpoint_out && e->max_packet_size == max_packet_size)
+		return;
+
+	e->endpoint_in = endpoint_in;
+	e->endpoint_out = endpoint_out;
+	e->max_packet_size = max_packet_size;
+	probe_cache_save();
+}
+
+void probe_cache_remove(const char *port_path, uint16_t vendor_id, uint16_t product_id) {
+	probe_entry *e = probe_cache_get(port_path, vendor_id, product_id, 0);
+
+	if (e == NULL)
+		return;
+
+	*e = entries[--entry_count];
+	probe_cache_save();
+}
+
+static probe_entry *probe_cache_get(const char *port_path, uint16_t vendor_id, uint16_t product_id, int create) {
+	int i;
+
+	for (i = 0; i < entry_count; i++) {
+		if (entries[i].vendor_id == vendor_id && entries[i].product_id == product_id && strcmp(entries[i].port_path, port_path) == 0)
+			return &entries[i];
+	}
+
+	if (!create || strlen(port_path) >= PROBE_CACHE_PATH_SIZE)
+		return NULL;
+
+	if (entry_count == entry_size) {
+		int size = entry_size > 0 ? entry_size * 2 : 16;
+		probe_entry *grown = realloc(entries, size * sizeof(probe_entry));
+		if (grown == NULL)
+			return NULL;
+		entries = grown;
+		entry_size = size;
+	}
+
+	probe_entry *e = &entries[entry_count++];
+	memset(e, 0, sizeof(probe_entry));
+	strcpy(e->port_path, port_path);
+	e->vendor_id = vendor_id;
+	e->product_id = product_id;
+
+	return e;
+}
+
+/**
+ * rewrite the cache file, through a temporary file renamed over it so a crash never leaves it truncated
+ */
+static void probe_cache_save() {
+	char temp_name[4096];
+	FILE *file;
+	int i;
+
+	if (cache_file_name == NULL)
+		return;
+
+	snprintf(temp_name, sizeof(temp_name), "%s.tmp", cache_file_name);
+	file = fopen(temp_name, "w");
+	if (file == NULL)
+		return;
+
+	for (i = 0; i < entry_count; i++) {
+		probe_entry *e = &entries[i];
+		fprintf(file, "%s %04x:%04x %d %02x %02x %u %lld\n", e->port_path, e->vendor_id, e->product_id, e->aoa_version,
+				e->endpoint_in, e->endpoint_out, e->max_packet_size, (long long) e->expires);
+	}
+
+	if (fclose(file) == 0)
+		rename(temp_name, cache_file_name);
+	else
+		remove(temp_name);
+}
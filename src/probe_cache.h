@@ -0,0 +1,56 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PROBE_CACHE_H_
+#define PROBE_CACHE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define PROBE_CACHE_PATH_SIZE			32
+
+/**
+ * outcome of the accessory probe of a VID:PID at a port path. aoa_version 0 marks a device that is not AOA
+ * capable: such negative entries expire, so a device is probed again once in a while. endpoint_in 0 means
+ * endpoints not yet known.
+ */
+typedef struct {
+	char port_path[PROBE_CACHE_PATH_SIZE];
+	uint16_t vendor_id;
+	uint16_t product_id;
+	int aoa_version;
+	uint8_t endpoint_in;
+	uint8_t endpoint_out;
+	uint16_t max_packet_size;
+	time_t expires;					// 0 for entries that do not expire
+} probe_entry;
+
+int probe_cache_open(const char *file_name);
+void probe_cache_close();
+const probe_entry *probe_cache_lookup(const char *port_path, uint16_t vendor_id, uint16_t product_id);
+void probe_cache_set_negative(const char *port_path, uint16_t vendor_id, uint16_t product_id);
+void probe_cache_set_version(const char *port_path, uint16_t vendor_id, uint16_t product_id, int aoa_version);
+void probe_cache_set_endpoints(const char *port_path, uint16_t vendor_id, uint16_t product_id, uint8_t endpoint_in, uint8_t endpoint_out, uint16_t max_packet_size);
+void probe_cache_remove(const char *port_path, uint16_t vendor_id, uint16_t product_id);
+
+#endif /* PROBE_CACHE_H_ */
@@ -0,0 +1,469 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "replay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libusb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+#include "trace.h"
+
+#define REPLAY_MAX_INTERFACES			256
+#define REPLAY_POLL_MS					100
+#define REPLAY_SLEEP_MAX_NS			100000000ULL		// a stop request is seen at least this often
+
+typedef struct {
+	uint64_t timestamp_ns;
+	size_t offset;					// of the data in the mapped file
+	int size;
+	int type;
+} replay_packet;
+
+struct replay {
+	const unsigned char *map;
+	size_t map_size;
+	replay_packet *packets;
+	int packet_count;
+	uart_port *port;
+	accessory_device *ad;
+	double speed;
+	int started;
+	pthread_t thread;
+	atomic_int stop;
+	int done_fd;
+	// written by the replay thread, read once it is done
+	unsigned long sent;
+	unsigned long long bytes;
+	unsigned long errors;
+	uint64_t elapsed_ns;
+	uint64_t *send_ns;
+	uint64_t *late_ns;
+};
+
+static int replay_index(replay *r);
+static int replay_add_packet(replay *r, uint64_t timestamp_ns, size_t offset, int size, int type);
+static const unsigned char *replay_find_option(const unsigned char *p, const unsigned char *end, uint16_t code, uint16_t *size);
+static void *replay_thread(void *arg);
+static int replay_to_uart(replay *r, const unsigned char *data, int size);
+static int replay_drain_uart(replay *r);
+static int replay_sleep_until(replay *r, uint64_t due_ns);
+static uint64_t replay_percentile(uint64_t *values, unsigned long count, int per_mille);
+static int replay_compare(const void *a, const void *b);
+static uint64_t replay_time_ns();
+
+/**
+ * map a pcapng capture written with --capture and index its packets. Packets are sent straight from the
+ * mapping, without copies. Returns NULL with errno set, EBADMSG if the file is not a valid capture.
+ */
+replay *replay_open(const char *file_name) {
+	struct stat st;
+	int error;
+
+	replay *r = calloc(1, sizeof(replay));
+	if (r == NULL)
+		return NULL;
+	r->done_fd = -1;
+	atomic_init(&r->stop, 0);
+
+	int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		goto fail;
+	if (st.st_size == 0) {
+		errno = EBADMSG;
+		goto fail;
+	}
+
+	r->map_size = st.st_size;
+	r->map = mmap(NULL, r->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		goto fail;
+	}
+	close(fd);
+	fd = -1;
+	madvise((void *) r->map, r->map_size, MADV_SEQUENTIAL);
+
+	r->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->done_fd < 0 || replay_index(r) < 0)
+		goto fail;
+
+	r->send_ns = malloc((r->packet_count + 1) * sizeof(uint64_t));
+	r->late_ns = malloc((r->packet_count + 1) * sizeof(uint64_t));
+	if (r->send_ns == NULL || r->late_ns == NULL)
+		goto fail;
+
+	return r;
+
+fail:
+	error = errno;
+	if (fd >= 0)
+		close(fd);
+	replay_close(r);
+	errno = error;
+	return NULL;
+}
+
+int replay_get_packet_count(replay *r) {
+	return r->packet_count;
+}
+
+/**
+ * replay the capture from a thread: data received from the accessory is written to port and data sent to the
+ * accessory is sent to ad again, either may be NULL to skip that direction. speed scales the capture timing,
+ * 2 replays twice as fast, 0 as fast as possible. The done fd is readable once everything was sent.
+ */
+int replay_start(replay *r, uart_port *port, accessory_device *ad, double speed) {
+	r->port = port;
+	r->ad = ad;
+	r->speed = speed;
+
+	if (pthread_create(&r->thread, NULL, replay_thread, r) != 0)
+		return -1;
+	r->started = 1;
+
+	return 0;
+}
+
+int replay_get_done_fd(replay *r) {
+	return r->done_fd;
+}
+
+/**
+ * stop the replay thread, at the latest once the packet being sent is done
+ */
+void replay_stop(replay *r) {
+	if (!r->started)
+		return;
+
+	atomic_store(&r->stop, 1);
+	pthread_join(r->thread, NULL);
+	r->started = 0;
+}
+
+/**
+ * throughput and latencies of a stopped replay
+ */
+void replay_get_report(replay *r, replay_report *report) {
+	memset(report, 0, sizeof(replay_report));
+	report->packets = r->sent;
+	report->bytes = r->bytes;
+	report->errors = r->errors;
+	report->elapsed_ns = r->elapsed_ns;
+	if (r->sent == 0)
+		return;
+
+	qsort(r->send_ns, r->sent, sizeof(uint64_t), replay_compare);
+	qsort(r->late_ns, r->sent, sizeof(uint64_t), replay_compare);
+	report->send_p50_ns = replay_percentile(r->send_ns, r->sent, 500);
+	report->send_p99_ns = replay_percentile(r->send_ns, r->sent, 990);
+	report->send_max_ns = r->send_ns[r->sent - 1];
+	report->late_p50_ns = replay_percentile(r->late_ns, r->sent, 500);
+	report->late_p99_ns = replay_percentile(r->late_ns, r->sent, 990);
+	report->late_max_ns = r->late_ns[r->sent - 1];
+}
+
+void replay_close(replay *r) {
+	if (r == NULL)
+		return;
+
+	replay_stop(r);
+	if (r->map != NULL)
+		munmap((void *) r->map, r->map_size);
+	if (r->done_fd >= 0)
+		close(r->done_fd);
+	free(r->packets);
+	free(r->send_ns);
+	free(r->late_ns);
+	free(r);
+}
+
+/**
+ * walk the blocks of the mapping and keep the packets of our link type having a direction. The sections of
+ * an appended or rotated capture are replayed back to back, the time between two runs is skipped.
+ */
+static int replay_index(replay *r) {
+	uint64_t multiplier[REPLAY_MAX_INTERFACES];
+	int interface_count = 0;
+	int section_start = 0;
+	int64_t shift = 0;
+	uint64_t previous = 0;
+	size_t offset = 0;
+
+	while (offset + 12 <= r->map_size) {
+		const unsigned char *block = r->map + offset;
+		uint32_t fields[7];
+		uint16_t size;
+
+		memcpy(fields, block, 2 * sizeof(uint32_t));
+		uint32_t length = fields[1];
+		if (length < 12 || length % 4 != 0 || length > r->map_size - offset)
+			goto invalid;
+		const unsigned char *end = block + length - sizeof(uint32_t);
+
+		if (fields[0] == PCAPNG_BLOCK_SECTION_HEADER) {
+			if (length < 28)
+				goto invalid;
+			// written in host order by capture, the other byte order is not supported
+			memcpy(&fields[2], block + 8, sizeof(uint32_t));
+			if (fields[2] != PCAPNG_BYTE_ORDER_MAGIC)
+				goto invalid;
+			interface_count = 0;
+			section_start = 1;
+		} else if (fields[0] == PCAPNG_BLOCK_INTERFACE_DESCRIPTION) {
+			uint16_t link_type;
+			if (length < 20 || interface_count == REPLAY_MAX_INTERFACES)
+				goto invalid;
+			memcpy(&link_type, block + 8, sizeof(link_type));
+
+			// timestamps in microseconds unless if_tsresol says otherwise, only powers of 10 up to ns are handled
+			int resolution = 6;
+			const unsigned char *value = replay_find_option(block + 16, end, PCAPNG_OPT_IF_TSRESOL, &size);
+			if (value != NULL && size >= 1)
+				resolution = *value;
+			multiplier[interface_count] = 0;
+			if (link_type == CAPTURE_LINK_TYPE && resolution <= 9) {
+				multiplier[interface_count] = 1;
+				for (; resolution < 9; resolution++)
+					multiplier[interface_count] *= 10;
+			}
+			interface_count++;
+		} else if (fields[0] == PCAPNG_BLOCK_ENHANCED_PACKET) {
+			uint32_t flags = 0;
+			if (length < 32)
+				goto invalid;
+			memcpy(fields, block, sizeof(fields));
+			uint32_t captured = fields[5];
+			if (captured > length - 32)
+				goto invalid;
+			if (fields[2] >= (uint32_t) interface_count || multiplier[fields[2]] == 0)
+				goto next;
+
+			const unsigned char *value = replay_find_option(block + 28 + ((captured + 3) & ~3), end, PCAPNG_OPT_EPB_FLAGS, &size);
+			if (value != NULL && size >= sizeof(flags))
+				memcpy(&flags, value, sizeof(flags));
+			if ((flags & 3) != PCAPNG_EPB_FLAG_INBOUND && (flags & 3) != PCAPNG_EPB_FLAG_OUTBOUND)
+				goto next;
+
+			uint64_t timestamp = (((uint64_t) fields[3] << 32) | fields[4]) * multiplier[fields[2]];
+			if (section_start && r->packet_count > 0)
+				shift = (int64_t) (previous - timestamp);
+			section_start = 0;
+			timestamp += shift;
+			if (timestamp < previous)
+				timestamp = previous;
+			previous = timestamp;
+
+			if (replay_add_packet(r, timestamp, offset + 28, captured,
+					(flags & 3) == PCAPNG_EPB_FLAG_INBOUND ? TRACE_RX : TRACE_TX) < 0)
+				return -1;
+		}
+
+next:
+		offset += length;
+	}
+
+	return 0;
+
+invalid:
+	errno = EBADMSG;
+	return -1;
+}
+
+static int replay_add_packet(replay *r, uint64_t timestamp_ns, size_t offset, int size, int type) {
+	// grown by powers of two
+	if ((r->packet_count & (r->packet_count - 1)) == 0) {
+		replay_packet *grown = realloc(r->packets, (r->packet_count ? 2 * r->packet_count : 1024) * sizeof(replay_packet));
+		if (grown == NULL)
+			return -1;
+		r->packets = grown;
+	}
+
+	replay_packet *packet = &r->packets[r->packet_count++];
+	packet->timestamp_ns = timestamp_ns;
+	packet->offset = offset;
+	packet->size = size;
+	packet->type = type;
+
+	return 0;
+}
+
+/**
+ * value of the first option code between p and end, NULL if not there
+ */
+static const unsigned char *replay_find_option(const unsigned char *p, const unsigned char *end, uint16_t code, uint16_t *size) {
+	uint16_t header[2];
+
+	while (p + sizeof(header) <= end) {
+		memcpy(header, p, sizeof(header));
+		if (header[0] == PCAPNG_OPT_END_OF_OPT || p + sizeof(header) + header[1] > end)
+			break;
+		if (header[0] == code) {
+			*size = header[1];
+			return p + sizeof(header);
+		}
+		p += sizeof(header) + ((header[1] + 3) & ~3);
+	}
+
+	return NULL;
+}
+
+static void *replay_thread(void *arg) {
+	replay *r = arg;
+	uint64_t start = replay_time_ns();
+	uint64_t origin = 0;
+	int timed = 0;
+	int i;
+
+	for (i = 0; i < r->packet_count && !atomic_load(&r->stop); i++) {
+		replay_packet *packet = &r->packets[i];
+		const unsigned char *data = r->map + packet->offset;
+		int result;
+
+		if ((packet->type == TRACE_RX && r->port == NULL) || (packet->type == TRACE_TX && r->ad == NULL))
+			continue;
+
+		// timing is relative to the first packet replayed
+		if (!timed) {
+			origin = packet->timestamp_ns;
+			timed = 1;
+		}
+		uint64_t due = start;
+		if (r->speed > 0) {
+			due += (uint64_t) ((packet->timestamp_ns - origin) / r->speed);
+			if (replay_sleep_until(r, due) < 0)
+				break;
+		}
+
+		uint64_t begin = replay_time_ns();
+		if (packet->type == TRACE_RX)
+			result = replay_to_uart(r, data, packet->size);
+		else
+			result = accessory_send_data(r->ad, (unsigned char *) data, packet->size);
+		uint64_t end = replay_time_ns();
+
+		if (result < 0) {
+			r->errors++;
+			if (packet->type == TRACE_RX || result == LIBUSB_ERROR_NO_DEVICE)
+				break;
+			continue;
+		}
+
+		r->send_ns[r->sent] = end - begin;
+		r->late_ns[r->sent] = r->speed > 0 && begin > due ? begin - due : 0;
+		r->sent++;
+		r->bytes += result;
+	}
+
+	if (r->port != NULL && replay_drain_uart(r) < 0)
+		r->errors++;
+	r->elapsed_ns = replay_time_ns() - start;
+	eventfd_write(r->done_fd, 1);
+
+	return NULL;
+}
+
+/**
+ * queue the whole packet to the uart, waiting for room rather than dropping data as the bridge would
+ */
+static int replay_to_uart(replay *r, const unsigned char *data, int size) {
+	struct pollfd fds;
+
+	fds.fd = uart_get_fd(r->port);
+	fds.events = POLLOUT;
+	while (uart_get_pending(r->port) > 0 && uart_get_pending_space(r->port) < (size_t) size) {
+		if (atomic_load(&r->stop))
+			return -1;
+		poll(&fds, 1, REPLAY_POLL_MS);
+		if (uart_flush_pending(r->port) < 0)
+			return -1;
+	}
+
+	return uart_send_buffer(r->port, (void *) data, size);
+}
+
+/**
+ * wait for the uart output queue to be written, so the elapsed time covers the whole transfer
+ */
+static int replay_drain_uart(replay *r) {
+	struct pollfd fds;
+
+	fds.fd = uart_get_fd(r->port);
+	fds.events = POLLOUT;
+	while (uart_get_pending(r->port) > 0 && !atomic_load(&r->stop)) {
+		poll(&fds, 1, REPLAY_POLL_MS);
+		if (uart_flush_pending(r->port) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * returns -1 if stopped meanwhile
+ */
+static int replay_sleep_until(replay *r, uint64_t due_ns) {
+	struct timespec ts;
+
+	while (!atomic_load(&r->stop)) {
+		uint64_t now = replay_time_ns();
+		if (now >= due_ns)
+			return 0;
+
+		uint64_t wake = due_ns - now > REPLAY_SLEEP_MAX_NS ? now + REPLAY_SLEEP_MAX_NS : due_ns;
+		ts.tv_sec = wake / 1000000000;
+		ts.tv_nsec = wake % 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+
+	return -1;
+}
+
+static uint64_t replay_percentile(uint64_t *values, unsigned long count, int per_mille) {
+	return values[(count - 1) * per_mille / 1000];
+}
+
+static int replay_compare(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t replay_time_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
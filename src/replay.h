@@ -0,0 +1,59 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>
+
+#include "accessory.h"
+#include "uart.h"
+
+typedef struct replay replay;
+
+/**
+ * outcome of a replay. Latencies are the time spent in the send call and how late it started compared to
+ * the scaled capture timing.
+ */
+typedef struct {
+	unsigned long packets;
+	unsigned long long bytes;
+	unsigned long errors;
+	uint64_t elapsed_ns;
+	uint64_t send_p50_ns;
+	uint64_t send_p99_ns;
+	uint64_t send_max_ns;
+	uint64_t late_p50_ns;
+	uint64_t late_p99_ns;
+	uint64_t late_max_ns;
+} replay_report;
+
+replay *replay_open(const char *file_name);
+int replay_get_packet_count(replay *r);
+int replay_start(replay *r, uart_port *port, accessory_device *ad, double speed);
+int replay_get_done_fd(replay *r);
+void replay_stop(replay *r);
+void replay_get_report(replay *r, replay_report *report);
+void replay_close(replay *r);
+
+#endif /* REPLAY_H_ */
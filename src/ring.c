@@ -0,0 +1,174 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void ring_update_stats(ring_buffer *ring, size_t head, size_t tail);
+
+/**
+ * allocate a ring of size bytes, rounded up to the next power of two
+ */
+int ring_init(ring_buffer *ring, size_t size) {
+	size_t ring_size = 1;
+
+	while (ring_size < size)
+		ring_size <<= 1;
+
+	memset(ring, 0, sizeof(ring_buffer));
+	ring->buffer = malloc(ring_size);
+	if (ring->buffer == NULL)
+		return -1;
+	ring->size = ring_size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+
+	return 0;
+}
+
+void ring_free(ring_buffer *ring) {
+	// size and statistics are left readable after release
+	free(ring->buffer);
+	ring->buffer = NULL;
+}
+
+size_t ring_used(ring_buffer *ring) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	return head - tail;
+}
+
+size_t ring_space(ring_buffer *ring) {
+	return ring->size - ring_used(ring);
+}
+
+/**
+ * producer side: copy size bytes in the ring. Nothing is written if there is not room for all of them, in that
+ * case 0 is returned and the event is accounted in full_count.
+ */
+size_t ring_write(ring_buffer *ring, const void *data, size_t size) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t space = ring->size - (head - tail);
+	size_t offset = head & (ring->size - 1);
+	size_t first;
+
+	if (size > space) {
+		ring->full_count++;
+		return 0;
+	}
+	if (size == 0)
+		return 0;
+
+	first = ring->size - offset;
+	if (first > size)
+		first = size;
+	memcpy(&ring->buffer[offset], data, first);
+	memcpy(ring->buffer, (const unsigned char *) data + first, size - first);
+
+	atomic_store_explicit(&ring->head, head + size, memory_order_release);
+	ring_update_stats(ring, head + size, tail);
+
+	return size;
+}
+
+/**
+ * producer side: return the largest contiguous free region, to be filled in place and then committed
+ */
+unsigned char *ring_write_region(ring_buffer *ring, size_t *size) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t space = ring->size - (head - tail);
+	size_t offset = head & (ring->size - 1);
+
+	if (space == 0)
+		ring->full_count++;
+	if (space > ring->size - offset)
+		space = ring->size - offset;
+
+	*size = space;
+	return &ring->buffer[offset];
+}
+
+void ring_write_commit(ring_buffer *ring, size_t size) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->head, head + size, memory_order_release);
+	ring_update_stats(ring, head + size, atomic_load_explicit(&ring->tail, memory_order_relaxed));
+}
+
+/**
+ * consumer side: return the contiguous data region starting offset bytes after the read position. A non zero
+ * offset lets the consumer have several regions in use (e.g. in flight transfers) before committing them, it
+ * must not exceed the data available.
+ */
+unsigned char *ring_read_region(ring_buffer *ring, size_t offset, size_t *size) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed) + offset;
+	size_t used = head - tail;
+	size_t position = tail & (ring->size - 1);
+
+	if (used > ring->size - position)
+		used = ring->size - position;
+
+	*size = used;
+	return &ring->buffer[position];
+}
+
+/**
+ * consumer side: copy size bytes starting offset bytes after the read position, without consuming them. Returns
+ * size or 0 if not yet available.
+ */
+size_t ring_peek(ring_buffer *ring, size_t offset, void *data, size_t size) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t position = (tail + offset) & (ring->size - 1);
+	size_t first;
+
+	if (head - tail < offset + size || size == 0)
+		return 0;
+
+	first = ring->size - position;
+	if (first > size)
+		first = size;
+	memcpy(data, &ring->buffer[position], first);
+	memcpy((unsigned char *) data + first, ring->buffer, size - first);
+
+	return size;
+}
+
+void ring_read_commit(ring_buffer *ring, size_t size) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+}
+
+static void ring_update_stats(ring_buffer *ring, size_t head, size_t tail) {
+	size_t used = head - tail;
+
+	if (used > ring->high_water)
+		ring->high_water = used;
+}
@@ -0,0 +1,54 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * single producer / single consumer lock free byte ring. head is only written by the producer thread and
+ * tail only by the consumer one, statistics are owned by the producer.
+ */
+typedef struct {
+	unsigned char *buffer;
+	size_t size;
+	atomic_size_t head;
+	atomic_size_t tail;
+	size_t high_water;
+	unsigned long full_count;
+} ring_buffer;
+
+int ring_init(ring_buffer *ring, size_t size);
+void ring_free(ring_buffer *ring);
+size_t ring_used(ring_buffer *ring);
+size_t ring_space(ring_buffer *ring);
+size_t ring_write(ring_buffer *ring, const void *data, size_t size);
+unsigned char *ring_write_region(ring_buffer *ring, size_t *size);
+void ring_write_commit(ring_buffer *ring, size_t size);
+unsigned char *ring_read_region(ring_buffer *ring, size_t offset, size_t *size);
+size_t ring_peek(ring_buffer *ring, size_t offset, void *data, size_t size);
+void ring_read_commit(ring_buffer *ring, size_t size);
+
+#endif /* RING_H_ */
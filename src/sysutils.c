@@ -53,3 +53,28 @@ int getasynckey() {
 
 	return ch;
 }
+
+static struct termios console_termios;
+static int console_is_raw = 0;
+
+/**
+ * switch stdin in not canonical mode without echo so every key press is readable as soon as typed, or
+ * restore the original terminal settings
+ */
+void console_set_raw_mode(int enable) {
+	struct termios new_termios;
+
+	if (enable && !console_is_raw) {
+		if (tcgetattr(fileno(stdin), &console_termios) != 0)
+			return;
+		new_termios = console_termios;
+		new_termios.c_lflag &= ~(ICANON | ECHO);
+		new_termios.c_cc[VTIME] = 0;
+		new_termios.c_cc[VMIN] = 1;
+		if (tcsetattr(fileno(stdin), TCSANOW, &new_termios) == 0)
+			console_is_raw = 1;
+	} else if (!enable && console_is_raw) {
+		tcsetattr(fileno(stdin), TCSANOW, &console_termios);
+		console_is_raw = 0;
+	}
+}
@@ -25,5 +25,6 @@
 #define SYSUTILS_H_
 
 int getasynckey();
+void console_set_raw_mode(int enable);
 
 #endif /* SYSUTILS_H_ */
@@ -0,0 +1,272 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include "ring.h"
+
+#define TRACE_RING_SIZE					(4 * 1024 * 1024)
+#define BYTES_PER_LINE					16
+#define LINE_SIZE						80		// "  offset  16 x "XX " |16 x ASCII|\n" with spare
+#define HEADER_SIZE					160
+#define TRACE_POLL_MS					10
+
+#define COLOR_RED						"\e[31m"
+#define COLOR_BLUE						"\e[34m"
+#define COLOR_RESET					"\033[0m"
+
+/**
+ * every traced packet is queued as this header followed by its data
+ */
+typedef struct {
+	uint64_t timestamp_ns;
+	const char *name;
+	int32_t size;
+	int32_t type;
+} trace_record;
+
+static void *trace_thread(void *arg);
+static int trace_wait();
+static size_t trace_format_header(char *out, const trace_record *record);
+static size_t trace_format_data(char *out, const unsigned char *data, int size);
+static uint64_t trace_time_ns();
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static ring_buffer ring;
+static int stop_fd = -1;
+static int output_fd = -1;
+static int use_colors = 0;
+static int started = 0;
+static pthread_t thread;
+static uint64_t start_ns;
+static unsigned long dropped_packets = 0;
+
+// used by the logging thread only
+static unsigned char *packet = NULL;
+static char *text = NULL;
+static size_t text_size = 0;
+
+/**
+ * start the logging thread writing the packets traced from now on to fd. Packets are queued in a lock free
+ * ring that the thread polls every TRACE_POLL_MS and formats, so tracing costs the forwarding path a copy and
+ * never a system call.
+ */
+int trace_start(int fd, int colors) {
+	output_fd = fd;
+	use_colors = colors;
+	start_ns = trace_time_ns();
+	dropped_packets = 0;
+
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stop_fd < 0 || ring_init(&ring, TRACE_RING_SIZE) < 0) {
+		trace_stop();
+		return -1;
+	}
+
+	if (pthread_create(&thread, NULL, trace_thread, NULL) != 0) {
+		trace_stop();
+		return -1;
+	}
+	started = 1;
+
+	return 0;
+}
+
+/**
+ * write what is still queued, then stop the logging thread
+ */
+void trace_stop() {
+	if (started) {
+		eventfd_write(stop_fd, 1);
+		pthread_join(thread, NULL);
+		started = 0;
+		if (dropped_packets > 0)
+			fprintf(stderr, "Trace: %lu packets not shown, logging slower than forwarding\n", dropped_packets);
+	}
+
+	if (stop_fd >= 0)
+		close(stop_fd);
+	stop_fd = -1;
+	ring_free(&ring);
+}
+
+/**
+ * queue a packet for the logging thread. When the ring is full the packet is dropped and accounted: tracing
+ * never stalls forwarding.
+ */
+void trace_packet(const char *name, const unsigned char *buffer, int size, int type) {
+	trace_record record;
+
+	if (!started)
+		return;
+
+	if (ring_space(&ring) < sizeof(record) + size) {
+		dropped_packets++;
+		return;
+	}
+
+	record.timestamp_ns = trace_time_ns();
+	record.name = name;
+	record.size = size;
+	record.type = type;
+	ring_write(&ring, &record, sizeof(record));
+	ring_write(&ring, buffer, size);
+}
+
+static void *trace_thread(void *arg) {
+	trace_record record;
+	struct iovec iov[2];
+	char header[HEADER_SIZE];
+	int stopping = 0;
+
+	packet = malloc(TRACE_RING_SIZE);
+	if (packet == NULL)
+		return NULL;
+
+	while (1) {
+		// header and data are written separately: a record is complete only when its data is there too
+		if (ring_peek(&ring, 0, &record, sizeof(record)) == 0 || ring_used(&ring) < sizeof(record) + record.size) {
+			if (stopping)
+				break;
+			stopping = trace_wait();
+			continue;
+		}
+
+		ring_peek(&ring, sizeof(record), packet, record.size);
+		ring_read_commit(&ring, sizeof(record) + record.size);
+
+		size_t needed = ((size_t) record.size / BYTES_PER_LINE + 1) * LINE_SIZE + sizeof(COLOR_RESET);
+		if (needed > text_size) {
+			char *grown = realloc(text, needed);
+			if (grown == NULL)
+				continue;
+			text = grown;
+			text_size = needed;
+		}
+
+		iov[0].iov_base = header;
+		iov[0].iov_len = trace_format_header(header, &record);
+		iov[1].iov_base = text;
+		iov[1].iov_len = trace_format_data(text, packet, record.size);
+		if (use_colors) {
+			memcpy(text + iov[1].iov_len, COLOR_RESET, sizeof(COLOR_RESET) - 1);
+			iov[1].iov_len += sizeof(COLOR_RESET) - 1;
+		}
+
+		while (writev(output_fd, iov, 2) < 0 && errno == EINTR)
+			;
+	}
+
+	free(packet);
+	free(text);
+	packet = NULL;
+	text = NULL;
+	text_size = 0;
+
+	return NULL;
+}
+
+/**
+ * sleep until the ring is looked at again. Returns 1 when asked to stop
+ */
+static int trace_wait() {
+	struct pollfd fds;
+
+	fds.fd = stop_fd;
+	fds.events = POLLIN;
+	while (poll(&fds, 1, TRACE_POLL_MS) < 0 && errno == EINTR)
+		;
+
+	return fds.revents != 0;
+}
+
+static size_t trace_format_header(char *out, const trace_record *record) {
+	uint64_t elapsed = record->timestamp_ns - start_ns;
+
+	return snprintf(out, HEADER_SIZE, "%s[%llu.%06llu] %s%s %d bytes\n",
+			use_colors ? (record->type == TRACE_RX ? COLOR_BLUE : COLOR_RED) : "",
+			(unsigned long long) (elapsed / 1000000000), (unsigned long long) (elapsed % 1000000000 / 1000),
+			record->name != NULL ? record->name : "", record->type == TRACE_RX ? "RX" : "TX", record->size);
+}
+
+/**
+ * hex dump with offset and ASCII columns, built with table lookups: no stdio call per byte
+ */
+static size_t trace_format_data(char *out, const unsigned char *data, int size) {
+	char *p = out;
+	int offset, i;
+
+	for (offset = 0; offset < size; offset += BYTES_PER_LINE) {
+		int count = size - offset < BYTES_PER_LINE ? size - offset : BYTES_PER_LINE;
+
+		*p++ = ' ';
+		*p++ = ' ';
+		for (i = 20; i >= 0; i -= 4)
+			*p++ = hex_digits[(offset >> i) & 0xF];
+		*p++ = ' ';
+		*p++ = ' ';
+
+		for (i = 0; i < BYTES_PER_LINE; i++) {
+			if (i < count) {
+				*p++ = hex_digits[data[offset + i] >> 4];
+				*p++ = hex_digits[data[offset + i] & 0xF];
+			} else {
+				*p++ = ' ';
+				*p++ = ' ';
+			}
+			*p++ = ' ';
+			if (i == BYTES_PER_LINE / 2 - 1)
+				*p++ = ' ';
+		}
+
+		*p++ = '|';
+		for (i = 0; i < count; i++) {
+			unsigned char c = data[offset + i];
+			*p++ = (c >= 0x20 && c < 0x7F) ? c : '.';
+		}
+		*p++ = '|';
+		*p++ = '\n';
+	}
+
+	return p - out;
+}
+
+static uint64_t trace_time_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
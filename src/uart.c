@@ -21,68 +21,718 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE					// posix_openpt(), ptsname_r() and accept4()
+
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
-#include <sys/param.h>
-
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/serial.h>
+
+#include "metrics.h"
+#include "ring.h"
 #include "uart.h"
+#include "uart_baud.h"
+
+#define OUTPUT_QUEUE_SIZE				65536
+#define LATENCY_TIMER_MS				1
+
+#define ARRAY_LEN(x)    ( sizeof( x ) / sizeof( x[ 0 ]))
+
+struct uart_port {
+	int fd;
+	ring_buffer output_queue;
+	uart_stats stats;
+	metrics_slot *metrics;				// may be NULL
+	unsigned int actual_baud_rate;
+	struct serial_icounter_struct icount_base;
+	int low_latency_applied;
+	int async_low_latency_restore;
+	char latency_timer_path[PATH_MAX];
+	int latency_timer_restore;
+	int peer_fd;					// slave side of a pseudo terminal, -1 for a real port
+	char peer_name[UART_PEER_NAME_SIZE];
+	int listen_fd;					// socket target waiting for its program, -1 for a tty
+	int is_tcp;
+	char socket_path[UART_PEER_NAME_SIZE];		// unix socket file to remove at close
+};
+
+typedef struct
+{
+	speed_t speed;
+	unsigned baud_rate;
+} baud_info;
+
+static const baud_info baud_table[] = {
+		{ B50, 50 },
+		{ B75, 75 },
+		{ B110, 110 },
+		{ B134, 134 },
+		{ B150, 150 },
+		{ B200, 200 },
+		{ B300, 300 },
+		{ B600, 600 },
+		{ B1200, 1200 },
+		{ B1800, 1800 },
+		{ B2400, 2400 },
+		{ B4800, 4800 },
+		{ B9600, 9600 },
+		{ B19200, 19200 },
+		{ B38400, 38400 },
+		{ B57600, 57600 },
+		{ B115200, 115200 },
+		{ B230400, 230400 },
+#ifdef B460800
+		{ B460800, 460800 },
+#endif
+#ifdef B500000
+		{ B500000, 500000 },
+#endif
+#ifdef B576000
+		{ B576000, 576000 },
+#endif
+#ifdef B921600
+		{ B921600, 921600 },
+#endif
+#ifdef B1000000
+		{ B1000000, 1000000 },
+#endif
+#ifdef B1152000
+		{ B1152000, 1152000 },
+#endif
+#ifdef B1500000
+		{ B1500000, 1500000 },
+#endif
+#ifdef B2000000
+		{ B2000000, 2000000 },
+#endif
+#ifdef B2500000
+		{ B2500000, 2500000 },
+#endif
+#ifdef B3000000
+		{ B3000000, 3000000 },
+#endif
+#ifdef B3500000
+		{ B3500000, 3500000 },
+#endif
+#ifdef B4000000
+		{ B4000000, 4000000 },
+#endif
+};
 
 static void uart_set_blocking(int fd, int should_block);
-static int uart_set_interface_attribs(int fd, int speed, int parity);
+static int uart_set_interface_attribs(int fd, speed_t speed, const uart_config *config);
+static speed_t uart_lookup_speed(unsigned int baud_rate);
+static int uart_set_async_low_latency(uart_port *port, int enable);
+static int uart_set_latency_timer(uart_port *port, const char *device_name, int value);
+static int uart_open_pty(uart_port *port);
+static int uart_open_socket(uart_port *port, const char *device_name);
 
-static int fd = -1;
 
-int uart_open(const char *device_name, int speed, int parity) {
+/**
+ * default framing 8N1 without flow control
+ */
+void uart_config_init(uart_config *config, unsigned int baud_rate) {
+	config->baud_rate = baud_rate;
+	config->data_bits = 8;
+	config->parity = 'N';
+	config->stop_bits = 1;
+	config->rtscts = 0;
+	config->low_latency = 0;
+}
 
-	fd = open(device_name, O_RDWR | O_NOCTTY | O_SYNC);
-	if (fd < 0)
+/**
+ * parse a framing string like "8N1", "7E1" or "8N2" in config. Returns 0 or -1 if not valid
+ */
+int uart_parse_framing(const char *framing, uart_config *config) {
+	if (strlen(framing) != 3)
 		return -1;
 
-	if (uart_set_interface_attribs(fd, speed, parity) < 0)
+	if (framing[0] < '5' || framing[0] > '8')
 		return -1;
+	char parity = toupper((unsigned char) framing[1]);
+	if (parity == 0 || strchr("NEOMS", parity) == NULL)
+		return -1;
+	if (framing[2] != '1' && framing[2] != '2')
+		return -1;
+
+	config->data_bits = framing[0] - '0';
+	config->parity = parity;
+	config->stop_bits = framing[2] - '0';
+
+	return 0;
+}
+
+/**
+ * open device_name with config at any baud rate: standard rates use the matching Bxxx constant, the others are programmed
+ * through termios2/BOTHER. The rate achieved by the driver is available with uart_get_baud_rate().
+ * Returns the port, NULL on error.
+ */
+uart_port *uart_open(const char *device_name, const uart_config *config) {
+	unsigned int baud_rate = config->baud_rate;
+	speed_t speed = uart_lookup_speed(baud_rate);
+	uart_port *port;
+
+	port = calloc(1, sizeof(uart_port));
+	if (port == NULL)
+		return NULL;
+	port->async_low_latency_restore = -1;
+	port->latency_timer_restore = -1;
+	port->fd = port->peer_fd = port->listen_fd = -1;
+
+	// no line to set up: the socket passes data at any rate, the baud rate only times the idle gap
+	if (strncmp(device_name, UART_UNIX_PREFIX, strlen(UART_UNIX_PREFIX)) == 0 || strncmp(device_name, UART_TCP_PREFIX, strlen(UART_TCP_PREFIX)) == 0) {
+		port->actual_baud_rate = baud_rate;
+		if (uart_open_socket(port, device_name) < 0 || ring_init(&port->output_queue, OUTPUT_QUEUE_SIZE) < 0) {
+			uart_close(port);
+			return NULL;
+		}
+		return port;
+	}
+
+	if (strcmp(device_name, UART_PTY) == 0) {
+		if (uart_open_pty(port) < 0) {
+			uart_close(port);
+			return NULL;
+		}
+	} else {
+		port->fd = open(device_name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (port->fd < 0) {
+			free(port);
+			return NULL;
+		}
+	}
+
+	// line settings of a pseudo terminal are those of its slave side
+	int settings_fd = port->peer_fd >= 0 ? port->peer_fd : port->fd;
+	if (uart_set_interface_attribs(settings_fd, speed != B0 ? speed : B38400, config) < 0) {
+		uart_close(port);
+		return NULL;
+	}
 
 	// set no blocking mode
-	uart_set_blocking(fd, 0);
+	uart_set_blocking(port->fd, 0);
+
+	// must follow every tcsetattr(): a termios v1 call would not preserve the BOTHER speed
+	if (speed == B0 && uart_set_custom_baud_rate(settings_fd, baud_rate) < 0) {
+		uart_close(port);
+		return NULL;
+	}
+
+	if (uart_get_actual_baud_rate(settings_fd, &port->actual_baud_rate) < 0)
+		port->actual_baud_rate = baud_rate;
+
+	// best effort: what the driver or adapter does not support is simply not reported as applied
+	if (config->low_latency) {
+		if (uart_set_async_low_latency(port, 1) == 0)
+			port->low_latency_applied |= UART_LOW_LATENCY_ASYNC;
+		if (uart_set_latency_timer(port, device_name, LATENCY_TIMER_MS) == 0)
+			port->low_latency_applied |= UART_LOW_LATENCY_TIMER;
+	}
+
+	// driver counters are not reset on open, keep a base to report only the errors of this session
+	ioctl(port->fd, TIOCGICOUNT, &port->icount_base);
+
+	if (ring_init(&port->output_queue, OUTPUT_QUEUE_SIZE) < 0) {
+		uart_close(port);
+		return NULL;
+	}
+
+	return port;
+}
+
+/**
+ * whether device_name is a pseudo terminal or a socket, not a serial port. Its name or path for the program on the
+ * other side is only known once open, so such a port is best kept open as long as the program runs.
+ */
+int uart_is_virtual(const char *device_name) {
+	return strcmp(device_name, UART_PTY) == 0 || strncmp(device_name, UART_UNIX_PREFIX, strlen(UART_UNIX_PREFIX)) == 0 ||
+			strncmp(device_name, UART_TCP_PREFIX, strlen(UART_TCP_PREFIX)) == 0;
+}
+
+void uart_close(uart_port *port) {
+	if (port == NULL)
+		return;
+
+	// port flags and latency timer outlive the descriptor, put back what was found at open
+	if (port->async_low_latency_restore >= 0)
+		uart_set_async_low_latency(port, port->async_low_latency_restore);
+	if (port->fd >= 0)
+		close(port->fd);
+	if (port->peer_fd >= 0)
+		close(port->peer_fd);
+	if (port->listen_fd >= 0) {
+		close(port->listen_fd);
+		if (port->socket_path[0] != 0)
+			unlink(port->socket_path);
+	}
+	if (port->latency_timer_restore >= 0)
+		uart_set_latency_timer(port, NULL, port->latency_timer_restore);
+	ring_free(&port->output_queue);
+	free(port);
+}
+
+/**
+ * the port is the master side. The slave side is kept open as well: the master would read EIO between a
+ * program closing the slave and the next one opening it.
+ */
+static int uart_open_pty(uart_port *port) {
+	port->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (port->fd < 0)
+		return -1;
+
+	if (grantpt(port->fd) < 0 || unlockpt(port->fd) < 0 || ptsname_r(port->fd, port->peer_name, sizeof(port->peer_name)) != 0)
+		return -1;
+
+	port->peer_fd = open(port->peer_name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (port->peer_fd < 0)
+		return -1;
 
 	return 0;
 }
 
-void uart_close() {
-	if (fd != 0)
+/**
+ * listen on unix:<path> or tcp:[address:]port, 127.0.0.1 when no address is given. The program playing the
+ * target device connects later, see uart_accept().
+ */
+static int uart_open_socket(uart_port *port, const char *device_name) {
+	struct sockaddr_un unix_address;
+	struct sockaddr_in tcp_address;
+	struct sockaddr *address;
+	struct stat status;
+	socklen_t address_size;
+	int reuse = 1;
+
+	if (strncmp(device_name, UART_UNIX_PREFIX, strlen(UART_UNIX_PREFIX)) == 0) {
+		const char *path = device_name + strlen(UART_UNIX_PREFIX);
+
+		memset(&unix_address, 0, sizeof(unix_address));
+		unix_address.sun_family = AF_UNIX;
+		if (path[0] == 0 || strlen(path) >= sizeof(unix_address.sun_path) || strlen(path) >= sizeof(port->socket_path)) {
+			errno = EINVAL;
+			return -1;
+		}
+		strcpy(unix_address.sun_path, path);
+		address = (struct sockaddr *) &unix_address;
+		address_size = sizeof(unix_address);
+		// a socket left by a previous run would make bind fail, anything else at the path is not ours to remove
+		if (lstat(path, &status) == 0 && S_ISSOCK(status.st_mode))
+			unlink(path);
+	} else {
+		char host[64] = "127.0.0.1";
+		const char *service = device_name + strlen(UART_TCP_PREFIX);
+		const char *colon = strrchr(service, ':');
+		char *end;
+
+		if (colon != NULL) {
+			snprintf(host, sizeof(host), "%.*s", (int) (colon - service), service);
+			service = colon + 1;
+		}
+		memset(&tcp_address, 0, sizeof(tcp_address));
+		tcp_address.sin_family = AF_INET;
+		unsigned long tcp_port = strtoul(service, &end, 10);
+		if (end == service || *end != 0 || tcp_port == 0 || tcp_port > 65535 || inet_pton(AF_INET, host, &tcp_address.sin_addr) != 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		tcp_address.sin_port = htons(tcp_port);
+		address = (struct sockaddr *) &tcp_address;
+		address_size = sizeof(tcp_address);
+		port->is_tcp = 1;
+	}
+
+	port->listen_fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (port->listen_fd < 0)
+		return -1;
+	// the port is opened again at every accessory connection, the previous one may still be in TIME_WAIT
+	if (port->is_tcp)
+		setsockopt(port->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+	if (bind(port->listen_fd, address, address_size) < 0 || listen(port->listen_fd, 1) < 0)
+		return -1;
+	if (!port->is_tcp)
+		strcpy(port->socket_path, unix_address.sun_path);
+
+	return 0;
+}
+
+/**
+ * descriptor to watch for the connection of a socket target, -1 for a tty
+ */
+int uart_get_listen_fd(uart_port *port) {
+	return port->listen_fd;
+}
+
+/**
+ * take the program waiting on a socket target, its descriptor becomes the one of uart_get_fd(). One
+ * program at a time: while one is connected the others are turned away. Returns the new descriptor or -1.
+ */
+int uart_accept(uart_port *port) {
+	int one = 1;
+
+	int fd = accept4(port->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (port->fd >= 0) {
 		close(fd);
+		errno = EBUSY;
+		return -1;
+	}
+
+	// small writes are the usual serial traffic, they must not wait for an ACK
+	if (port->is_tcp)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	port->fd = fd;
+
+	return fd;
+}
+
+/**
+ * close the connection of a socket target. Output still pending is dropped, as on a line nobody listens to
+ */
+void uart_disconnect(uart_port *port) {
+	size_t pending = ring_used(&port->output_queue);
+
+	if (port->fd >= 0)
+		close(port->fd);
+	port->fd = -1;
+
+	ring_read_commit(&port->output_queue, pending);
+	port->stats.bytes_dropped += pending;
+	if (port->metrics != NULL)
+		metrics_add(&port->metrics->uart_dropped_bytes, pending);
+}
+
+/**
+ * UART_LOW_LATENCY_* flags of the low latency settings really applied by uart_open()
+ */
+int uart_get_low_latency(uart_port *port) {
+	return port->low_latency_applied;
+}
+
+/**
+ * set or clear ASYNC_LOW_LATENCY: the driver pushes received bytes to the line discipline at once instead
+ * of deferring them to a work queue
+ */
+static int uart_set_async_low_latency(uart_port *port, int enable) {
+	struct serial_struct serial;
+
+	if (ioctl(port->fd, TIOCGSERIAL, &serial) < 0)
+		return -1;
+
+	if (port->async_low_latency_restore < 0)
+		port->async_low_latency_restore = (serial.flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+
+	if (enable)
+		serial.flags |= ASYNC_LOW_LATENCY;
+	else
+		serial.flags &= ~ASYNC_LOW_LATENCY;
+
+	return ioctl(port->fd, TIOCSSERIAL, &serial);
+}
+
+/**
+ * program the usb-serial latency timer (FTDI default is 16 ms) of device_name, when the adapter has one.
+ * With device_name NULL the path found by the previous call is reused.
+ */
+static int uart_set_latency_timer(uart_port *port, const char *device_name, int value) {
+	char real_path[PATH_MAX];
+	char buffer[16];
+	int timer_fd, cnt;
+
+	if (device_name != NULL) {
+		if (realpath(device_name, real_path) == NULL)
+			return -1;
+		const char *tty_name = strrchr(real_path, '/');
+		tty_name = tty_name != NULL ? tty_name + 1 : real_path;
+		snprintf(port->latency_timer_path, sizeof(port->latency_timer_path),
+				"/sys/bus/usb-serial/devices/%.64s/latency_timer", tty_name);
+	}
+
+	timer_fd = open(port->latency_timer_path, O_RDWR | O_CLOEXEC);
+	if (timer_fd < 0)
+		return -1;
+
+	if (port->latency_timer_restore < 0) {
+		cnt = read(timer_fd, buffer, sizeof(buffer) - 1);
+		if (cnt > 0) {
+			buffer[cnt] = 0;
+			port->latency_timer_restore = atoi(buffer);
+		}
+	}
+
+	cnt = snprintf(buffer, sizeof(buffer), "%d", value);
+	if (write(timer_fd, buffer, cnt) != cnt) {
+		close(timer_fd);
+		return -1;
+	}
+	close(timer_fd);
+
+	return 0;
+}
+
+int uart_get_fd(uart_port *port) {
+	return port->fd;
+}
+
+/**
+ * device to open on the other side of a UART_PTY port, NULL for a real one
+ */
+const char *uart_get_peer_name(uart_port *port) {
+	return port->peer_fd >= 0 ? port->peer_name : NULL;
+}
+
+unsigned int uart_get_baud_rate(uart_port *port) {
+	return port->actual_baud_rate;
+}
+
+static speed_t uart_lookup_speed(unsigned int baud_rate) {
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(baud_table); i++) {
+		if (baud_table[i].baud_rate == baud_rate)
+			return baud_table[i].speed;
+	}
+
+	return B0;
+}
+
+/**
+ * write buffer without ever blocking: what the port does not accept now is appended to the pending output
+ * queue, drained by uart_flush_pending() when the descriptor becomes writable. Bytes not fitting the queue
+ * are dropped and accounted. Returns the number of bytes written or queued, -1 on error.
+ */
+int uart_send_buffer(uart_port *port, void *buffer, size_t size) {
+	size_t written = 0;
+
+	// keep ordering: write directly only when nothing is pending
+	if (ring_used(&port->output_queue) == 0) {
+		ssize_t cnt = uart_write(port, buffer, size);
+		if (cnt < 0)
+			return -1;
+		written = cnt;
+	}
+
+	if (written < size) {
+		size_t space = ring_space(&port->output_queue);
+		size_t to_queue = size - written;
+
+		if (to_queue > space) {
+			port->stats.bytes_dropped += to_queue - space;
+			if (port->metrics != NULL)
+				metrics_add(&port->metrics->uart_dropped_bytes, to_queue - space);
+			to_queue = space;
+		}
+		ring_write(&port->output_queue, (unsigned char *) buffer + written, to_queue);
+		port->stats.bytes_queued += to_queue;
+		written += to_queue;
+	}
+
+	return written;
+}
+
+/**
+ * single not blocking write accounted in statistics. Returns bytes written (0 if the port is full) or -1
+ */
+ssize_t uart_write(uart_port *port, const void *buffer, size_t size) {
+	ssize_t cnt;
+
+	// a socket target without its program drops data like a line with nothing attached
+	if (port->listen_fd >= 0 && port->fd < 0) {
+		port->stats.bytes_dropped += size;
+		if (port->metrics != NULL)
+			metrics_add(&port->metrics->uart_dropped_bytes, size);
+		return size;
+	}
+
+	// a program closing its socket must not kill us with SIGPIPE
+	if (port->listen_fd >= 0)
+		cnt = send(port->fd, buffer, size, MSG_NOSIGNAL);
+	else
+		cnt = write(port->fd, buffer, size);
+
+	if (cnt < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			cnt = 0;
+		else
+			return -1;
+	}
+
+	port->stats.bytes_written += cnt;
+	if (cnt < size) {
+		port->stats.short_writes++;
+		if (port->metrics != NULL)
+			metrics_add(&port->metrics->uart_short_writes, 1);
+	}
+
+	return cnt;
+}
+
+/**
+ * write as much of the pending output queue as the port accepts. Returns the number of bytes still pending or -1
+ */
+int uart_flush_pending(uart_port *port) {
+	size_t size;
+
+	while (1) {
+		unsigned char *data = ring_read_region(&port->output_queue, 0, &size);
+		if (size == 0)
+			break;
+
+		ssize_t cnt = uart_write(port, data, size);
+		if (cnt < 0)
+			return -1;
+		ring_read_commit(&port->output_queue, cnt);
+		if (cnt < size)
+			break;
+	}
+
+	return ring_used(&port->output_queue);
+}
+
+size_t uart_get_pending(uart_port *port) {
+	return ring_used(&port->output_queue);
+}
+
+size_t uart_get_pending_space(uart_port *port) {
+	return ring_space(&port->output_queue);
+}
+
+void uart_get_stats(uart_port *port, uart_stats *stats) {
+	*stats = port->stats;
+}
+
+/**
+ * also count short writes and dropped bytes in a metrics slot, by the thread writing the port
+ */
+void uart_set_metrics(uart_port *port, struct metrics_slot *metrics) {
+	port->metrics = metrics;
+}
+
+/**
+ * line error counters kept by the driver (TIOCGICOUNT) since the port was opened. Returns -1 when the
+ * driver does not provide them
+ */
+int uart_get_error_counters(uart_port *port, uart_error_counters *counters) {
+	struct serial_icounter_struct icount;
+
+	memset(&icount, 0, sizeof(icount));
+	if (ioctl(port->fd, TIOCGICOUNT, &icount) < 0)
+		return -1;
+
+	counters->overrun = icount.overrun - port->icount_base.overrun;
+	counters->buffer_overrun = icount.buf_overrun - port->icount_base.buf_overrun;
+	counters->framing = icount.frame - port->icount_base.frame;
+	counters->parity = icount.parity - port->icount_base.parity;
+	counters->breaks = icount.brk - port->icount_base.brk;
+
+	return 0;
 }
 
-void uart_send_buffer(void *buffer, size_t size) {
-	write(fd, buffer, size);
+void uart_receive_buffer(uart_port *port, void* buffer, size_t size) {
+	read(port->fd, buffer, size);
 }
 
-void uart_receive_buffer(void* buffer, size_t size) {
-	read(fd, buffer, size);
+/**
+ * wait up to timeout ms for data and keep reading while the next byte arrives within timeout ms, until size
+ * bytes are read. Returns the number of bytes read, 0 on timeout or -1 on error.
+ */
+int uart_receive_buffer_timout(uart_port *port, void* buffer, size_t size, int timeout) {
+	return uart_receive_frame(port, buffer, size, timeout, (unsigned int) timeout * 1000);
 }
 
-int uart_receive_buffer_timout(void* buffer, size_t size, int timeout) {
-	struct timeval to = { (timeout * 2) / 1000, ((timeout * 2) % 1000) * 1000 };
-	int ret, bytes_read = 0;
-	fd_set read_fds;
+/**
+ * single not blocking read of everything available, up to size bytes. Returns the number of bytes read,
+ * 0 if nothing is available or -1 on error (errno set), so data and errors are never confused.
+ */
+ssize_t uart_receive(uart_port *port, void *buffer, size_t size) {
+	if (port->fd < 0)
+		return 0;
+
+	ssize_t cnt = read(port->fd, buffer, size);
+
+	// a hang-up is reported by poll/epoll, here 0 always means no data
+	if (cnt < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	// ...but a TCP peer closing its side is seen only as end of file
+	if (cnt == 0 && port->listen_fd >= 0 && size > 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
 
-	FD_ZERO(&read_fds);
-	FD_SET(fd, &read_fds);
+	return cnt;
+}
 
-	while (bytes_read < size && select(fd + 1, &read_fds, NULL, NULL, &to) == 1) {
-		ret = read(fd, buffer + bytes_read, size - bytes_read);
-		if (ret < 0 && errno != EAGAIN) {
-			perror("serial, read:");
-			return 1;
+/**
+ * read a frame: wait up to timeout_ms (-1 forever) for the first byte, then collect data until the line stays
+ * idle for idle_gap_us or size bytes are read. Every wait is a fresh poll() on the descriptor and every read
+ * takes all the available data. Returns the frame length, 0 on timeout, -1 on error or hang-up. Data read
+ * before a hang-up or error is returned first, the next call reports it.
+ */
+int uart_receive_frame(uart_port *port, void *buffer, size_t size, int timeout_ms, unsigned int idle_gap_us) {
+	struct pollfd pfd;
+	size_t bytes_read = 0;
+	int wait_ms = timeout_ms;
+
+	pfd.fd = port->fd;
+	pfd.events = POLLIN;
+
+	while (bytes_read < size) {
+		pfd.revents = 0;
+		int r = poll(&pfd, 1, wait_ms);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
-		bytes_read += MAX(ret, 0);
+		if (r == 0)
+			break;
+		int hangup = pfd.revents & (POLLERR | POLLHUP | POLLNVAL);
+		if (hangup && !(pfd.revents & POLLIN))
+			return bytes_read > 0 ? (int) bytes_read : -1;
+
+		ssize_t cnt = uart_receive(port, (unsigned char *) buffer + bytes_read, size - bytes_read);
+		if (cnt < 0)
+			return bytes_read > 0 ? (int) bytes_read : -1;
+		bytes_read += cnt;
+		// what was left before the hang-up is all there is
+		if (hangup)
+			return bytes_read > 0 ? (int) bytes_read : -1;
+
+		// from now on the timeout is the inter-byte idle gap, rounded up to poll() resolution
+		wait_ms = (idle_gap_us + 999) / 1000;
 	}
+
 	return bytes_read;
 }
 
+/**
+ * inter-frame gap for baud_rate as in Modbus RTU: 3.5 character times of 11 bits, fixed to 1750 us above
+ * 19200 baud
+ */
+unsigned int uart_frame_gap_us(unsigned int baud_rate) {
+	if (baud_rate == 0 || baud_rate > 19200)
+		return 1750;
+
+	return (unsigned int) (3.5 * 11 * 1000000.0 / baud_rate);
+}
+
+/**
+ * O_NONBLOCK is what makes reads and writes return at once; VMIN=1 with VTIME=0 makes the descriptor
+ * readable as soon as a single byte arrives, so readiness events carry no added timer latency
+ */
 void uart_set_blocking(int fd, int should_block) {
 	struct termios tty;
 
@@ -92,14 +742,18 @@ void uart_set_blocking(int fd, int should_block) {
 		return;
 	}
 
-	tty.c_cc[VMIN] = should_block ? 1 : 0;
-	tty.c_cc[VTIME] = 5;            // 0.5 seconds read timeout
+	tty.c_cc[VMIN] = 1;
+	tty.c_cc[VTIME] = 0;
 
 	if (tcsetattr(fd, TCSANOW, &tty) != 0)
 		return;
+
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags >= 0)
+		fcntl(fd, F_SETFL, should_block ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
 }
 
-int uart_set_interface_attribs(int fd, int speed, int parity) {
+int uart_set_interface_attribs(int fd, speed_t speed, const uart_config *config) {
 	struct termios tty;
 
 	memset(&tty, 0, sizeof tty);
@@ -111,8 +765,22 @@ int uart_set_interface_attribs(int fd, int speed, int parity) {
 	cfsetospeed(&tty, speed);
 	cfsetispeed(&tty, speed);
 
-	// 8-bit chars
-	tty.c_cflag = (tty.c_cflag & ~CSIZE) | CS8;
+	// character size
+	tty.c_cflag &= ~CSIZE;
+	switch (config->data_bits) {
+	case 5:
+		tty.c_cflag |= CS5;
+		break;
+	case 6:
+		tty.c_cflag |= CS6;
+		break;
+	case 7:
+		tty.c_cflag |= CS7;
+		break;
+	default:
+		tty.c_cflag |= CS8;
+		break;
+	}
 
 	// input flags, turn off input processing:
 	//   convert break to null byte
@@ -147,8 +815,8 @@ int uart_set_interface_attribs(int fd, int speed, int parity) {
 	//  tty.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
 	tty.c_lflag = 0;
 
-	tty.c_cc[VMIN] = 0;            	// read doesn't block
-	tty.c_cc[VTIME] = 5;            // 0.5 seconds read timeout
+	tty.c_cc[VMIN] = 1;            	// readable as soon as a byte arrives
+	tty.c_cc[VTIME] = 0;            // no inter-byte timer, reads never block on O_NONBLOCK
 
 	// shut off xon/xoff ctrl
 	tty.c_iflag &= ~(IXON | IXOFF | IXANY);
@@ -156,11 +824,34 @@ int uart_set_interface_attribs(int fd, int speed, int parity) {
 	// ignore modem controls, enable reading
 	tty.c_cflag |= (CLOCAL | CREAD);
 
-	// shut off parity
-	tty.c_cflag &= ~(PARENB | PARODD);
-	tty.c_cflag |= parity;
-	tty.c_cflag &= ~CSTOPB;
-	tty.c_cflag &= ~CRTSCTS;
+	// parity: mark and space are a stick parity bit (CMSPAR) with PARODD selecting mark
+	tty.c_cflag &= ~(PARENB | PARODD | CMSPAR);
+	switch (config->parity) {
+	case 'E':
+		tty.c_cflag |= PARENB;
+		break;
+	case 'O':
+		tty.c_cflag |= PARENB | PARODD;
+		break;
+	case 'M':
+		tty.c_cflag |= PARENB | PARODD | CMSPAR;
+		break;
+	case 'S':
+		tty.c_cflag |= PARENB | CMSPAR;
+		break;
+	}
+
+	// stop bits
+	if (config->stop_bits == 2)
+		tty.c_cflag |= CSTOPB;
+	else
+		tty.c_cflag &= ~CSTOPB;
+
+	// RTS/CTS hardware flow control
+	if (config->rtscts)
+		tty.c_cflag |= CRTSCTS;
+	else
+		tty.c_cflag &= ~CRTSCTS;
 
 	if (tcsetattr(fd, TCSANOW, &tty) != 0) {
 		return -1;
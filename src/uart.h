@@ -24,11 +24,72 @@
 #ifndef UART_H_
 #define UART_H_
 
-int uart_open(const char *device_name, int speed, int parity);
-void uart_close();
-void uart_send_byte(unsigned char b);
-void uart_send_buffer(void *buffer, size_t size);
-void uart_receive_buffer(void* buffer, size_t size);
-int uart_receive_buffer_timout(void* buffer, size_t size, int timeout);
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+	unsigned int baud_rate;
+	int data_bits;					// 5 to 8
+	char parity;					// 'N'one, 'E'ven, 'O'dd, 'M'ark or 'S'pace
+	int stop_bits;					// 1 or 2
+	int rtscts;					// RTS/CTS hardware flow control
+	int low_latency;				// ASYNC_LOW_LATENCY and 1 ms usb-serial latency timer
+} uart_config;
+
+#define UART_PTY						"pty"		// device name creating a pseudo terminal pair
+#define UART_UNIX_PREFIX				"unix:"		// unix:<path> listens on a local socket
+#define UART_TCP_PREFIX				"tcp:"		// tcp:[address:]port listens on TCP, 127.0.0.1 by default
+#define UART_PEER_NAME_SIZE			64
+
+#define UART_LOW_LATENCY_ASYNC			1
+#define UART_LOW_LATENCY_TIMER			2
+
+typedef struct {
+	unsigned long overrun;
+	unsigned long buffer_overrun;
+	unsigned long framing;
+	unsigned long parity;
+	unsigned long breaks;
+} uart_error_counters;
+
+typedef struct {
+	unsigned long long bytes_queued;
+	unsigned long long bytes_written;
+	unsigned long long bytes_dropped;
+	unsigned long short_writes;
+} uart_stats;
+
+/**
+ * an open serial port, owned by the caller between uart_open() and uart_close()
+ */
+typedef struct uart_port uart_port;
+
+struct metrics_slot;
+
+uart_port *uart_open(const char *device_name, const uart_config *config);
+int uart_is_virtual(const char *device_name);
+void uart_config_init(uart_config *config, unsigned int baud_rate);
+int uart_parse_framing(const char *framing, uart_config *config);
+void uart_close(uart_port *port);
+int uart_send_buffer(uart_port *port, void *buffer, size_t size);
+ssize_t uart_write(uart_port *port, const void *buffer, size_t size);
+int uart_flush_pending(uart_port *port);
+size_t uart_get_pending(uart_port *port);
+size_t uart_get_pending_space(uart_port *port);
+void uart_get_stats(uart_port *port, uart_stats *stats);
+void uart_set_metrics(uart_port *port, struct metrics_slot *metrics);
+int uart_get_error_counters(uart_port *port, uart_error_counters *counters);
+void uart_receive_buffer(uart_port *port, void* buffer, size_t size);
+int uart_receive_buffer_timout(uart_port *port, void* buffer, size_t size, int timeout);
+ssize_t uart_receive(uart_port *port, void *buffer, size_t size);
+int uart_receive_frame(uart_port *port, void *buffer, size_t size, int timeout_ms, unsigned int idle_gap_us);
+unsigned int uart_frame_gap_us(unsigned int baud_rate);
+int uart_get_fd(uart_port *port);
+const char *uart_get_peer_name(uart_port *port);
+int uart_get_listen_fd(uart_port *port);
+int uart_accept(uart_port *port);
+void uart_disconnect(uart_port *port);
+unsigned int uart_get_baud_rate(uart_port *port);
+int uart_get_low_latency(uart_port *port);
 
 #endif /* UART_H_ */
@@ -0,0 +1,69 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * termios2 based speed handling. It lives in its own translation unit because <asm/termbits.h>, which defines
+ * struct termios2 and BOTHER, conflicts with the glibc <termios.h> used everywhere else.
+ */
+
+#include "uart_baud.h"
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+/**
+ * set any baud rate, also not standard ones, through BOTHER. Returns 0 or -1 when the driver refuses it
+ */
+int uart_set_custom_baud_rate(int fd, unsigned int baud_rate) {
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -1;
+
+	tio.c_cflag &= ~CBAUD;
+	tio.c_cflag |= BOTHER;
+	tio.c_ospeed = baud_rate;
+	tio.c_cflag &= ~(CBAUD << IBSHIFT);
+	tio.c_cflag |= BOTHER << IBSHIFT;
+	tio.c_ispeed = baud_rate;
+
+	if (ioctl(fd, TCSETS2, &tio) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * read back the output baud rate really programmed by the driver, which can differ from the requested one
+ * because of the clock divisor granularity
+ */
+int uart_get_actual_baud_rate(int fd, unsigned int *baud_rate) {
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -1;
+
+	*baud_rate = tio.c_ospeed;
+
+	return 0;
+}
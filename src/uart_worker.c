@@ -0,0 +1,214 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "uart_worker.h"
+#include "uart.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static void *uart_worker_writer(void *arg);
+static void *uart_worker_reader(void *arg);
+static int uart_worker_wait(int fd, short events, int stop_fd);
+
+int uart_worker_start(uart_worker *worker, uart_port *port, size_t ring_size) {
+	memset(worker, 0, sizeof(uart_worker));
+	worker->port = port;
+	worker->fd = uart_get_fd(port);
+	worker->to_uart_data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	worker->to_uart_space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	worker->from_uart_data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	worker->from_uart_space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	worker->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (worker->to_uart_data_fd < 0 || worker->to_uart_space_fd < 0 || worker->from_uart_data_fd < 0
+			|| worker->from_uart_space_fd < 0 || worker->stop_fd < 0
+			|| ring_init(&worker->to_uart, ring_size) < 0 || ring_init(&worker->from_uart, ring_size) < 0) {
+		uart_worker_stop(worker);
+		return -1;
+	}
+
+	if (pthread_create(&worker->writer_thread, NULL, uart_worker_writer, worker) != 0) {
+		uart_worker_stop(worker);
+		return -1;
+	}
+	if (pthread_create(&worker->reader_thread, NULL, uart_worker_reader, worker) != 0) {
+		uart_worker_signal(worker->stop_fd);
+		pthread_join(worker->writer_thread, NULL);
+		uart_worker_stop(worker);
+		return -1;
+	}
+	worker->started = 1;
+
+	return 0;
+}
+
+/**
+ * stop and join both threads (when started) then release rings and eventfds, the rings only if not kept
+ */
+void uart_worker_stop(uart_worker *worker) {
+	if (worker->started) {
+		uart_worker_signal(worker->stop_fd);
+		pthread_join(worker->writer_thread, NULL);
+		pthread_join(worker->reader_thread, NULL);
+		worker->started = 0;
+	}
+	worker->port = NULL;
+	worker->fd = -1;
+
+	if (worker->to_uart_data_fd >= 0)
+		close(worker->to_uart_data_fd);
+	if (worker->to_uart_space_fd >= 0)
+		close(worker->to_uart_space_fd);
+	if (worker->from_uart_data_fd >= 0)
+		close(worker->from_uart_data_fd);
+	if (worker->from_uart_space_fd >= 0)
+		close(worker->from_uart_space_fd);
+	if (worker->stop_fd >= 0)
+		close(worker->stop_fd);
+	worker->to_uart_data_fd = worker->to_uart_space_fd = -1;
+	worker->from_uart_data_fd = worker->from_uart_space_fd = -1;
+	worker->stop_fd = -1;
+
+	if (!worker->keep_rings) {
+		ring_free(&worker->to_uart);
+		ring_free(&worker->from_uart);
+	}
+}
+
+void uart_worker_signal(int event_fd) {
+	eventfd_write(event_fd, 1);
+}
+
+void uart_worker_drain(int event_fd) {
+	eventfd_t value;
+
+	eventfd_read(event_fd, &value);
+}
+
+/**
+ * wait for events on fd or for the stop request. Returns 1 when fd is ready, 0 when stopping, -1 on error
+ */
+static int uart_worker_wait(int fd, short events, int stop_fd) {
+	struct pollfd fds[2];
+
+	fds[0].fd = fd;
+	fds[0].events = events;
+	fds[1].fd = stop_fd;
+	fds[1].events = POLLIN;
+
+	while (1) {
+		fds[0].revents = fds[1].revents = 0;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fds[1].revents)
+			return 0;
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			return -1;
+		return 1;
+	}
+}
+
+static void *uart_worker_writer(void *arg) {
+	uart_worker *worker = arg;
+	size_t size;
+
+	while (1) {
+		unsigned char *data = ring_read_region(&worker->to_uart, 0, &size);
+		if (size == 0) {
+			int r = uart_worker_wait(worker->to_uart_data_fd, POLLIN, worker->stop_fd);
+			if (r <= 0)
+				break;
+			uart_worker_drain(worker->to_uart_data_fd);
+			continue;
+		}
+
+		ssize_t cnt = uart_write(worker->port, data, size);
+		if (cnt > 0) {
+			ring_read_commit(&worker->to_uart, cnt);
+			uart_worker_signal(worker->to_uart_space_fd);
+		} else if (cnt == 0) {
+			// port output buffer full
+			int r = uart_worker_wait(worker->fd, POLLOUT, worker->stop_fd);
+			if (r <= 0) {
+				if (r < 0)
+					worker->error = EIO;
+				break;
+			}
+		} else {
+			worker->error = errno;
+			break;
+		}
+	}
+
+	if (worker->error)
+		uart_worker_signal(worker->to_uart_space_fd);
+
+	return NULL;
+}
+
+static void *uart_worker_reader(void *arg) {
+	uart_worker *worker = arg;
+	size_t size;
+
+	while (1) {
+		unsigned char *data = ring_write_region(&worker->from_uart, &size);
+		if (size == 0) {
+			// ring full: wait for the USB side to release space, the tty buffers meanwhile
+			int r = uart_worker_wait(worker->from_uart_space_fd, POLLIN, worker->stop_fd);
+			if (r <= 0)
+				break;
+			uart_worker_drain(worker->from_uart_space_fd);
+			continue;
+		}
+
+		int r = uart_worker_wait(worker->fd, POLLIN, worker->stop_fd);
+		if (r <= 0) {
+			if (r < 0)
+				worker->error = EIO;
+			break;
+		}
+
+		ssize_t cnt = read(worker->fd, data, size);
+		if (cnt > 0) {
+			ring_write_commit(&worker->from_uart, cnt);
+			uart_worker_signal(worker->from_uart_data_fd);
+		} else if (cnt < 0 && errno != EAGAIN && errno != EINTR) {
+			worker->error = errno;
+			break;
+		}
+	}
+
+	if (worker->error)
+		uart_worker_signal(worker->from_uart_data_fd);
+
+	return NULL;
+}
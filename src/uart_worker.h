@@ -0,0 +1,58 @@
+/*
+ * The MIT License (MIT)
+ * Copyright (c) 2013 Silverio Diquigiovanni
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef UART_WORKER_H_
+#define UART_WORKER_H_
+
+#include <pthread.h>
+
+#include "ring.h"
+#include "uart.h"
+
+/**
+ * uart side of the threaded bridge: a writer thread drains to_uart and a reader thread fills from_uart.
+ * Each ring has a data eventfd, signaled by its producer, and a space eventfd, signaled by its consumer.
+ */
+typedef struct {
+	uart_port *port;
+	int fd;
+	ring_buffer to_uart;
+	ring_buffer from_uart;
+	int to_uart_data_fd;
+	int to_uart_space_fd;
+	int from_uart_data_fd;
+	int from_uart_space_fd;
+	int stop_fd;
+	pthread_t writer_thread;
+	pthread_t reader_thread;
+	int started;
+	int keep_rings;					// set before uart_worker_stop() while USB transfers still use ring regions
+	volatile int error;
+} uart_worker;
+
+int uart_worker_start(uart_worker *worker, uart_port *port, size_t ring_size);
+void uart_worker_stop(uart_worker *worker);
+void uart_worker_signal(int event_fd);
+void uart_worker_drain(int event_fd);
+
+#endif /* UART_WORKER_H_ */
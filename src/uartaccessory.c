@@ -21,23 +21,110 @@
  * SOFTWARE.
  */
 
+#include <errno.h>
 #include <getopt.h>
 #include <libusb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <termios.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "accessory.h"
+#include "accessory_loopback.h"
+#include "bench.h"
+#include "bridge.h"
+#include "capture.h"
+#include "evloop.h"
+#include "framer.h"
+#include "hid_stream.h"
+#include "metrics.h"
+#include "mux.h"
+#include "pairing.h"
+#include "probe_cache.h"
+#include "replay.h"
 #include "sysutils.h"
+#include "trace.h"
 #include "uart.h"
 
 #define ACCESSORY_MODE_BUFFER_SIZE 16384
+#define USB_QUEUE_DEPTH_DEFAULT	4
+#define USB_QUEUE_DEPTH_MAX		64
+#define RING_SIZE_DEFAULT			262144
+#define SCAN_INTERVAL_US			500000
+#define HID_ID						1
+#define HID_DESCRIPTOR_MAX			4096
+#define HID_RATE_DEFAULT			100
+#define METRICS_INTERVAL_DEFAULT	10
 
-#define ARRAY_LEN(x)    ( sizeof( x ) / sizeof( x[ 0 ]))
+// long only options
+#define OPTION_USB_QUEUE_DEPTH	256
+#define OPTION_THREADED			257
+#define OPTION_RING_SIZE			258
+#define OPTION_IDLE_GAP			259
+#define OPTION_RTSCTS				260
+#define OPTION_LOW_LATENCY			261
+#define OPTION_MAP					262
+#define OPTION_PROBE_CACHE			263
+#define OPTION_DEVICE				264
+#define OPTION_IDENTITY			265
+#define OPTION_AUDIO				266
+#define OPTION_HID_DESCRIPTOR		267
+#define OPTION_HID_EVENTS			268
+#define OPTION_HID_REPORT_SIZE		269
+#define OPTION_HID_RATE			270
+#define OPTION_CAPTURE				271
+#define OPTION_CAPTURE_SIZE		272
+#define OPTION_REPLAY				273
+#define OPTION_REPLAY_SPEED		274
+#define OPTION_REPLAY_TO			275
+#define OPTION_BENCH				276
+#define OPTION_BENCH_SIZE			277
+#define OPTION_BENCH_RATE			278
+#define OPTION_BENCH_COUNT			279
+#define OPTION_BENCH_DIRECTION		280
+#define OPTION_METRICS				281
+#define OPTION_METRICS_SOCKET		282
+#define OPTION_METRICS_INTERVAL	283
+#define OPTION_FRAME				284
+#define OPTION_COALESCE_DELAY		285
+#define OPTION_COALESCE_SIZE		286
+#define OPTION_COALESCE_ADAPTIVE	287
+#define OPTION_FLUSH_ON			288
+#define OPTION_CHANNEL			289
 
-static void print_buffer(unsigned char *buffer, int size, int type);
+static void bridge_traffic(const char *name, const unsigned char *buffer, int size, int type);
+static void console_ready(int fd, uint32_t events, void *user_data);
+static void console_restore();
+static void scan_timer_expired(int fd, uint32_t events, void *user_data);
+static void device_arrived(void *user_data);
+static int pairing_accept(const accessory_device *candidate, void *user_data);
+static int pairing_selects(const accessory_device *candidate, void *user_data);
+static void pairings_scan(int full);
+static void pairings_reap();
+static int pairing_start(pairing *p, accessory_device *ad);
+static int pairing_finish(pairing *p);
+static int pairing_open_port(pairing *p);
+static int channel_open_port(pairing *p, mux_channel_config *config);
+static void pairing_close_ports(pairing *p, int all);
+static int load_file(const char *file_name, unsigned char *buffer, int size);
+static int replay_accept(const accessory_device *candidate, void *user_data);
+static int replay_run(const uart_config *uart_cfg);
+static void replay_done(int fd, uint32_t events, void *user_data);
+static int bench_main(const uart_config *uart_cfg);
+static void bench_print_flow(const char *name, const bench_flow_result *flow);
+
+static int need_quit = 0;
+static int need_scan = 1;
+static int deferred_scan = 0;		// a candidate was put off while a phone was switching for its pairing
+static int need_arrival_scan = 0;
+static int hotplug = 0;
+static int exit_code = EXIT_SUCCESS;
+
+static pairing *pairings = NULL;
+static int pairing_count = 0;
+static int scan_timer_fd = -1;
+static bridge_options bridge_opts;
 
 static int option_quiet = 0;
 static int option_colors = 0;
@@ -45,51 +132,97 @@ static int option_no_reply = 0;
 static int option_closed_loop = 0;
 static const char *option_baud = "115200";
 static const char *option_port = "/dev/ttyUSB0";
-
-typedef struct
-{
-	speed_t speed;
-	unsigned baud_rate;
-} baud_info;
-
-baud_info baud_table[] = {
-		{ B50, 50 },
-		{ B75, 75 },
-		{ B110, 110 },
-		{ B134, 134 },
-		{ B150, 150 },
-		{ B200, 200 },
-		{ B300, 300 },
-		{ B600, 600 },
-		{ B1200, 1200 },
-		{ B1800, 1800 },
-		{ B2400, 2400 },
-		{ B4800, 4800 },
-		{ B9600, 9600 },
-		{ B19200, 19200 },
-		{ B38400, 38400 },
-		{ B57600, 57600 },
-		{ B115200, 115200 },
-		{ B230400, 230400 }
-};
+static int option_usb_queue_depth = USB_QUEUE_DEPTH_DEFAULT;
+static int option_threaded = 0;
+static int option_ring_size = RING_SIZE_DEFAULT;
+static const char *option_idle_gap = NULL;
+static const char *option_framing = "8N1";
+static int option_rtscts = 0;
+static int option_low_latency = 0;
+static const char *option_map = NULL;
+static const char *option_probe_cache = NULL;
+static const char *option_device = "any";
+static const char *option_hid_events = NULL;
+static int option_hid_report_size = 0;
+static int option_hid_rate = HID_RATE_DEFAULT;
+static unsigned char hid_descriptor[HID_DESCRIPTOR_MAX];
+static int hid_descriptor_size = 0;
+static const char *option_capture = NULL;
+static int option_capture_size = 0;
+static const char *option_replay = NULL;
+static const char *option_replay_speed = "1";
+static const char *option_replay_to = "uart";
+static int option_bench = 0;
+static const char *option_bench_size = "1,64,1024,16384";
+static unsigned int option_bench_rate = 0;
+static unsigned long option_bench_count = 10000;
+static const char *option_bench_direction = "both";
+static const char *option_metrics = NULL;
+static const char *option_metrics_socket = NULL;
+static int option_metrics_interval = METRICS_INTERVAL_DEFAULT;
+static framer_config option_frame;
+static unsigned int option_coalesce_delay = 0;
+static int option_coalesce_size = 0;
+static int option_coalesce_adaptive = 0;
+static unsigned char option_flush_bytes[FRAMER_DELIMITER_MAX];
+static int option_flush_byte_count = 0;
+static const char *option_channels[MUX_CHANNELS_MAX];
+static int option_channel_count = 0;
+static mux_channel_config channel_configs[MUX_CHANNELS_MAX];
 
 int main(int argc, char *argv[]) {
 
 	static struct option long_options[] = {
 			{ "uart-port", required_argument, 0, 'p' },
 			{ "baud-rate", required_argument, 0, 'b' },
+			{ "framing", required_argument, 0, 'f' },
+			{ "rtscts", no_argument, 0, OPTION_RTSCTS },
+			{ "low-latency", no_argument, 0, OPTION_LOW_LATENCY },
 			{ "closed-loop", no_argument, 0, 'c' },
 			{ "no-reply", no_argument, 0, 'n' },
 			{ "colors", no_argument, 0, 'j' },
 			{ "quiet", no_argument, 0, 'q' },
+			{ "usb-queue-depth", required_argument, 0, OPTION_USB_QUEUE_DEPTH },
+			{ "threaded", no_argument, 0, OPTION_THREADED },
+			{ "ring-size", required_argument, 0, OPTION_RING_SIZE },
+			{ "idle-gap", required_argument, 0, OPTION_IDLE_GAP },
+			{ "map", required_argument, 0, OPTION_MAP },
+			{ "probe-cache", required_argument, 0, OPTION_PROBE_CACHE },
+			{ "device", required_argument, 0, OPTION_DEVICE },
+			{ "identity", required_argument, 0, OPTION_IDENTITY },
+			{ "audio", no_argument, 0, OPTION_AUDIO },
+			{ "hid-descriptor", required_argument, 0, OPTION_HID_DESCRIPTOR },
+			{ "hid-events", required_argument, 0, OPTION_HID_EVENTS },
+			{ "hid-report-size", required_argument, 0, OPTION_HID_REPORT_SIZE },
+			{ "hid-rate", required_argument, 0, OPTION_HID_RATE },
+			{ "capture", required_argument, 0, OPTION_CAPTURE },
+			{ "capture-size", required_argument, 0, OPTION_CAPTURE_SIZE },
+			{ "replay", required_argument, 0, OPTION_REPLAY },
+			{ "replay-speed", required_argument, 0, OPTION_REPLAY_SPEED },
+			{ "replay-to", required_argument, 0, OPTION_REPLAY_TO },
+			{ "bench", no_argument, 0, OPTION_BENCH },
+			{ "bench-size", required_argument, 0, OPTION_BENCH_SIZE },
+			{ "bench-rate", required_argument, 0, OPTION_BENCH_RATE },
+			{ "bench-count", required_argument, 0, OPTION_BENCH_COUNT },
+			{ "bench-direction", required_argument, 0, OPTION_BENCH_DIRECTION },
+			{ "metrics", required_argument, 0, OPTION_METRICS },
+			{ "metrics-socket", required_argument, 0, OPTION_METRICS_SOCKET },
+			{ "metrics-interval", required_argument, 0, OPTION_METRICS_INTERVAL },
+			{ "frame", required_argument, 0, OPTION_FRAME },
+			{ "coalesce-delay", required_argument, 0, OPTION_COALESCE_DELAY },
+			{ "coalesce-size", required_argument, 0, OPTION_COALESCE_SIZE },
+			{ "coalesce-adaptive", no_argument, 0, OPTION_COALESCE_ADAPTIVE },
+			{ "flush-on", required_argument, 0, OPTION_FLUSH_ON },
+			{ "channel", required_argument, 0, OPTION_CHANNEL },
 			{ "help", no_argument, 0, 'h' },
 			{ 0, 0, 0, 0 }
 	};
 
 	int option;
 	int option_index = 0;
+	int i;
 
-	while ((option = getopt_long(argc, argv, "p:b:cnjqh", long_options, &option_index)) != -1) {
+	while ((option = getopt_long(argc, argv, "p:b:f:cnjqh", long_options, &option_index)) != -1) {
 		switch (option) {
 		case 0:
 			break;
@@ -103,6 +236,17 @@ int main(int argc, char *argv[]) {
 				option_baud = optarg;
 			}
 			break;
+		case 'f':
+			if (optarg) {
+				option_framing = optarg;
+			}
+			break;
+		case OPTION_RTSCTS:
+			option_rtscts = 1;
+			break;
+		case OPTION_LOW_LATENCY:
+			option_low_latency = 1;
+			break;
 		case 'c':
 			option_closed_loop = 1;
 			break;
@@ -115,150 +259,970 @@ int main(int argc, char *argv[]) {
 		case 'q':
 			option_quiet = 1;
 			break;
+		case OPTION_USB_QUEUE_DEPTH:
+			option_usb_queue_depth = atoi(optarg);
+			if (option_usb_queue_depth < 1 || option_usb_queue_depth > USB_QUEUE_DEPTH_MAX) {
+				fprintf(stderr, "Invalid USB queue depth: '%s' (1..%d)\n", optarg, USB_QUEUE_DEPTH_MAX);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_THREADED:
+			option_threaded = 1;
+			break;
+		case OPTION_RING_SIZE:
+			option_ring_size = atoi(optarg);
+			if (option_ring_size < 2 * ACCESSORY_MODE_BUFFER_SIZE) {
+				fprintf(stderr, "Invalid ring size: '%s' (minimum %d)\n", optarg, 2 * ACCESSORY_MODE_BUFFER_SIZE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_IDLE_GAP:
+			option_idle_gap = optarg;
+			break;
+		case OPTION_MAP:
+			option_map = optarg;
+			break;
+		case OPTION_PROBE_CACHE:
+			option_probe_cache = optarg;
+			break;
+		case OPTION_DEVICE:
+			option_device = optarg;
+			break;
+		case OPTION_IDENTITY:
+			if (strchr(optarg, '=') != NULL && access(optarg, F_OK) != 0) {
+				char key[32];
+				const char *value = strchr(optarg, '=') + 1;
+				snprintf(key, sizeof(key), "%.*s", (int) (value - 1 - optarg), optarg);
+				if (accessory_set_identity(key, value) < 0) {
+					fprintf(stderr, "Invalid identity string: '%s'\n", optarg);
+					return EXIT_FAILURE;
+				}
+			} else if ((errno = 0, accessory_load_identity(optarg)) < 0) {
+				if (errno != 0)
+					perror(optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_AUDIO:
+			accessory_set_audio_mode(1);
+			break;
+		case OPTION_HID_DESCRIPTOR:
+			hid_descriptor_size = load_file(optarg, hid_descriptor, sizeof(hid_descriptor));
+			if (hid_descriptor_size <= 0) {
+				fprintf(stderr, "Unable to read a HID report descriptor of 1..%d bytes from %s\n", HID_DESCRIPTOR_MAX, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_HID_EVENTS:
+			option_hid_events = optarg;
+			break;
+		case OPTION_HID_REPORT_SIZE:
+			option_hid_report_size = atoi(optarg);
+			break;
+		case OPTION_HID_RATE:
+			option_hid_rate = atoi(optarg);
+			if (option_hid_rate < 1) {
+				fprintf(stderr, "Invalid HID rate: '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_CAPTURE:
+			option_capture = optarg;
+			break;
+		case OPTION_CAPTURE_SIZE:
+			option_capture_size = atoi(optarg);
+			if (option_capture_size < 1) {
+				fprintf(stderr, "Invalid capture file size: '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_REPLAY:
+			option_replay = optarg;
+			break;
+		case OPTION_REPLAY_SPEED:
+			option_replay_speed = optarg;
+			break;
+		case OPTION_REPLAY_TO:
+			option_replay_to = optarg;
+			break;
+		case OPTION_BENCH:
+			option_bench = 1;
+			break;
+		case OPTION_BENCH_SIZE:
+			option_bench_size = optarg;
+			break;
+		case OPTION_BENCH_RATE:
+			option_bench_rate = strtoul(optarg, NULL, 10);
+			break;
+		case OPTION_BENCH_COUNT:
+			option_bench_count = strtoul(optarg, NULL, 10);
+			if (option_bench_count == 0) {
+				fprintf(stderr, "Invalid benchmark packet count: '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_BENCH_DIRECTION:
+			option_bench_direction = optarg;
+			break;
+		case OPTION_METRICS:
+			option_metrics = optarg;
+			break;
+		case OPTION_METRICS_SOCKET:
+			option_metrics_socket = optarg;
+			break;
+		case OPTION_METRICS_INTERVAL:
+			option_metrics_interval = atoi(optarg);
+			if (option_metrics_interval < 1) {
+				fprintf(stderr, "Invalid metrics interval: '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_FRAME:
+			if (framer_parse(optarg, &option_frame) < 0) {
+				fprintf(stderr, "Invalid frame format: '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			// idle line framing is the --idle-gap one
+			if (option_frame.mode == FRAMER_IDLE)
+				option_idle_gap = option_frame.idle_gap_us > 0 ? strchr(optarg, ':') + 1 : "auto";
+			break;
+		case OPTION_COALESCE_DELAY:
+			option_coalesce_delay = strtoul(optarg, NULL, 10);
+			break;
+		case OPTION_COALESCE_SIZE:
+			option_coalesce_size = atoi(optarg);
+			if (option_coalesce_size < 1 || option_coalesce_size > ACCESSORY_MODE_BUFFER_SIZE) {
+				fprintf(stderr, "Invalid coalesce size: '%s' (1..%d)\n", optarg, ACCESSORY_MODE_BUFFER_SIZE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_COALESCE_ADAPTIVE:
+			option_coalesce_adaptive = 1;
+			break;
+		case OPTION_FLUSH_ON:
+			option_flush_byte_count = framer_parse_bytes(optarg, option_flush_bytes, FRAMER_DELIMITER_MAX);
+			if (option_flush_byte_count <= 0) {
+				fprintf(stderr, "Invalid flush bytes: '%s' (1..%d hex bytes)\n", optarg, FRAMER_DELIMITER_MAX);
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPTION_CHANNEL:
+			if (option_channel_count == MUX_CHANNELS_MAX) {
+				fprintf(stderr, "Too many channels, at most %d\n", MUX_CHANNELS_MAX);
+				return EXIT_FAILURE;
+			}
+			option_channels[option_channel_count++] = optarg;
+			break;
 		case 'h':
 			puts("Usage: uartaccessory [options]");
 			puts("Options:");
 			puts("  -h, --help               Display this information");
-			puts("  -p, --uart-port          Set the uart port. Example: use -p /dev/ttyUSB3 or simply port number -p 3. Default is /dev/ttyUSB0");
-			puts("  -b, --baud-rate          Set the baud rate. Example: use -b 57600. Standard values are permitted. Default is 115200");
+			puts("  -p, --uart-port          Set the uart port. Example: use -p /dev/ttyUSB3 or simply port number -p 3. 'pty' creates a pseudo terminal, unix:<path> or tcp:[address:]port (127.0.0.1 by default) listen for a program playing the device. Default is /dev/ttyUSB0");
+			puts("  -b, --baud-rate          Set the baud rate. Example: use -b 921600. Any rate supported by the adapter is permitted, also not standard ones like 250000. Default is 115200");
+			puts("  -f, --framing            Set data bits, parity (N, E, O, M, S) and stop bits. Example: use -f 7E1. Default is 8N1");
+			puts("      --rtscts             Enable RTS/CTS hardware flow control");
+			puts("      --low-latency        Set ASYNC_LOW_LATENCY and a 1 ms usb-serial (FTDI) latency timer, when supported");
 			puts("  -c, --closed-loop        Enable closed loop mode where accessory TX/RX are logically coupled and ttyUSBx disabled");
 			puts("  -n, --no-reply           Disable sending of RX data packets (reply to request)");
 			puts("  -j, --colors             Enable colors to show TX vs RX packets");
 			puts("  -q, --quiet              Quiet mode");
+			puts("      --usb-queue-depth    Set the number of USB IN transfers kept in flight. Default is 4");
+			puts("      --threaded           Run uart reads and writes in dedicated threads decoupled from USB by lock-free rings");
+			puts("      --ring-size          Set the size in bytes of each threaded mode ring. Default is 262144");
+			puts("      --idle-gap           Send uart data to USB as frames closed by an idle line gap. Example: --idle-gap 1750 (us) or --idle-gap auto for Modbus RTU t3.5");
+			puts("      --frame              Send uart data to USB as whole frames: raw, delim:<hex> (e.g. delim:0a, delim:0d0a), len:<1|2|4>[be|le][+n], slip, cobs or idle[:us]. Default is raw");
+			puts("      --coalesce-delay     Hold complete frames up to this many us, to send more of them in one USB transfer. Default is 0");
+			puts("      --coalesce-size      Send the held frames as soon as they reach this many bytes. Default is 16384");
+			puts("      --coalesce-adaptive  Tune the wait to the uart data rate, up to --coalesce-delay which must be given, and do not wait for sparse data");
+			puts("      --flush-on           Hex bytes sending the held frames at once, e.g. 0d0a for a CR or LF ending a command");
+			puts("      --device             Bridge only the phone selected by serial=XYZ, path=1-1.2 (bus-port.port) or id=18d1:4ee2 (VID:PID before the switch). 'loopback' echoes in process without USB. Default is any");
+			puts("      --identity           Set the accessory identity from a file of 'key = value' lines or a single key=value. Keys: manufacturer, model, description, version, uri, serial");
+			puts("      --audio              Ask the phone to route its audio output to the accessory (AOA v2)");
+			puts("      --hid-descriptor     Register a HID device with the report descriptor read from a file (AOA v2)");
+			puts("      --hid-events         Send the HID input reports read from a file or pipe, single accessory mode only");
+			puts("      --hid-report-size    Set the size in bytes of each HID input report");
+			puts("      --hid-rate           Set the maximum rate of HID input reports per second. Default is 100");
+			puts("      --map                Bridge many accessories from a file of '<path=1-1.2|serial=XYZ|id=vid:pid|any> <uart-port> [baud-rate] [framing]' lines");
+			puts("      --probe-cache        Keep the accessory probe results in a file, to skip probing known devices after a restart");
+			puts("      --capture            Record the forwarded data with timestamps to a pcapng file, readable by Wireshark");
+			puts("      --capture-size       Rotate the capture file when it reaches this size in MB");
+			puts("      --replay             Replay a capture file instead of bridging, then report throughput and latency");
+			puts("      --replay-speed       Scale the capture timing, 2 is twice as fast, 'max' as fast as possible. Default is 1");
+			puts("      --replay-to          Replay to the 'uart' what the accessory sent, to the 'accessory' what it received, or 'both'. Default is uart");
+			puts("      --bench              Benchmark the forwarding through a loopback accessory and a pseudo terminal, with the bridge options given");
+			puts("      --bench-size         Comma separated packet sizes of the benchmark runs, 1 to 16384 bytes. Default is 1,64,1024,16384");
+			puts("      --bench-rate         Packets per second in each direction. Default is 0, as fast as possible");
+			puts("      --bench-count        Packets per direction and run. Default is 10000");
+			puts("      --bench-direction    'usb-to-uart', 'uart-to-usb' or 'both'. Default is both");
+			puts("      --metrics            Keep traffic counters and latency histograms in a Prometheus text file, e.g. for the node exporter textfile collector");
+			puts("      --metrics-socket     Serve the same metrics to every client connecting to this unix socket");
+			puts("      --metrics-interval   Seconds between rewrites of the metrics file. Default is 10");
+			puts("      --channel            Multiplex this channel over the accessory, repeatable: <id>=<uart-port|pty|unix:path|tcp:[address:]port>[,baud-rate[,framing]] with id 1..255");
 			return EXIT_SUCCESS;
 		}
 	}
 
-	accessory_device *ad = NULL;
+	// the adaptive wait only ever shortens --coalesce-delay, alone it would never hold anything
+	if (option_coalesce_adaptive && option_coalesce_delay == 0) {
+		fputs("--coalesce-adaptive needs a maximum wait given by --coalesce-delay\n", stderr);
+		return EXIT_FAILURE;
+	}
+	// the idle gap already decides when uart data is sent, there is nothing left to coalesce
+	if (option_idle_gap != NULL && option_coalesce_delay > 0) {
+		fputs("--coalesce-delay cannot be used with --idle-gap or --frame idle\n", stderr);
+		return EXIT_FAILURE;
+	}
 
-	accessory_init();
+	bridge_opts.name = NULL;
+	bridge_opts.closed_loop = option_closed_loop;
+	bridge_opts.no_reply = option_no_reply;
+	bridge_opts.buffer_size = ACCESSORY_MODE_BUFFER_SIZE;
+	bridge_opts.usb_queue_depth = option_usb_queue_depth;
+	bridge_opts.threaded = option_threaded;
+	bridge_opts.ring_size = option_ring_size;
+	bridge_opts.framing = option_frame;
+	bridge_opts.coalesce_delay_us = option_coalesce_delay;
+	bridge_opts.coalesce_size = option_coalesce_size;
+	bridge_opts.coalesce_adaptive = option_coalesce_adaptive;
+	memcpy(bridge_opts.flush_bytes, option_flush_bytes, sizeof(option_flush_bytes));
+	bridge_opts.flush_byte_count = option_flush_byte_count;
+	unsigned int requested_baud = strtoul(option_baud, NULL, 10);
+	if (requested_baud == 0) {
+		fprintf(stderr, "Unrecognized baud rate: '%s'\n", option_baud);
+		return EXIT_FAILURE;
+	}
 
-	int need_quit = 0;
+	uart_config uart_cfg;
+	uart_config_init(&uart_cfg, requested_baud);
+	uart_cfg.rtscts = option_rtscts;
+	uart_cfg.low_latency = option_low_latency;
+	if (uart_parse_framing(option_framing, &uart_cfg) < 0) {
+		fprintf(stderr, "Unrecognized framing: '%s'\n", option_framing);
+		return EXIT_FAILURE;
+	}
 
-	while (need_quit == 0) {
-		puts("");
-		puts("Looking for accessory device... Press Q to quit");
-		while (1) {
-			int key = getasynckey();
-			if (key == 'Q' || key == 'q') {
-				need_quit = 1;
-				break;
+	// channels take the uart settings given so far as defaults
+	for (i = 0; i < option_channel_count; i++) {
+		int j;
+		if (mux_parse_channel(option_channels[i], &uart_cfg, &channel_configs[i]) < 0) {
+			fprintf(stderr, "Invalid channel: '%s'\n", option_channels[i]);
+			return EXIT_FAILURE;
+		}
+		for (j = 0; j < i; j++) {
+			if (channel_configs[j].id == channel_configs[i].id) {
+				fprintf(stderr, "Channel %d given twice\n", channel_configs[i].id);
+				return EXIT_FAILURE;
 			}
+		}
+	}
+	if (option_channel_count > 0 && (option_map != NULL || option_closed_loop)) {
+		fputs("Channels are available in single accessory mode only, without closed loop\n", stderr);
+		return EXIT_FAILURE;
+	}
 
-			ad = accessory_get_device();
-			if (ad != NULL) {
-				printf(" - Found Android device with ID=%04x:%04x now connected as ID=%04x:%04x, version %d\n", ad->vendor_id, ad->product_id, ad->aoa_vendor_id, ad->aoa_product_id, ad->aoa_version);
-				break;
-			}
-			usleep(500000);
+	// with "auto" the gap is computed for the baud rate of each pairing, the default one is for the benchmark
+	bridge_opts.idle_gap_us = 0;
+	if (option_idle_gap != NULL && strcmp(option_idle_gap, "auto") != 0)
+		bridge_opts.idle_gap_us = atoi(option_idle_gap);
+	else if (option_idle_gap != NULL)
+		bridge_opts.idle_gap_us = uart_frame_gap_us(uart_cfg.baud_rate);
+	if (option_replay != NULL)
+		return replay_run(&uart_cfg);
+	if (option_bench)
+		return bench_main(&uart_cfg);
+
+	bridge_opts.trace = NULL;
+	bridge_opts.metrics = NULL;
+	if (option_quiet == 0) {
+		// formatted and written by a logging thread, so a slow terminal never slows down forwarding
+		if (trace_start(STDOUT_FILENO, option_colors) < 0) {
+			fputs("Unable to start the trace thread\n", stderr);
+			exit_code = EXIT_FAILURE;
+			goto out;
 		}
-		if (need_quit != 0)
-			break;
+	}
+	if (option_capture != NULL && capture_start(option_capture, (uint64_t) option_capture_size * 1024 * 1024) < 0) {
+		perror(option_capture);
+		exit_code = EXIT_FAILURE;
+		goto out;
+	}
+	if (option_quiet == 0 || option_capture != NULL)
+		bridge_opts.trace = bridge_traffic;
 
-		puts("");
-		puts("Capture and show data flow coming from Android device... Press Q to quit");
+	if (option_map != NULL) {
+		pairing_count = pairing_load(option_map, &uart_cfg, &pairings);
+		if (pairing_count < 0) {
+			perror(option_map);
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+		if (pairing_count == 0) {
+			fprintf(stderr, "No pairings in %s\n", option_map);
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+	} else {
+		// single accessory bridged to the uart given with -p
+		pairings = calloc(1, sizeof(pairing));
+		pairing_count = 1;
+		if (accessory_selector_parse(option_device, &pairings[0].selector) < 0) {
+			fprintf(stderr, "Invalid device selector: '%s'\n", option_device);
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+		pairings[0].uart = uart_cfg;
+		pairing_set_uart_device(&pairings[0], option_port);
+	}
 
-		unsigned char *buffer = malloc(ACCESSORY_MODE_BUFFER_SIZE);
-		if (buffer == NULL)
-			return EXIT_FAILURE;
+	if (option_hid_events != NULL) {
+		if (hid_descriptor_size == 0 || option_hid_report_size <= 0) {
+			fputs("HID events need --hid-descriptor and --hid-report-size\n", stderr);
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+		if (option_map != NULL) {
+			fputs("HID events are available in single accessory mode only\n", stderr);
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+	}
 
-		if (option_closed_loop == 0) {
+	if (option_probe_cache != NULL && probe_cache_open(option_probe_cache) < 0) {
+		perror(option_probe_cache);
+		exit_code = EXIT_FAILURE;
+		goto out;
+	}
 
-			char device_name[256];
-			if (option_port[0] == '/')
-				strcpy(device_name, option_port);
-			else {
-				strcpy(device_name, "/dev/ttyUSB");
-				strcpy(&device_name[11], option_port);
-			}
+	if (evloop_init() < 0 || accessory_init() < 0 || accessory_attach_event_loop() < 0) {
+		fputs("Unable to initialize USB event handling\n", stderr);
+		exit_code = EXIT_FAILURE;
+		goto out;
+	}
 
-			int i;
-			speed_t baud_rate = B0;
-			int requested_baud = atoi(option_baud);
-			for (i = 0; i < ARRAY_LEN(baud_table); i++) {
-				if (baud_table[i].baud_rate == requested_baud) {
-					baud_rate = baud_table[i].speed;
-					break;
-				}
-			}
-			if (baud_rate == B0) {
-				fprintf(stderr, "Unrecognized baud rate: '%s'\n", option_baud);
-				exit(1);
-			}
+	if (option_metrics != NULL || option_metrics_socket != NULL) {
+		for (i = 0; i < pairing_count; i++) {
+			// the name of a mapped pairing is "[selector] ", a single pairing is labelled by its selector
+			const char *name = pairings[i].name;
+			char label[sizeof(pairings[i].name)];
+			if (name[0] == '[')
+				snprintf(label, sizeof(label), "%.*s", (int) strlen(name) - 3, name + 1);
+			else
+				snprintf(label, sizeof(label), "%s", option_device);
+			metrics_register(&pairings[i].metrics, label);
+		}
+		if (metrics_start(option_metrics, option_metrics_socket, option_metrics_interval * 1000) < 0) {
+			perror(option_metrics_socket != NULL ? option_metrics_socket : option_metrics);
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+	}
 
-			if (uart_open(device_name, baud_rate, 0) < 0) {
-				char message[256];
-				snprintf(message, sizeof message, "Unable to open serial port %s", device_name);
-				perror(message);
-				return EXIT_FAILURE;
+	// pseudo terminals and sockets live as long as the program, so the one on the other side keeps the same
+	// name to open or path to connect to, and stays connected while phones come and go
+	if (option_closed_loop == 0 && option_channel_count == 0) {
+		for (i = 0; i < pairing_count; i++) {
+			if (uart_is_virtual(pairings[i].uart_device) && pairing_open_port(&pairings[i]) < 0) {
+				exit_code = EXIT_FAILURE;
+				goto out;
 			}
 		}
+	}
+	for (i = 0; i < option_channel_count; i++) {
+		if (uart_is_virtual(channel_configs[i].device) && channel_open_port(&pairings[0], &channel_configs[i]) < 0) {
+			exit_code = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	// one event loop serves every pairing, without hotplug events a timer drives the device scan
+	scan_timer_fd = evloop_timer_create();
+	if (scan_timer_fd < 0 || evloop_add(scan_timer_fd, EPOLLIN, scan_timer_expired, NULL) < 0) {
+		fputs("Unable to create the device scan timer\n", stderr);
+		exit_code = EXIT_FAILURE;
+		goto out;
+	}
+
+	// with hotplug events a full enumeration is needed only at start and when a pairing becomes free again
+	hotplug = accessory_enable_hotplug(device_arrived, NULL) == 0;
+	if (!hotplug)
+		puts("USB hotplug events not available, polling for devices");
+
+	console_set_raw_mode(1);
+	atexit(console_restore);
+	evloop_add(fileno(stdin), EPOLLIN, console_ready, NULL);
+
+	puts("");
+	puts("Looking for accessory device... Press Q to quit");
+
+	while (need_quit == 0) {
+		if (need_scan) {
+			need_scan = 0;
+			need_arrival_scan = 0;
+			pairings_scan(1);
+		} else if (need_arrival_scan) {
+			need_arrival_scan = 0;
+			pairings_scan(0);
+		}
+
+		if (evloop_run_once(accessory_get_next_timeout(-1)) == 0)
+			accessory_handle_events();
+
+		pairings_reap();
+	}
+
+out:
+	for (i = 0; i < pairing_count; i++) {
+		if (pairings[i].bridge != NULL) {
+			bridge_stop(pairings[i].bridge);
+			pairing_finish(&pairings[i]);
+		} else if (pairings[i].mux != NULL) {
+			mux_stop(pairings[i].mux);
+			pairing_finish(&pairings[i]);
+		}
+	}
+	for (i = 0; i < pairing_count; i++)
+		pairing_close_ports(&pairings[i], 1);
+	// bridges are gone, trace and capture keep pointers to pairing names until stopped
+	trace_stop();
+	capture_stop();
+	metrics_stop();
+	free(pairings);
+
+	if (scan_timer_fd >= 0) {
+		evloop_remove(scan_timer_fd);
+		close(scan_timer_fd);
+	}
+	accessory_detach_event_loop();
+	accessory_finalize();
+	evloop_finalize();
+	probe_cache_close();
+
+	return exit_code;
+}
+
+static void scan_timer_expired(int fd, uint32_t events, void *user_data) {
+	evloop_timer_ack(fd);
+	need_scan = 1;
+}
+
+static void device_arrived(void *user_data) {
+	need_arrival_scan = 1;
+}
+
+/**
+ * take a candidate only when a pairing waiting for an accessory selects it; the phones already bridged are
+ * reported too, but their port path is in use
+ */
+static int pairing_accept(const accessory_device *candidate, void *user_data) {
+	int i;
+
+	for (i = 0; i < pairing_count; i++) {
+		if (pairings[i].ad != NULL && strcmp(pairings[i].ad->port_path, candidate->port_path) == 0)
+			return 0;
+	}
+	for (i = 0; i < pairing_count; i++) {
+		if (pairings[i].ad != NULL || !pairing_matches(&pairings[i], candidate))
+			continue;
+		// a phone switching to accessory mode is on its way to this pairing, do not switch a second one
+		if (accessory_switch_pending(pairing_selects, &pairings[i])) {
+			deferred_scan = 1;
+			continue;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static int pairing_selects(const accessory_device *candidate, void *user_data) {
+	return pairing_matches(user_data, candidate);
+}
+
+/**
+ * switch to accessory mode and bridge every new device selected by a waiting pairing, the first one in file
+ * order taking it. Only the devices just plugged in are looked at unless full is set.
+ */
+static void pairings_scan(int full) {
+	accessory_device *ad;
+	int i, waiting = 0;
 
-		while (1) {
-			int key = getasynckey();
-			if (key == 'Q' || key == 'q') {
+	// loopback pairings need no USB device
+	for (i = 0; i < pairing_count; i++) {
+		if (pairings[i].ad != NULL || !pairings[i].selector.loopback)
+			continue;
+		ad = accessory_loopback_open(ACCESSORY_LOOPBACK_ECHO);
+		if (ad == NULL || pairing_start(&pairings[i], ad) < 0) {
+			accessory_free_device(ad);
+			if (option_map == NULL) {
 				need_quit = 1;
-				break;
+				exit_code = EXIT_FAILURE;
+				return;
 			}
+		}
+	}
 
-			int cnt = accessory_receive_data(ad, buffer, ACCESSORY_MODE_BUFFER_SIZE);
-			if (cnt > 0) {
-				print_buffer(buffer, cnt, 0);
-				if (option_closed_loop == 0)
-					uart_send_buffer(buffer, cnt);
-				else
-				if (option_no_reply == 0) {
-					accessory_send_data(ad, buffer, cnt);
-					print_buffer(buffer, cnt, 1);
-				}
-			} else if (cnt == LIBUSB_ERROR_NO_DEVICE) {
-				puts("AOA device disconnected !");
+	while (1) {
+		if (full)
+			ad = accessory_get_device_matching(pairing_accept, NULL);
+		else
+			ad = accessory_get_arrived_device(pairing_accept, NULL);
+		if (ad == NULL)
+			break;
+
+		for (i = 0; i < pairing_count; i++) {
+			if (pairings[i].ad == NULL && pairing_matches(&pairings[i], ad))
 				break;
+		}
+		if (i == pairing_count || pairing_start(&pairings[i], ad) < 0) {
+			accessory_free_device(ad);
+			if (option_map == NULL) {
+				need_quit = 1;
+				exit_code = EXIT_FAILURE;
 			}
+			break;
+		}
+	}
 
-			if (option_no_reply == 0 && option_closed_loop == 0) {
-				cnt = uart_receive_buffer_timout(buffer, ACCESSORY_MODE_BUFFER_SIZE, 0);
-				if (cnt > 0) {
-					accessory_send_data(ad, buffer, cnt);
-					print_buffer(buffer, cnt, 1);
-				}
+	// the phones put off are looked at again once no switch is pending, whatever its outcome
+	if (deferred_scan && !accessory_switch_pending(NULL, NULL)) {
+		deferred_scan = 0;
+		need_scan = 1;
+	}
+
+	if (hotplug)
+		return;
+
+	// no hotplug events: poll the bus while some pairing waits for its accessory
+	for (i = 0; i < pairing_count; i++) {
+		if (pairings[i].ad == NULL)
+			waiting++;
+	}
+	evloop_timer_arm(scan_timer_fd, waiting > 0 ? SCAN_INTERVAL_US : 0, waiting > 0 ? SCAN_INTERVAL_US : 0);
+}
+
+/**
+ * tear down the pairings whose bridge stopped, a disconnected accessory is looked for again
+ */
+static void pairings_reap() {
+	int i;
+
+	for (i = 0; i < pairing_count; i++) {
+		pairing *p = &pairings[i];
+
+		if (p->bridge != NULL ? bridge_get_state(p->bridge) == BRIDGE_RUNNING : p->mux == NULL || mux_get_state(p->mux) == BRIDGE_RUNNING)
+			continue;
+
+		int result = pairing_finish(p);
+		if (result == BRIDGE_DISCONNECTED)
+			printf("%sAOA device disconnected !\n", p->name);
+		else if (result == BRIDGE_ERROR) {
+			fprintf(stderr, "%sData forwarding stopped on error\n", p->name);
+			// a single bridge quits as always, with a map the others keep running
+			if (option_map == NULL)
+				need_quit = 1;
+		}
+
+		if (need_quit == 0 && option_map == NULL) {
+			puts("");
+			puts("Looking for accessory device... Press Q to quit");
+		}
+		need_scan = 1;
+	}
+}
+
+static int pairing_start(pairing *p, accessory_device *ad) {
+	int i;
+
+	printf(" - %sFound Android device with ID=%04x:%04x at %s now connected as ID=%04x:%04x, version %d\n", p->name, ad->vendor_id, ad->product_id, ad->port_path, ad->aoa_vendor_id, ad->aoa_product_id, ad->aoa_version);
+	if (ad->setup_timings.total_us > 0)
+		printf(" - %sAccessory mode switch in %.1f ms: protocol %.1f, strings %.1f, start %.1f, re-enumeration %.1f, claim %.1f\n", p->name,
+				ad->setup_timings.total_us / 1000.0, ad->setup_timings.protocol_us / 1000.0, ad->setup_timings.strings_us / 1000.0,
+				ad->setup_timings.start_us / 1000.0, ad->setup_timings.reenumeration_us / 1000.0, ad->setup_timings.claim_us / 1000.0);
+
+	// pseudo terminals and sockets are already open, since startup
+	if (option_closed_loop == 0 && option_channel_count == 0 && p->port == NULL && pairing_open_port(p) < 0)
+		return -1;
+	for (i = 0; i < option_channel_count; i++) {
+		if (channel_configs[i].port == NULL && channel_open_port(p, &channel_configs[i]) < 0) {
+			pairing_close_ports(p, 0);
+			return -1;
+		}
+	}
+
+	bridge_options options = bridge_opts;
+	options.name = p->name;
+	if (option_metrics != NULL || option_metrics_socket != NULL)
+		options.metrics = &p->metrics;
+	if (option_idle_gap != NULL && strcmp(option_idle_gap, "auto") == 0)
+		options.idle_gap_us = uart_frame_gap_us(p->uart.baud_rate);
+
+	if (option_channel_count > 0) {
+		// the channels replace the uart given with -p
+		p->mux = mux_start(ad, channel_configs, option_channel_count, &options);
+		if (p->mux == NULL || mux_get_state(p->mux) != BRIDGE_RUNNING) {
+			fprintf(stderr, "%sUnable to start data forwarding\n", p->name);
+			if (p->mux != NULL)
+				mux_destroy(p->mux);
+			p->mux = NULL;
+			pairing_close_ports(p, 0);
+			return -1;
+		}
+	} else
+		p->bridge = bridge_start(ad, p->port, &options);
+	if (p->bridge == NULL && p->mux == NULL) {
+		fprintf(stderr, "%sUnable to start data forwarding\n", p->name);
+		pairing_close_ports(p, 0);
+		return -1;
+	}
+	p->ad = ad;
+	if (p->sessions++ > 0)
+		metrics_add(&p->metrics.reconnects, 1);
+
+	if (hid_descriptor_size > 0) {
+		int r = accessory_register_hid(ad, HID_ID, hid_descriptor, hid_descriptor_size);
+		if (r < 0)
+			fprintf(stderr, "%sUnable to register the HID device: %s\n", p->name, libusb_error_name(r));
+		else {
+			p->hid_registered = 1;
+			if (option_hid_events != NULL) {
+				p->hid = hid_stream_start(ad, HID_ID, option_hid_events, option_hid_report_size, option_hid_rate);
+				if (p->hid == NULL)
+					perror(option_hid_events);
 			}
 		}
-		free(buffer);
 	}
 
-	accessory_free_device(ad);
-	accessory_finalize();
-	uart_close();
+	if (option_map == NULL) {
+		puts("");
+		puts("Capture and show data flow coming from Android device... Press Q to quit");
+	}
 
-	return EXIT_SUCCESS;
+	return 0;
 }
 
-#define COLOR_RED      "\e[31m"
-#define COLOR_BLUE     "\e[34m"
-#define COLOR_GREEN    "\e[32m"
-#define COLOR_RESET    "\033[0m"
+/**
+ * open the uart of a pairing and tell how it was set up. Returns -1 on error
+ */
+static int pairing_open_port(pairing *p) {
+	p->port = uart_open(p->uart_device, &p->uart);
+	if (p->port == NULL) {
+		char message[512];
+		snprintf(message, sizeof message, "%sUnable to open serial port %s at %u baud", p->name, p->uart_device, p->uart.baud_rate);
+		perror(message);
+		return -1;
+	}
+	unsigned int baud_rate = uart_get_baud_rate(p->port);
+	if (uart_get_listen_fd(p->port) >= 0)
+		printf(" - %sListening on %s for the program playing the target device\n", p->name, p->uart_device);
+	else {
+		printf(" - %sSerial port %s opened at %u baud", p->name, p->uart_device, baud_rate);
+		if (baud_rate != p->uart.baud_rate)
+			printf(" (requested %u)", p->uart.baud_rate);
+		printf(", %d%c%d%s\n", p->uart.data_bits, p->uart.parity, p->uart.stop_bits, p->uart.rtscts ? " RTS/CTS" : "");
+	}
+	if (uart_get_peer_name(p->port) != NULL)
+		printf(" - %sPseudo terminal, connect to %s\n", p->name, uart_get_peer_name(p->port));
+	if (option_low_latency && uart_get_listen_fd(p->port) < 0)
+		printf(" - %sLow latency: ASYNC_LOW_LATENCY %s, latency timer %s\n", p->name,
+				(uart_get_low_latency(p->port) & UART_LOW_LATENCY_ASYNC) ? "set" : "not supported",
+				(uart_get_low_latency(p->port) & UART_LOW_LATENCY_TIMER) ? "1 ms" : "not present");
+
+	return 0;
+}
+
+/**
+ * destroy the bridge or the multiplexer then release accessory and port. Returns the final bridge state
+ */
+static int pairing_finish(pairing *p) {
+	hid_stream_stop(p->hid);
+	p->hid = NULL;
+
+	int result = p->mux != NULL ? mux_destroy(p->mux) : bridge_destroy(p->bridge);
+
+	p->bridge = NULL;
+	p->mux = NULL;
+	if (p->hid_registered)
+		accessory_unregister_hid(p->ad, HID_ID);
+	p->hid_registered = 0;
+	accessory_free_device(p->ad);
+	p->ad = NULL;
+	pairing_close_ports(p, 0);
+
+	return result;
+}
 
-static void print_buffer(unsigned char *buffer, int size, int type) {
+/**
+ * open the port of a multiplexed channel and tell how it was set up. Returns -1 on error
+ */
+static int channel_open_port(pairing *p, mux_channel_config *config) {
+	config->port = uart_open(config->device, &config->uart);
+	if (config->port == NULL) {
+		char message[512];
+		snprintf(message, sizeof message, "%s%sUnable to open serial port %s at %u baud", p->name, config->name, config->device, config->uart.baud_rate);
+		perror(message);
+		return -1;
+	}
+	if (uart_get_listen_fd(config->port) >= 0)
+		printf(" - %s%sListening on %s\n", p->name, config->name, config->device);
+	else
+		printf(" - %s%sSerial port %s opened at %u baud\n", p->name, config->name, config->device, uart_get_baud_rate(config->port));
+	if (uart_get_peer_name(config->port) != NULL)
+		printf(" - %s%sPseudo terminal, connect to %s\n", p->name, config->name, uart_get_peer_name(config->port));
+
+	return 0;
+}
+
+/**
+ * close the serial ports of a pairing and of its channels. The program on a pseudo terminal or socket stays
+ * connected for the next accessory session, unless all is set.
+ */
+static void pairing_close_ports(pairing *p, int all) {
 	int i;
 
-	if (option_quiet)
-		return;
+	if (p->port != NULL && (all || !uart_is_virtual(p->uart_device))) {
+		uart_close(p->port);
+		p->port = NULL;
+	}
+	// channels are available with a single pairing only
+	for (i = 0; i < option_channel_count; i++) {
+		if (channel_configs[i].port != NULL && (all || !uart_is_virtual(channel_configs[i].device))) {
+			uart_close(channel_configs[i].port);
+			channel_configs[i].port = NULL;
+		}
+	}
+}
+
+/**
+ * read a whole file of up to size bytes. Returns the bytes read, -1 on error or if the file is larger
+ */
+static int load_file(const char *file_name, unsigned char *buffer, int size) {
+	FILE *file = fopen(file_name, "rb");
+	int cnt;
+
+	if (file == NULL)
+		return -1;
+
+	cnt = fread(buffer, 1, size, file);
+	if (ferror(file) || fgetc(file) != EOF)
+		cnt = -1;
+	fclose(file);
+
+	return cnt;
+}
 
-	if (option_colors) {
-		if (type == 0)
-			printf(COLOR_BLUE);
+static int replay_accept(const accessory_device *candidate, void *user_data) {
+	return accessory_selector_matches(user_data, candidate);
+}
+
+/**
+ * replay mode: no bridge, the capture is sent to the uart given with -p and/or to the selected accessory
+ */
+static int replay_run(const uart_config *uart_cfg) {
+	accessory_selector selector;
+	replay_report report;
+	uart_port *port = NULL;
+	accessory_device *ad = NULL;
+	double speed = 0;
+	int result = EXIT_FAILURE;
+
+	int to_uart = strcmp(option_replay_to, "uart") == 0 || strcmp(option_replay_to, "both") == 0;
+	int to_accessory = strcmp(option_replay_to, "accessory") == 0 || strcmp(option_replay_to, "both") == 0;
+	if (!to_uart && !to_accessory) {
+		fprintf(stderr, "Invalid replay target: '%s'\n", option_replay_to);
+		return EXIT_FAILURE;
+	}
+	if (strcmp(option_replay_speed, "max") != 0) {
+		speed = atof(option_replay_speed);
+		if (speed <= 0) {
+			fprintf(stderr, "Invalid replay speed: '%s'\n", option_replay_speed);
+			return EXIT_FAILURE;
+		}
+	}
+	if (to_accessory && accessory_selector_parse(option_device, &selector) < 0) {
+		fprintf(stderr, "Invalid device selector: '%s'\n", option_device);
+		return EXIT_FAILURE;
+	}
+
+	replay *r = replay_open(option_replay);
+	if (r == NULL) {
+		if (errno == EBADMSG)
+			fprintf(stderr, "%s: not a capture file or corrupted\n", option_replay);
 		else
-			printf(COLOR_RED);
+			perror(option_replay);
+		return EXIT_FAILURE;
+	}
+	printf("Replaying %d packets from %s\n", replay_get_packet_count(r), option_replay);
+
+	if (to_uart) {
+		port = uart_open(option_port, uart_cfg);
+		if (port == NULL) {
+			perror(option_port);
+			goto out;
+		}
+		if (uart_get_listen_fd(port) >= 0) {
+			fputs("Replay needs a serial port or a pseudo terminal\n", stderr);
+			goto out;
+		}
+	}
+
+	if (evloop_init() < 0 || (to_accessory && accessory_init() < 0)) {
+		fputs("Unable to initialize event handling\n", stderr);
+		goto out;
+	}
+	if (to_accessory) {
+		ad = accessory_get_device_matching(replay_accept, &selector);
+		if (ad == NULL) {
+			fputs("No accessory device found\n", stderr);
+			goto out;
+		}
+	}
+
+	console_set_raw_mode(1);
+	atexit(console_restore);
+	evloop_add(fileno(stdin), EPOLLIN, console_ready, NULL);
+	evloop_add(replay_get_done_fd(r), EPOLLIN, replay_done, NULL);
+
+	if (replay_start(r, port, ad, speed) < 0) {
+		fputs("Unable to start the replay thread\n", stderr);
+		goto out;
+	}
+	puts("Press Q to stop");
+	while (need_quit == 0)
+		evloop_run_once(-1);
+	replay_stop(r);
+
+	replay_get_report(r, &report);
+	double seconds = report.elapsed_ns / 1e9;
+	printf("Replayed %lu packets, %llu bytes in %.3f s: %.2f MB/s, %.0f packets/s, %lu errors\n", report.packets, report.bytes,
+			seconds, seconds > 0 ? report.bytes / seconds / 1e6 : 0, seconds > 0 ? report.packets / seconds : 0, report.errors);
+	printf("Send time p50 %.1f us, p99 %.1f us, max %.1f us\n", report.send_p50_ns / 1e3, report.send_p99_ns / 1e3, report.send_max_ns / 1e3);
+	if (speed > 0)
+		printf("Late on capture timing p50 %.1f us, p99 %.1f us, max %.1f us\n", report.late_p50_ns / 1e3, report.late_p99_ns / 1e3, report.late_max_ns / 1e3);
+	result = report.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+out:
+	replay_close(r);
+	accessory_free_device(ad);
+	uart_close(port);
+	if (to_accessory)
+		accessory_finalize();
+	evloop_finalize();
+
+	return result;
+}
+
+/**
+ * benchmark mode: one run per packet size, through the same forwarding code as a phone would use
+ */
+static int bench_main(const uart_config *uart_cfg) {
+	bench_config config;
+	bench_result result;
+	char sizes[256];
+	int exit_status = EXIT_SUCCESS;
+
+	config.rate = option_bench_rate;
+	config.count = option_bench_count;
+	if (strcmp(option_bench_direction, "usb-to-uart") == 0)
+		config.directions = BENCH_USB_TO_UART;
+	else if (strcmp(option_bench_direction, "uart-to-usb") == 0)
+		config.directions = BENCH_UART_TO_USB;
+	else if (strcmp(option_bench_direction, "both") == 0)
+		config.directions = BENCH_USB_TO_UART | BENCH_UART_TO_USB;
+	else {
+		fprintf(stderr, "Invalid benchmark direction: '%s'\n", option_bench_direction);
+		return EXIT_FAILURE;
 	}
-	for (i = 0; i < size; i++) {
-		if (type == 0)
-			printf("%02X ", buffer[i]);
+
+	if (evloop_init() < 0) {
+		fputs("Unable to initialize event handling\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	bridge_options options = bridge_opts;
+	options.name = "[bench] ";
+	snprintf(sizes, sizeof(sizes), "%s", option_bench_size);
+	char *size;
+	for (size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ",")) {
+		config.packet_size = atoi(size);
+		if (config.packet_size < 1 || config.packet_size > BENCH_MAX_PACKET_SIZE) {
+			fprintf(stderr, "Invalid benchmark packet size: '%s' (1..%d)\n", size, BENCH_MAX_PACKET_SIZE);
+			exit_status = EXIT_FAILURE;
+			break;
+		}
+
+		printf("\n%lu packets of %d bytes per direction, ", config.count, config.packet_size);
+		if (config.rate > 0)
+			printf("%u packets/s\n", config.rate);
 		else
-			printf("%02X ", buffer[i]);
+			printf("as fast as possible\n");
+		fflush(stdout);
+
+		if (bench_run(&config, uart_cfg, &options, &result) < 0) {
+			perror("Unable to set up the benchmark");
+			exit_status = EXIT_FAILURE;
+			break;
+		}
+
+		if (config.directions & BENCH_USB_TO_UART)
+			bench_print_flow("USB->UART", &result.flows[0]);
+		if (config.directions & BENCH_UART_TO_USB)
+			bench_print_flow("UART->USB", &result.flows[1]);
+		unsigned long long bytes = result.flows[0].bytes + result.flows[1].bytes;
+		if (bytes > 0)
+			printf(" CPU %.3f ms per MB forwarded\n", result.forwarding_cpu_ns / 1e6 / (bytes / 1e6));
+
+		if (result.stalled || result.bridge_state != BRIDGE_RUNNING || result.flows[0].corrupted_bytes > 0 || result.flows[1].corrupted_bytes > 0) {
+			fprintf(stderr, "Benchmark failed:%s%s%s\n", result.stalled ? " data stopped flowing" : "",
+					result.bridge_state != BRIDGE_RUNNING ? " bridge stopped" : "",
+					result.flows[0].corrupted_bytes + result.flows[1].corrupted_bytes > 0 ? " corrupted data" : "");
+			exit_status = EXIT_FAILURE;
+		}
 	}
-	if (option_colors)
-		printf(COLOR_RESET "\n");
 
-	fflush(stdout);
+	evloop_finalize();
+
+	return exit_status;
+}
+
+static void bench_print_flow(const char *name, const bench_flow_result *flow) {
+	double seconds = flow->elapsed_ns / 1e9;
+
+	printf(" %s: %lu packets, %.2f MB in %.3f s: %.2f MB/s, %.0f packets/s, latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+			name, flow->packets, flow->bytes / 1e6, seconds, seconds > 0 ? flow->bytes / seconds / 1e6 : 0, seconds > 0 ? flow->packets / seconds : 0,
+			flow->latency_p50_ns / 1e3, flow->latency_p99_ns / 1e3, flow->latency_p999_ns / 1e3, flow->latency_max_ns / 1e3);
+	if (flow->corrupted_bytes > 0)
+		printf(" %s: %llu corrupted bytes\n", name, flow->corrupted_bytes);
+}
+
+static void replay_done(int fd, uint32_t events, void *user_data) {
+	eventfd_t value;
+
+	eventfd_read(fd, &value);
+	need_quit = 1;
+}
+
+/**
+ * traffic of every bridge, both only queue the packet for their own thread
+ */
+static void bridge_traffic(const char *name, const unsigned char *buffer, int size, int type) {
+	trace_packet(name, buffer, size, type);
+	capture_packet(name, buffer, size, type);
+}
+
+static void console_ready(int fd, uint32_t events, void *user_data) {
+	unsigned char key;
+
+	ssize_t cnt = read(fd, &key, 1);
+	if (cnt == 0 || (cnt < 0 && errno != EAGAIN && errno != EINTR)) {
+		// stdin closed (running headless), stop watching it
+		evloop_remove(fd);
+		return;
+	}
+
+	if (cnt == 1 && (key == 'Q' || key == 'q'))
+		need_quit = 1;
+}
+
+static void console_restore() {
+	console_set_raw_mode(0);
 }